@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Compare how many lines per second the shell executes in each input mode.
+#
+# Usage: bench/batch_mode.sh [path/to/shell] [lines]
+#
+# A piped stdin is slower than the other modes on purpose: the shell only reads it up to the end
+# of each line, so commands that read the same stdin get the rest. With 20000 lines expect about
+# 20k lines/s interactive, 130-145k for stdin and script, and about 100k for a pipe.
+
+set -e
+
+SHELL_BIN=${1:-./build/shell}
+LINES=${2:-20000}
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+# Builtins only, so we measure the shell itself and not process creation
+SCRIPT="$WORKDIR/script.sh"
+i=0
+while [ "$i" -lt "$LINES" ]; do
+	echo "echo 'line' \"$i\" with\\ some   quoting"
+	echo "type echo"
+	i=$((i + 2))
+done > "$SCRIPT"
+
+now() {
+	date +%s%N
+}
+
+run() {
+	mode=$1
+	lines=$2
+	shift 2
+	start=$(now)
+	"$@" > /dev/null
+	end=$(now)
+	elapsed=$((end - start))
+	echo "$mode $lines $elapsed" | awk '{ printf "%-12s %8d lines %8.3f s %12.0f lines/s\n", $1, $2, $3 / 1e9, $2 / ($3 / 1e9) }'
+}
+
+run interactive "$LINES" sh -c "\"$SHELL_BIN\" -i < \"$SCRIPT\""
+run stdin "$LINES" sh -c "\"$SHELL_BIN\" < \"$SCRIPT\""
+run pipe "$LINES" sh -c "cat \"$SCRIPT\" | \"$SHELL_BIN\""
+run script "$LINES" "$SHELL_BIN" "$SCRIPT"
+# A single argument is limited to 128 KiB, so -c only gets the start of the script
+COMMAND_LINES=$((LINES < 2000 ? LINES : 2000))
+run command "$COMMAND_LINES" "$SHELL_BIN" -c "$(head -n "$COMMAND_LINES" "$SCRIPT")"
@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+"""Measure startup time and peak memory of the interactive shell with a large HISTFILE.
+
+Usage: bench/history_startup.py [path/to/shell] [history lines] [runs]
+"""
+
+import os
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def run_once(shell, env, commands):
+    before = resource.getrusage(resource.RUSAGE_CHILDREN)
+    start = time.perf_counter()
+    subprocess.run([shell, "-i"], input=commands, env=env, stdout=subprocess.DEVNULL, check=False)
+    elapsed = time.perf_counter() - start
+    after = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return elapsed, max(before.ru_maxrss, after.ru_maxrss)
+
+
+def main():
+    shell = sys.argv[1] if len(sys.argv) > 1 else "./build/shell"
+    lines = int(sys.argv[2]) if len(sys.argv) > 2 else 1_000_000
+    runs = int(sys.argv[3]) if len(sys.argv) > 3 else 5
+
+    with tempfile.TemporaryDirectory() as workdir:
+        source = os.path.join(workdir, "source_history")
+        with open(source, "w") as history:
+            for i in range(lines):
+                history.write(f"git commit -m 'change number {i}' --author someone\n")
+
+        # Every run gets a fresh copy, because exiting trims the file to HISTFILESIZE
+        scenarios = [
+            ("startup+exit", b"exit\n"),
+            ("history 10", b"history 10\nexit\n"),
+        ]
+        for name, commands in scenarios:
+            times = []
+            peak = 0
+            for _ in range(runs):
+                histfile = os.path.join(workdir, "history")
+                shutil.copyfile(source, histfile)
+                env = dict(os.environ, HISTFILE=histfile)
+                elapsed, rss = run_once(shell, env, commands)
+                times.append(elapsed)
+                peak = max(peak, rss)
+            times.sort()
+            print(f"{name:<14} {lines} lines  median {times[len(times) // 2] * 1000:8.2f} ms  max RSS {peak / 1024:8.1f} MiB")
+
+
+if __name__ == "__main__":
+    main()
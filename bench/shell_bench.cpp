@@ -0,0 +1,307 @@
+// Benchmarks of the shell's hot paths, results are printed as JSON
+//
+// Usage: shell_bench [scale]
+//
+// scale multiplies the iteration counts, e.g. 0.1 for a quick run. Every benchmark reports the
+// time and the number of heap allocations per operation, benchmarks that move data also their throughput:
+//
+//   {"benchmarks": [{"name": "parse", "iterations": 1200000, "ns_per_op": 180.2, "allocs_per_op": 0.000}, ...]}
+//   {"name": "pipeline_3_throughput", ..., "mb_per_s": 2650.4}
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <new>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "../src/shell.hpp"
+
+// Count every heap allocation made while a benchmark runs, threads of the shell included
+static std::atomic<size_t> allocationCount = 0;
+
+void* operator new(std::size_t size) {
+	++allocationCount;
+	if (void* memory = std::malloc(size ? size : 1)) {
+		return memory;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+	std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+	std::free(memory);
+}
+
+struct Result {
+	std::string name;
+	size_t iterations;
+	double nsPerOp;
+	double allocsPerOp;
+	double mbPerSecond;
+};
+
+std::vector<Result> results;
+double scale = 1.0;
+
+// Run body `iterations` times (scaled, at least once) and record the time and allocations per run
+// bytesPerOp is the amount of data one run moves, if it moves any
+template <typename Body>
+void benchmark(const char* name, size_t iterations, Body body, size_t bytesPerOp = 0) {
+	iterations = std::max<size_t>(1, iterations * scale);
+	body(); // Warm up caches and lazily built tables
+
+	allocationCount = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < iterations; ++i) {
+		body();
+	}
+	double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	double mbPerSecond = bytesPerOp * 1e3 / (elapsed / iterations);
+	results.push_back({name, iterations, elapsed / iterations, static_cast<double>(allocationCount.load()) / iterations, mbPerSecond});
+}
+
+// Parse a line that has to be valid, the tree points into both the line and the arena
+const CommandList& parse(std::string_view line, ParseArena& arena) {
+	std::string error;
+	const CommandList* list = parseLine(line, arena, error);
+	if (!list) {
+		std::fprintf(stderr, "shell_bench: %.*s: %s\n", static_cast<int>(line.size()), line.data(), error.c_str());
+		std::exit(1);
+	}
+	return *list;
+}
+
+// Run the shell binary built next to shell_bench with its input from /dev/null and wait for it
+// The time covers everything from exec to exit, the startup a user or a script waits for
+void runShell(const std::string& shellPath, std::vector<const char*> arguments) {
+	arguments.insert(arguments.begin(), shellPath.c_str());
+	arguments.push_back(nullptr);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	pid_t pid;
+	if (posix_spawn(&pid, shellPath.c_str(), &actions, nullptr, const_cast<char* const*>(arguments.data()), environ) == 0) {
+		waitpid(pid, nullptr, 0);
+	}
+	posix_spawn_file_actions_destroy(&actions);
+}
+
+int main(int argc, char* argv[]) {
+	scale = argc > 1 ? std::strtod(argv[1], nullptr) : 1.0;
+	interactiveShell = false; // Keep executed lines out of the history
+	setenv("FASTUTILS", "off", 1); // The spawn benchmarks run true and cat, they have to stay external programs
+
+	// Parsing a mix of typical lines, one line per run
+	const std::vector<std::string_view> lines = {
+		"ls -la /usr/local/bin",
+		"echo 'hello   world' \"with \\\"escapes\\\"\" and\\ spaces",
+		"cat /var/log/syslog | grep -i error | sort | uniq -c > /tmp/errors.txt",
+		"make -j8 2>&1 >> build.log && echo done || echo failed",
+		"cd /tmp; ls; pwd # trailing comment",
+		"history 10",
+	};
+	ParseArena arena;
+	size_t lineIndex = 0;
+	benchmark("parse", 1000000, [&] {
+		arena.reset();
+		parse(lines[lineIndex++ % lines.size()], arena);
+	});
+
+	// The same lines once the cache of repeated lines holds them
+	LineCache lineCache;
+	std::shared_ptr<const ParsedLine> cached;
+	std::string parseError;
+	benchmark("parse_cached", 1000000, [&] {
+		arena.reset();
+		lineCache.parse(lines[lineIndex++ % lines.size()], arena, parseError, nullptr, cached);
+	});
+
+	// PATH lookup through the hash table, warm and after the table was reset
+	std::string foundPath;
+	benchmark("path_lookup_hashed", 1000000, [&] { hashLookup("ls", foundPath); });
+	benchmark("path_lookup_cold", 2000, [&] {
+		resetHashTable();
+		hashLookup("ls", foundPath);
+	});
+	benchmark("path_lookup_missing", 1000000, [&] { hashLookup("no-such-command", foundPath); });
+
+	// Completion of a common prefix, collecting every match like readline does
+	benchmark("completion", 20000, [&] {
+		for (int state = 0; char* match = commandGenerator("g", state); ++state) {
+			std::free(match);
+		}
+	});
+
+	// Builtins called through the registry, streaming their output to /dev/null
+	OutputSink devNull(open("/dev/null", O_WRONLY | O_CLOEXEC));
+	ParseArena echoArena;
+	const CommandList& echoLine = parse("echo 'single  quoted' \"double \\\"quoted\\\" \\$text\" back\\ slashed 'a'\"b\"c \"\" end", echoArena);
+	BuiltinHandler echo = findBuiltin("echo");
+	benchmark("builtin_echo", 1000000, [&] {
+		CommandData commandData = commandFromAst(echoLine.items[0].pipeline.commands[0]);
+		runBuiltinCommand(commandData, echo, {0, devNull.fd(), 2}, devNull);
+	});
+
+	// Expanding variables, and capturing $(...) from a builtin in the shell and from an external command over a pipe
+	ParseArena expandArena;
+	const CommandList& expandLine = parse("echo $HOME \"${PATH}\" $? ${UNSET:-default}", expandArena);
+	benchmark("expand_variables", 500000, [&] { CommandData commandData = commandFromAst(expandLine.items[0].pipeline.commands[0]); });
+	benchmark("substitution_builtin", 200000, [&] { commandSubstitution("pwd"); });
+	benchmark("substitution_external", 1000, [&] { commandSubstitution("true"); });
+
+	// A whole line whose redirections only change the descriptors the builtin is given
+	benchmark("builtin_redirected", 200000, [&] { executeLine("echo redirected > /dev/null 2>&1"); });
+
+	// Loops run from the bytecode their line was compiled to, 100k iterations calling a builtin or a function
+	benchmark("loop_for_100k", 5, [&] { executeLine("for i in $(seq 100000); do echo $i; done > /dev/null"); });
+	executeLine("f() { echo $1; }");
+	benchmark("function_call_100k", 5, [&] { executeLine("for i in $(seq 100000); do f $i; done > /dev/null"); });
+
+	commandHistory.setCapacity(100000);
+	for (size_t i = 0; i < 100000; ++i) {
+		commandHistory.add("make -j8 target" + std::to_string(i), false);
+	}
+	ParseArena historyArena;
+	const CommandList& historyLine = parse("history", historyArena);
+	BuiltinHandler history = findBuiltin("history");
+	benchmark("builtin_history_100k", 50, [&] {
+		CommandData commandData = commandFromAst(historyLine.items[0].pipeline.commands[0]);
+		runBuiltinCommand(commandData, history, {0, devNull.fd(), 2}, devNull);
+	});
+
+	// Pathname expansion of a directory with 1000 entries, two patterns reading it once, and ** over 10000 files
+	std::string globRoot = std::filesystem::temp_directory_path() / ("shell_bench_glob." + std::to_string(getpid()));
+	for (size_t i = 0; i < 1000; ++i) {
+		std::filesystem::create_directories(globRoot + "/flat");
+		close(open((globRoot + "/flat/file" + std::to_string(i) + (i % 10 ? ".o" : ".c")).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+	}
+	for (size_t i = 0; i < 10000; ++i) {
+		std::string directory = globRoot + "/tree/d" + std::to_string(i % 10) + "/s" + std::to_string(i % 200);
+		std::filesystem::create_directories(directory);
+		close(open((directory + "/file" + std::to_string(i) + (i % 10 ? ".o" : ".c")).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+	}
+	ParseArena globArena;
+	std::string globLines[] = {"echo " + globRoot + "/flat/*.c", "echo " + globRoot + "/flat/*.c " + globRoot + "/flat/*[0-4].o",
+		"echo " + globRoot + "/tree/**/*.c"};
+	const CommandList& globFlat = parse(globLines[0], globArena);
+	const CommandList& globTwice = parse(globLines[1], globArena);
+	const CommandList& globRecursive = parse(globLines[2], globArena);
+	benchmark("glob_directory_1k", 5000, [&] { CommandData commandData = commandFromAst(globFlat.items[0].pipeline.commands[0]); });
+	benchmark("glob_directory_1k_two_patterns", 5000, [&] { CommandData commandData = commandFromAst(globTwice.items[0].pipeline.commands[0]); });
+	benchmark("glob_recursive_10k", 200, [&] { CommandData commandData = commandFromAst(globRecursive.items[0].pipeline.commands[0]); });
+
+	// Completing an argument in the same directory, each lookup has the background thread check its mtime
+	std::string completionText = globRoot + "/flat/file12";
+	benchmark("completion_argument_1k", 20000, [&] {
+		for (int state = 0; char* match = argumentGenerator(completionText.c_str(), state); ++state) {
+			std::free(match);
+		}
+	});
+	std::filesystem::remove_all(globRoot);
+
+	// The fast cat, head and wc against the programs on a 1 GiB file, including the cost of starting them
+	std::string bigFile = std::filesystem::temp_directory_path() / ("shell_bench_lines." + std::to_string(getpid()));
+	constexpr size_t bigBytes = 1 << 30;
+	{
+		std::string block;
+		for (size_t i = 0; block.size() < (1 << 20); ++i) {
+			block += std::to_string(i) + " GET /index.html 200 " + std::to_string(i * 7919 % 100000) + "\n";
+		}
+		block.resize(1 << 20);
+		int fd = open(bigFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		for (size_t written = 0; written < bigBytes; written += block.size()) {
+			writeAll(fd, block);
+		}
+		close(fd);
+	}
+	struct UtilityLine {
+		const char* name;
+		std::string line;
+		size_t bytes; // Read by every run, for the throughput
+	};
+	const UtilityLine utilityLines[] = {
+		{"wc_lines_1g", "wc -l " + bigFile + " > /dev/null", bigBytes},
+		{"cat_pipe_wc_1g", "cat " + bigFile + " | wc -l > /dev/null", bigBytes},
+		{"cat_copy_1g", "cat " + bigFile + " > " + bigFile + ".copy", bigBytes},
+		{"head_lines_1g", "head -n 1000 " + bigFile + " > /dev/null", 0},
+	};
+	for (const auto& utility : utilityLines) {
+		setenv("FASTUTILS", "on", 1);
+		benchmark(("fast_" + std::string(utility.name)).c_str(), 5, [&] { executeLine(utility.line); }, utility.bytes);
+		setenv("FASTUTILS", "off", 1);
+		benchmark(("external_" + std::string(utility.name)).c_str(), 5, [&] { executeLine(utility.line); }, utility.bytes);
+	}
+	std::filesystem::remove(bigFile);
+	std::filesystem::remove(bigFile + ".copy");
+
+	// Starting external commands end to end
+	ParseArena spawnArena;
+	const CommandList& pipeline = parse("true | true | true", spawnArena);
+	benchmark("spawn_pipeline_3", 500, [&] { runPipes(pipeline.items[0].pipeline, nullptr); });
+	benchmark("spawn_simple", 1000, [&] { executeLine("true"); });
+
+	// Exec to exit of the shell itself, running a -c command and reaching the first prompt of an interactive shell
+	std::string shellPath = std::filesystem::read_symlink("/proc/self/exe").parent_path() / "shell";
+	benchmark("startup_command", 500, [&] { runShell(shellPath, {"-c", "true"}); });
+	benchmark("startup_interactive", 500, [&] { runShell(shellPath, {"-i"}); });
+
+	// Data streaming through a 3 stage pipeline, with the default pipes and with PIPESIZE pipes
+	constexpr size_t streamBytes = 256 << 20;
+	ParseArena streamArena;
+	const CommandList& stream = parse("head -c 268435456 /dev/zero | cat | cat > /dev/null", streamArena);
+	benchmark("pipeline_3_throughput", 8, [&] { runPipes(stream.items[0].pipeline, nullptr); }, streamBytes);
+	setenv("PIPESIZE", "1m", 1);
+	benchmark("pipeline_3_throughput_pipesize_1m", 8, [&] { runPipes(stream.items[0].pipeline, nullptr); }, streamBytes);
+
+	// A builtin writing into the pipeline
+	ParseArena historyStreamArena;
+	const CommandList& historyStream = parse("history | cat | cat > /dev/null", historyStreamArena);
+	size_t historyBytes = 0;
+	for (size_t i = 0; i < commandHistory.size(); ++i) {
+		historyBytes += 8 + commandHistory.at(i).size(); // Number, two blanks and newline around the entry
+	}
+	unsetenv("PIPESIZE");
+	benchmark("pipeline_3_history_100k", 20, [&] { runPipes(historyStream.items[0].pipeline, nullptr); }, historyBytes);
+	setenv("PIPESIZE", "1m", 1);
+	benchmark("pipeline_3_history_100k_pipesize_1m", 20, [&] { runPipes(historyStream.items[0].pipeline, nullptr); }, historyBytes);
+	unsetenv("PIPESIZE");
+
+	// Spawn latency as the history, and with it the memory of the shell, grows
+	// posix_spawn does not copy the shell's page tables, a forked copy of the shell, as $(a; b) still needs, does
+	for (auto [entries, suffix] : {std::pair<size_t, const char*>{0, "0"}, {100000, "100k"}, {1000000, "1m"}}) {
+		commandHistory.clear();
+		commandHistory.setCapacity(std::max<size_t>(entries, 1));
+		for (size_t i = 0; i < entries; ++i) {
+			commandHistory.add("make -j8 target" + std::to_string(i), false);
+		}
+		benchmark(("spawn_simple_history_" + std::string(suffix)).c_str(), 500, [&] { executeLine("true"); });
+		benchmark(("substitution_pipeline_history_" + std::string(suffix)).c_str(), 300, [&] { commandSubstitution("true | true"); });
+		benchmark(("substitution_list_history_" + std::string(suffix)).c_str(), 300, [&] { commandSubstitution("true; true"); });
+	}
+
+	std::printf("{\"benchmarks\": [");
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Result& result = results[i];
+		std::printf("%s\n  {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.1f, \"allocs_per_op\": %.3f",
+			i ? "," : "", result.name.c_str(), result.iterations, result.nsPerOp, result.allocsPerOp);
+		if (result.mbPerSecond > 0) {
+			std::printf(", \"mb_per_s\": %.1f", result.mbPerSecond);
+		}
+		std::printf("}");
+	}
+	std::printf("\n]}\n");
+	return 0;
+}
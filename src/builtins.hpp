@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// --------------------------------------------------------------
+// Builtin registry
+// --------------------------------------------------------------
+
+template <typename Handler>
+struct BuiltinEntry {
+	std::string_view name{};
+	Handler handler{};
+};
+
+// FNV-1a with a seed, the table searches for a seed without collisions
+// The multiplications only carry upwards, so the final mix is needed for the seed to reach the low bits
+constexpr uint32_t builtinHash(std::string_view name, uint32_t seed) {
+	uint32_t hash = 2166136261u ^ seed;
+	for (char c : name) {
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 16777619u;
+	}
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	return hash;
+}
+
+// Perfect hash table over the builtin names, built entirely at compile time
+// A lookup hashes the name once and compares it with the single entry in its slot
+template <typename Handler, size_t N>
+class BuiltinTable {
+public:
+	static_assert(N > 0 && N < 255, "the slots store entry indexes as bytes");
+	static constexpr size_t slotCount = std::bit_ceil(N * 2);
+
+	consteval explicit BuiltinTable(const std::array<BuiltinEntry<Handler>, N>& list) : entryList(list) {
+		for (seed = 0; seed < 100000; ++seed) {
+			if (fillSlots()) {
+				return;
+			}
+		}
+		throw "no collision free seed for the builtin names";
+	}
+
+	constexpr const BuiltinEntry<Handler>* find(std::string_view name) const {
+		uint8_t index = slots[builtinHash(name, seed) & (slotCount - 1)];
+		return index != emptySlot && entryList[index].name == name ? &entryList[index] : nullptr;
+	}
+
+	// The entries in the order they were registered, used for completion
+	constexpr const std::array<BuiltinEntry<Handler>, N>& entries() const { return entryList; }
+
+private:
+	static constexpr uint8_t emptySlot = 0xff;
+
+	consteval bool fillSlots() {
+		slots.fill(emptySlot);
+		for (size_t i = 0; i < N; ++i) {
+			uint8_t& slot = slots[builtinHash(entryList[i].name, seed) & (slotCount - 1)];
+			if (slot != emptySlot) {
+				return false;
+			}
+			slot = static_cast<uint8_t>(i);
+		}
+		return true;
+	}
+
+	std::array<BuiltinEntry<Handler>, N> entryList{};
+	std::array<uint8_t, slotCount> slots{};
+	uint32_t seed{0};
+};
+
+template <typename Handler, size_t N>
+consteval BuiltinTable<Handler, N> makeBuiltinTable(const BuiltinEntry<Handler> (&list)[N]) {
+	std::array<BuiltinEntry<Handler>, N> entries{};
+	for (size_t i = 0; i < N; ++i) {
+		entries[i] = list[i];
+	}
+	return BuiltinTable<Handler, N>(entries);
+}
@@ -0,0 +1,168 @@
+#include "bytecode.hpp"
+
+#include <cstddef>
+
+namespace {
+
+struct Compiler {
+	std::pmr::vector<Instruction>& code;
+
+	uint32_t here() const { return static_cast<uint32_t>(code.size()); }
+
+	size_t emit(Op op, uint32_t target = 0, const void* operand = nullptr) {
+		Instruction& instruction = code.emplace_back();
+		instruction.op = op;
+		instruction.target = target;
+		instruction.none = operand;
+		return code.size() - 1;
+	}
+
+	// Point a forward jump at the next instruction
+	void land(size_t jump) { code[jump].target = here(); }
+};
+
+void compileCompound(Compiler& compiler, const CompoundCommand& compound);
+
+// A pipeline that is nothing but a compound command runs its code inline, anything else runs as a whole
+void compilePipeline(Compiler& compiler, const Pipeline& pipeline) {
+	if (pipeline.commands.size() == 1 && !pipeline.negated && !pipeline.timed) {
+		const SimpleCommand& command = pipeline.commands[0];
+		if (command.compound && command.redirections.empty()) {
+			compileCompound(compiler, *command.compound);
+			return;
+		}
+	}
+	compiler.emit(Op::Run, 0, &pipeline);
+}
+
+// Like executeList and runAndOr: a pipeline after && or || is skipped depending on the status before it,
+// a skipped pipeline leaves the status alone for the next one to look at
+void compileList(Compiler& compiler, const CommandList& list) {
+	for (size_t i = 0; i < list.items.size();) {
+		size_t end = i;
+		while (end + 1 < list.items.size() && (list.items[end].op == ListOp::And || list.items[end].op == ListOp::Or)) {
+			++end;
+		}
+		if (list.items[end].op == ListOp::Background) {
+			compiler.emit(Op::Background, static_cast<uint32_t>(end - i + 1), &list.items[i]);
+			i = end + 1;
+			continue;
+		}
+		for (size_t k = i; k <= end; ++k) {
+			if (k == i) {
+				compilePipeline(compiler, list.items[k].pipeline);
+				continue;
+			}
+			size_t skip = compiler.emit(list.items[k - 1].op == ListOp::And ? Op::JumpIfFailed : Op::JumpIfSucceeded);
+			compilePipeline(compiler, list.items[k].pipeline);
+			compiler.land(skip);
+		}
+		i = end + 1;
+	}
+}
+
+void compileIf(Compiler& compiler, const CompoundCommand& compound) {
+	std::vector<size_t> ends;
+	bool hasElse = false;
+	for (const auto& clause : compound.clauses) {
+		if (!clause.condition) {
+			compileList(compiler, *clause.body);
+			hasElse = true;
+			continue;
+		}
+		compileList(compiler, *clause.condition);
+		size_t next = compiler.emit(Op::JumpIfFailed);
+		compileList(compiler, *clause.body);
+		ends.push_back(compiler.emit(Op::Jump));
+		compiler.land(next);
+	}
+	// An if whose conditions all failed succeeds
+	if (!hasElse) {
+		compiler.emit(Op::Status, 0);
+	}
+	for (size_t end : ends) {
+		compiler.land(end);
+	}
+}
+
+void compileLoop(Compiler& compiler, const CompoundCommand& compound) {
+	const Clause& clause = compound.clauses[0];
+	size_t loop = compiler.emit(Op::Loop);
+	uint32_t top = compiler.here();
+	compileList(compiler, *clause.condition);
+	size_t exit = compiler.emit(compound.kind == CompoundKind::While ? Op::JumpIfFailed : Op::JumpIfSucceeded);
+	compileList(compiler, *clause.body);
+	compiler.emit(Op::Repeat, top);
+	compiler.land(exit);
+	compiler.land(loop);
+	compiler.emit(Op::LoopEnd);
+}
+
+void compileFor(Compiler& compiler, const CompoundCommand& compound) {
+	size_t begin = compiler.emit(Op::ForBegin, 0, &compound);
+	uint32_t next = compiler.here();
+	size_t exit = compiler.emit(Op::ForNext, 0, &compound);
+	compileList(compiler, *compound.clauses[0].body);
+	compiler.emit(Op::Repeat, next);
+	compiler.land(exit);
+	compiler.land(begin);
+	compiler.emit(Op::LoopEnd);
+}
+
+// The subject is matched against the items in order, the first match runs its list
+// A case without a matching item succeeds
+void compileCase(Compiler& compiler, const CompoundCommand& compound) {
+	size_t subject = compiler.emit(Op::Case, 0, &compound);
+	std::vector<size_t> matches;
+	for (const auto& item : compound.items) {
+		matches.push_back(compiler.emit(Op::Match, 0, &item));
+	}
+	compiler.emit(Op::Status, 0);
+	std::vector<size_t> ends = {subject, compiler.emit(Op::Jump)};
+	for (size_t i = 0; i < compound.items.size(); ++i) {
+		compiler.land(matches[i]);
+		if (compound.items[i].body) {
+			compileList(compiler, *compound.items[i].body);
+		} else {
+			compiler.emit(Op::Status, 0);
+		}
+		ends.push_back(compiler.emit(Op::Jump));
+	}
+	for (size_t end : ends) {
+		compiler.land(end);
+	}
+}
+
+void compileCompound(Compiler& compiler, const CompoundCommand& compound) {
+	switch (compound.kind) {
+		case CompoundKind::If:
+			compileIf(compiler, compound);
+			break;
+		case CompoundKind::While:
+		case CompoundKind::Until:
+			compileLoop(compiler, compound);
+			break;
+		case CompoundKind::For:
+			compileFor(compiler, compound);
+			break;
+		case CompoundKind::Case:
+			compileCase(compiler, compound);
+			break;
+		case CompoundKind::Group:
+			compileList(compiler, *compound.clauses[0].body);
+			break;
+		case CompoundKind::Function:
+			compiler.emit(Op::Define, 0, &compound);
+			break;
+	}
+}
+
+} // namespace
+
+const Program* compileCompound(const CompoundCommand& compound, std::pmr::memory_resource* arena) {
+	auto* program = std::pmr::polymorphic_allocator<Program>(arena).allocate(1);
+	new (program) Program(arena);
+	Compiler compiler{program->code};
+	compileCompound(compiler, compound);
+	return program;
+}
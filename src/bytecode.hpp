@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+#include "parser.hpp"
+
+// --------------------------------------------------------------
+// Compound commands compiled to bytecode
+// --------------------------------------------------------------
+
+// if, while, until, for, case, { } and function definitions are compiled once, when they are
+// parsed, into a flat array of instructions in the arena of their line. Jumps replace the nesting
+// of the tree, so a loop runs its body by going back to an index instead of walking the tree again.
+// Pipelines stay as they were parsed, an instruction only points to them.
+
+enum class Op : uint8_t {
+	Run,             // Run the pipeline in the foreground
+	Background,      // Start the and-or list of target items as a job
+	Jump,            // Continue at target
+	JumpIfFailed,    // Continue at target if the last status is not 0
+	JumpIfSucceeded, // Continue at target if the last status is 0
+	Status,          // Set the status to target
+	Loop,            // Enter a while or until loop that ends at target, continue goes to the next instruction
+	ForBegin,        // Expand the words of a for loop and enter it like Loop
+	ForNext,         // Assign the next value to the variable, or continue at target once they are used up
+	Repeat,          // Remember the status of the loop body and continue at target
+	LoopEnd,         // Leave the innermost loop, the status is that of its body's last run, 0 if it never ran
+	Case,            // Expand the subject of a case, continue at target if that fails
+	Match,           // Continue at target if a pattern of the item matches the subject
+	Define           // Define a function
+};
+
+// 16 bytes, the operand depends on the operation
+struct Instruction {
+	union {
+		const void* none{nullptr};
+		const Pipeline* pipeline;       // Run
+		const ListItem* items;          // Background
+		const CompoundCommand* command; // ForBegin, ForNext, Case, Define
+		const CaseItem* item;           // Match
+	};
+	uint32_t target{0};
+	Op op{Op::Run};
+};
+
+struct Program {
+	explicit Program(std::pmr::memory_resource* arena) : code(arena) {}
+
+	std::pmr::vector<Instruction> code;
+};
+
+// Compile a compound command into a program allocated from the arena
+// Compound commands nested in it without redirections, ! or time are compiled inline
+const Program* compileCompound(const CompoundCommand& compound, std::pmr::memory_resource* arena);
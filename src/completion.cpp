@@ -0,0 +1,168 @@
+#include "completion.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <thread>
+#include <unistd.h>
+
+DirectoryCache::DirectoryCache(size_t capacity) : state(std::make_shared<State>()), capacity(std::max<size_t>(capacity, 1)) {
+}
+
+bool DirectoryCache::lookup(const std::string& directory, std::string_view prefix, std::chrono::milliseconds wait, std::vector<CompletionEntry>& matches) {
+	std::unique_lock<std::mutex> guard(state->lock);
+	// The thread is only started by the first completion, scripts never pay for it
+	if (!state->started) {
+		std::thread(worker, state).detach();
+		state->started = true;
+	}
+
+	auto [found, inserted] = state->listings.try_emplace(directory);
+	if (inserted && state->listings.size() > capacity) {
+		// Drop the least recently used listing the thread is not about to check
+		auto oldest = state->listings.end();
+		for (auto it = state->listings.begin(); it != state->listings.end(); ++it) {
+			if (it != found && !it->second.queued && (oldest == state->listings.end() || it->second.lastUsed < oldest->second.lastUsed)) {
+				oldest = it;
+			}
+		}
+		if (oldest != state->listings.end()) {
+			state->listings.erase(oldest);
+		}
+	}
+	Listing& listing = found->second;
+	listing.lastUsed = ++state->clock;
+	uint64_t ticket = ++listing.requested;
+	if (!listing.queued) {
+		listing.queued = true;
+		state->queue.push_back(directory);
+		state->requests.notify_one();
+	}
+	bool current = state->checked.wait_for(guard, wait, [&] { return listing.checked >= ticket; });
+
+	bool hidden = prefix.starts_with('.');
+	auto add = [&](const CompletionEntry& entry) {
+		if (entry.name.starts_with(prefix) && (hidden || !entry.name.starts_with('.'))) {
+			matches.push_back(entry);
+		}
+	};
+	if (listing.complete) {
+		// The names starting with the prefix directly follow its lower bound
+		auto first = std::lower_bound(listing.entries.begin(), listing.entries.end(), prefix,
+			[](const CompletionEntry& entry, std::string_view name) { return entry.name < name; });
+		for (; first != listing.entries.end() && first->name.starts_with(prefix); ++first) {
+			add(*first);
+		}
+	} else {
+		std::for_each(listing.partial.begin(), listing.partial.end(), add);
+	}
+	return current && listing.complete;
+}
+
+void DirectoryCache::worker(std::shared_ptr<State> state) {
+	while (true) {
+		std::string path;
+		{
+			std::unique_lock<std::mutex> guard(state->lock);
+			state->requests.wait(guard, [&] { return !state->queue.empty(); });
+			path = std::move(state->queue.front());
+			state->queue.pop_front();
+		}
+		refresh(*state, path);
+	}
+}
+
+// Check the mtime of the directory and read it again if it changed since the listing was read
+// A directory read the first time publishes its entries batch by batch, so lookups that gave up
+// waiting still find what was read so far
+void DirectoryCache::refresh(State& state, const std::string& path) {
+	uint64_t ticket = 0;
+	struct timespec known{};
+	bool complete = false;
+	{
+		std::lock_guard<std::mutex> guard(state.lock);
+		auto found = state.listings.find(path);
+		if (found == state.listings.end()) {
+			return;
+		}
+		found->second.queued = false;
+		ticket = found->second.requested;
+		known = found->second.mtime;
+		complete = found->second.complete;
+	}
+
+	// The mtime is taken before reading, a change while we read is caught by the next check
+	struct stat info{};
+	if (stat(path.c_str(), &info) != 0) {
+		info.st_mtim = {};
+	}
+	if (complete && known.tv_sec == info.st_mtim.tv_sec && known.tv_nsec == info.st_mtim.tv_nsec) {
+		{
+			std::lock_guard<std::mutex> guard(state.lock);
+			auto found = state.listings.find(path);
+			if (found != state.listings.end()) {
+				found->second.checked = std::max(found->second.checked, ticket);
+			}
+		}
+		state.checked.notify_all();
+		return;
+	}
+
+	std::vector<CompletionEntry> entries;
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		std::vector<char> buffer(64 * 1024);
+		while (true) {
+			ssize_t bytes = getdents64(fd, buffer.data(), buffer.size());
+			if (bytes < 0 && errno == EINTR) {
+				continue;
+			}
+			if (bytes <= 0) {
+				break;
+			}
+			size_t first = entries.size();
+			for (ssize_t offset = 0; offset < bytes;) {
+				const auto* entry = reinterpret_cast<const struct dirent64*>(buffer.data() + offset);
+				offset += entry->d_reclen;
+				std::string_view name = entry->d_name;
+				if (name == "." || name == "..") {
+					continue;
+				}
+				// Symbolic links and file systems without d_type need a stat to tell directories apart
+				bool directory = entry->d_type == DT_DIR;
+				if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+					struct stat target{};
+					directory = fstatat(fd, entry->d_name, &target, 0) == 0 && S_ISDIR(target.st_mode);
+				}
+				entries.push_back(CompletionEntry{std::string(name), directory});
+			}
+			if (!complete) {
+				std::lock_guard<std::mutex> guard(state.lock);
+				auto found = state.listings.find(path);
+				if (found == state.listings.end()) {
+					close(fd);
+					return;
+				}
+				found->second.partial.insert(found->second.partial.end(), entries.begin() + first, entries.end());
+			}
+		}
+		close(fd);
+	}
+	std::sort(entries.begin(), entries.end(), [](const CompletionEntry& a, const CompletionEntry& b) { return a.name < b.name; });
+
+	{
+		std::lock_guard<std::mutex> guard(state.lock);
+		auto found = state.listings.find(path);
+		if (found == state.listings.end()) {
+			return;
+		}
+		Listing& listing = found->second;
+		listing.entries = std::move(entries);
+		listing.partial = {};
+		listing.mtime = info.st_mtim;
+		listing.complete = true;
+		listing.checked = std::max(listing.checked, ticket);
+	}
+	state.checked.notify_all();
+}
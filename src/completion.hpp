@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+
+// --------------------------------------------------------------
+// Directory listings for argument completion
+// --------------------------------------------------------------
+
+struct CompletionEntry {
+	std::string name{};
+	bool directory{false};
+};
+
+// The listings of the directories arguments are completed in, read by a background thread
+//
+// A lookup asks the thread to compare the directory's mtime with the listing and to read the
+// directory again if it changed, then waits a bounded time for it. A directory that is still
+// being read yields the entries read so far, so a huge or slow (NFS) directory never freezes
+// the prompt, and the next lookup sees more of it. Complete listings are sorted, a prefix is
+// found with a binary search.
+class DirectoryCache {
+public:
+	explicit DirectoryCache(size_t capacity = 32);
+
+	// Append the entries of the directory whose names start with prefix, names starting with
+	// a dot only if the prefix does. Returns true if the listing is complete and up to date.
+	bool lookup(const std::string& directory, std::string_view prefix, std::chrono::milliseconds wait, std::vector<CompletionEntry>& matches);
+
+private:
+	struct Listing {
+		std::vector<CompletionEntry> entries{}; // Sorted, from the last complete read
+		std::vector<CompletionEntry> partial{}; // Read so far, while the directory is read the first time
+		struct timespec mtime{};
+		bool complete{false};
+		bool queued{false};
+		uint64_t requested{0}; // Lookups that asked for the listing to be checked
+		uint64_t checked{0};   // The last of them the thread answered
+		uint64_t lastUsed{0};
+	};
+
+	// Shared with the thread, which keeps it alive and is never joined: a directory that
+	// does not answer must not keep the shell from exiting
+	struct State {
+		std::mutex lock;
+		std::condition_variable requests; // A directory was queued
+		std::condition_variable checked;  // A listing was checked or read
+		std::deque<std::string> queue{};
+		std::unordered_map<std::string, Listing> listings{};
+		bool started{false};
+		uint64_t clock{0};
+	};
+
+	static void worker(std::shared_ptr<State> state);
+	static void refresh(State& state, const std::string& path);
+
+	std::shared_ptr<State> state;
+	size_t capacity;
+};
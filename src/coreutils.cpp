@@ -0,0 +1,639 @@
+#include "coreutils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "builtins.hpp"
+#include "variables.hpp"
+
+namespace {
+
+// --------------------------------------------------------------
+// Arguments
+// --------------------------------------------------------------
+
+// What cat, head and wc were asked for, the files are in order and "-" is stdin
+struct UtilityArguments {
+	uint64_t count{10}; // head: lines or bytes to copy
+	bool bytes{false};  // head -c, wc -c
+	bool lines{false};  // wc -l
+	std::vector<std::string_view> files{};
+};
+
+bool parseCount(std::string_view text, uint64_t& count) {
+	auto result = std::from_chars(text.data(), text.data() + text.size(), count);
+	return !text.empty() && result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+// cat [-u] [file...], -u is what cat does anyway
+bool parseCat(std::span<const Word> words, UtilityArguments& arguments) {
+	bool options = true;
+	for (const auto& word : words.subspan(1)) {
+		std::string_view text = word.text;
+		if (options && text == "--") {
+			options = false;
+		} else if (options && text == "-u") {
+			continue;
+		} else if (options && text.size() > 1 && text[0] == '-') {
+			return false;
+		} else {
+			arguments.files.push_back(text);
+		}
+	}
+	return true;
+}
+
+// head [-n lines | -c bytes | -lines] [file...]
+bool parseHead(std::span<const Word> words, UtilityArguments& arguments) {
+	std::span<const Word> rest = words.subspan(1);
+	// The historical -5 is only an option in front of everything else
+	if (!rest.empty() && rest[0].text.size() > 1 && rest[0].text[0] == '-' && parseCount(rest[0].text.substr(1), arguments.count)) {
+		rest = rest.subspan(1);
+	}
+	bool options = true;
+	for (size_t i = 0; i < rest.size(); ++i) {
+		std::string_view text = rest[i].text;
+		if (options && text == "--") {
+			options = false;
+		} else if (options && (text.starts_with("-n") || text.starts_with("-c"))) {
+			arguments.bytes = text[1] == 'c';
+			std::string_view value = text.substr(2);
+			if (value.empty()) {
+				if (i + 1 == rest.size()) {
+					return false;
+				}
+				value = rest[++i].text;
+			}
+			// Negative counts and suffixes like 1K are left to the real head
+			if (!parseCount(value, arguments.count)) {
+				return false;
+			}
+		} else if (options && text.size() > 1 && text[0] == '-') {
+			return false;
+		} else {
+			arguments.files.push_back(text);
+		}
+	}
+	return true;
+}
+
+// wc -l, wc -c or both, counting words needs the locale rules of the real wc
+bool parseWc(std::span<const Word> words, UtilityArguments& arguments) {
+	bool options = true;
+	for (const auto& word : words.subspan(1)) {
+		std::string_view text = word.text;
+		if (options && text == "--") {
+			options = false;
+		} else if (options && text == "--lines") {
+			arguments.lines = true;
+		} else if (options && text == "--bytes") {
+			arguments.bytes = true;
+		} else if (options && text.size() > 1 && text[0] == '-') {
+			for (char c : text.substr(1)) {
+				if (c == 'l') {
+					arguments.lines = true;
+				} else if (c == 'c') {
+					arguments.bytes = true;
+				} else {
+					return false;
+				}
+			}
+		} else {
+			arguments.files.push_back(text);
+		}
+	}
+	return arguments.lines || arguments.bytes;
+}
+
+bool parseAnything(std::span<const Word>, UtilityArguments&) {
+	return true;
+}
+
+struct FastUtility {
+	bool (*parse)(std::span<const Word> words, UtilityArguments& arguments){};
+	BuiltinHandler run{};
+	bool readsInput{true};
+};
+
+constexpr auto fastUtilities = makeBuiltinTable<FastUtility>({
+	{"cat", {parseCat, catBuiltin}},
+	{"head", {parseHead, headBuiltin}},
+	{"wc", {parseWc, wcBuiltin}},
+	{"true", {parseAnything, trueBuiltin, false}},
+	{"false", {parseAnything, falseBuiltin, false}},
+});
+
+// --------------------------------------------------------------
+// Reading the input
+// --------------------------------------------------------------
+
+// A file truncated while it is mapped raises SIGBUS on the pages that are gone. The builtins run
+// inside the shell, so the fault ends the read with an error instead of killing the shell.
+thread_local sigjmp_buf* mappedReadJump = nullptr;
+
+void mappedReadFault(int signalNumber) {
+	if (mappedReadJump) {
+		siglongjmp(*mappedReadJump, 1);
+	}
+	signal(signalNumber, SIG_DFL);
+	raise(signalNumber);
+}
+
+void catchMappedReadFaults() {
+	static std::once_flag installed;
+	std::call_once(installed, [] {
+		struct sigaction action{};
+		action.sa_handler = mappedReadFault;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGBUS, &action, nullptr);
+	});
+}
+
+// Call visit with the contents of fd from its offset on, until it returns false
+// A regular file is mapped and visited in one piece, anything else is read block by block
+// Returns the errno that ended the reading early, 0 if there was none
+template <typename Visit>
+int visitInput(int fd, Visit visit) {
+	struct stat status{};
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	// Files in /proc claim to be empty, they are read like pipes
+	if (offset >= 0 && fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+		if (offset >= status.st_size) {
+			return 0;
+		}
+		off_t start = offset & ~static_cast<off_t>(sysconf(_SC_PAGESIZE) - 1);
+		size_t length = status.st_size - start;
+		void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, start);
+		if (mapped != MAP_FAILED) {
+			madvise(mapped, length, MADV_SEQUENTIAL);
+			catchMappedReadFaults();
+			int error = 0;
+			sigjmp_buf jump;
+			if (sigsetjmp(jump, 1) == 0) {
+				mappedReadJump = &jump;
+				visit(std::string_view(static_cast<const char*>(mapped) + (offset - start), status.st_size - offset));
+			} else {
+				error = EIO;
+			}
+			mappedReadJump = nullptr;
+			munmap(mapped, length);
+			lseek(fd, status.st_size, SEEK_SET);
+			return error;
+		}
+	}
+
+	constexpr size_t blockSize = 128 * 1024;
+	std::unique_ptr<char[]> buffer(new char[blockSize]);
+	while (true) {
+		ssize_t bytes = read(fd, buffer.get(), blockSize);
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes < 0) {
+			return errno;
+		}
+		if (bytes == 0 || !visit(std::string_view(buffer.get(), bytes))) {
+			return 0;
+		}
+	}
+}
+
+// Open a file argument, "-" is the builtin's stdin
+int openInput(std::string_view name, const std::array<int, 3>& fds) {
+	return name == "-" ? fds[STDIN_FILENO] : open(std::string(name).c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+void closeInput(std::string_view name, int fd) {
+	if (name != "-" && fd >= 0) {
+		close(fd);
+	}
+}
+
+// The status of a program killed by SIGPIPE, what the real programs end with once the reader is gone
+constexpr int brokenPipeStatus = 128 + SIGPIPE;
+
+// --------------------------------------------------------------
+// Copying for cat
+// --------------------------------------------------------------
+
+struct CopyResult {
+	int error{0};
+	bool writing{false}; // The error came from the output
+};
+
+// Write all of data, returns 0 or the errno
+int writeData(int fd, const char* data, size_t size) {
+	while (size > 0) {
+		ssize_t bytes = write(fd, data, size);
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes < 0) {
+			return errno;
+		}
+		data += bytes;
+		size -= bytes;
+	}
+	return 0;
+}
+
+// Errors of the kernel copies that are about the output
+bool outputError(int error) {
+	return error == EPIPE || error == ENOSPC || error == EDQUOT || error == EFBIG;
+}
+
+// An errno that means the kernel cannot copy between these two files this way, the next way is tried
+bool unsupportedCopy(int error) {
+	return error == EINVAL || error == EXDEV || error == ENOSYS || error == EOPNOTSUPP || error == EBADF;
+}
+
+// Copy in to out inside the kernel where possible: copy_file_range between regular files (a
+// reflink or a server side copy on file systems that have them), sendfile from a regular file,
+// splice from or into a pipe. The data only passes through our memory when none of them applies.
+CopyResult copyDescriptor(int in, int out) {
+	struct stat inStatus{};
+	struct stat outStatus{};
+	fstat(in, &inStatus);
+	fstat(out, &outStatus);
+	constexpr size_t chunk = 1 << 30;
+
+	// Each way only gives up before it copied anything, after that its errors are real
+	if (S_ISREG(inStatus.st_mode) && S_ISREG(outStatus.st_mode)) {
+		for (bool copied = false;;) {
+			ssize_t bytes = copy_file_range(in, nullptr, out, nullptr, chunk, 0);
+			if (bytes == 0) {
+				return {};
+			}
+			if (bytes > 0) {
+				copied = true;
+			} else if (errno != EINTR) {
+				if (copied || !unsupportedCopy(errno)) {
+					return {errno, outputError(errno)};
+				}
+				break;
+			}
+		}
+	}
+	if (S_ISREG(inStatus.st_mode)) {
+		for (bool copied = false;;) {
+			ssize_t bytes = sendfile(out, in, nullptr, chunk);
+			if (bytes == 0) {
+				return {};
+			}
+			if (bytes > 0) {
+				copied = true;
+			} else if (errno != EINTR) {
+				if (copied || !unsupportedCopy(errno)) {
+					return {errno, outputError(errno)};
+				}
+				break;
+			}
+		}
+	}
+	if (S_ISFIFO(inStatus.st_mode) || S_ISFIFO(outStatus.st_mode)) {
+		for (bool copied = false;;) {
+			ssize_t bytes = splice(in, nullptr, out, nullptr, chunk, SPLICE_F_MOVE);
+			if (bytes == 0) {
+				return {};
+			}
+			if (bytes > 0) {
+				copied = true;
+			} else if (errno != EINTR) {
+				if (copied || !unsupportedCopy(errno)) {
+					return {errno, outputError(errno)};
+				}
+				break;
+			}
+		}
+	}
+
+	int writeError = 0;
+	int readError = visitInput(in, [&](std::string_view data) {
+		writeError = writeData(out, data.data(), data.size());
+		return writeError == 0;
+	});
+	return writeError ? CopyResult{writeError, true} : CopyResult{readError, false};
+}
+
+// --------------------------------------------------------------
+// Counting newlines
+// --------------------------------------------------------------
+
+#if defined(__x86_64__)
+
+// Every block of bytes compared with '\n' gives 0xff (-1) per newline, subtracting it counts up a
+// byte per lane. The byte counters are summed up with sad before they can overflow at 255 blocks.
+__attribute__((target("avx2"))) size_t countNewlinesAvx2(const char* data, size_t size) {
+	const __m256i newline = _mm256_set1_epi8('\n');
+	size_t count = 0;
+	size_t i = 0;
+	while (i + 32 <= size) {
+		__m256i counters = _mm256_setzero_si256();
+		size_t rounds = std::min<size_t>((size - i) / 32, 255);
+		for (size_t round = 0; round < rounds; ++round, i += 32) {
+			__m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+			counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(bytes, newline));
+		}
+		__m256i sums = _mm256_sad_epu8(counters, _mm256_setzero_si256());
+		count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) + _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+	}
+	return count + std::count(data + i, data + size, '\n');
+}
+
+size_t countNewlinesSse2(const char* data, size_t size) {
+	const __m128i newline = _mm_set1_epi8('\n');
+	size_t count = 0;
+	size_t i = 0;
+	while (i + 16 <= size) {
+		__m128i counters = _mm_setzero_si128();
+		size_t rounds = std::min<size_t>((size - i) / 16, 255);
+		for (size_t round = 0; round < rounds; ++round, i += 16) {
+			__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+			counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(bytes, newline));
+		}
+		__m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+		count += _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+	}
+	return count + std::count(data + i, data + size, '\n');
+}
+
+#endif
+
+} // namespace
+
+size_t countNewlines(const char* data, size_t size) {
+#if defined(__x86_64__)
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	return avx2 ? countNewlinesAvx2(data, size) : countNewlinesSse2(data, size);
+#else
+	return std::count(data, data + size, '\n');
+#endif
+}
+
+BuiltinHandler findFastUtility(std::span<const Word> words, bool& readsStdin) {
+	if (words.empty()) {
+		return nullptr;
+	}
+	const auto* entry = fastUtilities.find(words[0].text);
+	if (!entry) {
+		return nullptr;
+	}
+	const char* setting = getVariable("FASTUTILS");
+	if (setting && std::string_view(setting) == "off") {
+		return nullptr;
+	}
+	UtilityArguments arguments;
+	if (!entry->handler.parse(words, arguments)) {
+		return nullptr;
+	}
+	readsStdin = entry->handler.readsInput &&
+		(arguments.files.empty() || std::find(arguments.files.begin(), arguments.files.end(), "-") != arguments.files.end());
+	return entry->handler.run;
+}
+
+// --------------------------------------------------------------
+// The builtins
+// --------------------------------------------------------------
+
+int catBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	UtilityArguments arguments;
+	parseCat(commandData.words, arguments);
+	if (arguments.files.empty()) {
+		arguments.files.push_back("-");
+	}
+	// Whatever the sink holds goes first, then the files go straight to its descriptor
+	out.flush();
+	struct stat outStatus{};
+	bool regularOutput = out.fd() >= 0 && fstat(out.fd(), &outStatus) == 0 && S_ISREG(outStatus.st_mode);
+
+	int status = 0;
+	for (std::string_view name : arguments.files) {
+		int fd = openInput(name, fds);
+		if (fd < 0) {
+			writeAll(fds[STDERR_FILENO], "cat: " + std::string(name) + ": " + std::strerror(errno) + "\n");
+			status = 1;
+			continue;
+		}
+		// Appending a file to itself would never end
+		struct stat inStatus{};
+		if (regularOutput && fstat(fd, &inStatus) == 0 && inStatus.st_dev == outStatus.st_dev && inStatus.st_ino == outStatus.st_ino) {
+			writeAll(fds[STDERR_FILENO], "cat: " + std::string(name) + ": input file is output file\n");
+			closeInput(name, fd);
+			status = 1;
+			continue;
+		}
+
+		CopyResult result{};
+		if (out.fd() < 0) {
+			// Captured by $(...), the sink collects the text
+			result.error = visitInput(fd, [&](std::string_view data) {
+				out.write(data);
+				return true;
+			});
+		} else {
+			result = copyDescriptor(fd, out.fd());
+		}
+		closeInput(name, fd);
+		if (result.writing && result.error == EPIPE) {
+			return brokenPipeStatus;
+		}
+		if (result.writing) {
+			writeAll(fds[STDERR_FILENO], std::string("cat: write error: ") + std::strerror(result.error) + "\n");
+			return 1;
+		}
+		if (result.error) {
+			writeAll(fds[STDERR_FILENO], "cat: " + std::string(name) + ": " + std::strerror(result.error) + "\n");
+			status = 1;
+		}
+	}
+	return status;
+}
+
+int headBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	UtilityArguments arguments;
+	parseHead(commandData.words, arguments);
+	bool headers = arguments.files.size() > 1;
+	if (arguments.files.empty()) {
+		arguments.files.push_back("-");
+	}
+
+	int status = 0;
+	bool first = true;
+	for (std::string_view name : arguments.files) {
+		int fd = openInput(name, fds);
+		if (fd < 0) {
+			writeAll(fds[STDERR_FILENO], "head: cannot open '" + std::string(name) + "' for reading: " + std::strerror(errno) + "\n");
+			status = 1;
+			continue;
+		}
+		if (headers) {
+			out.write(first ? "==> " : "\n==> ");
+			out.write(name == "-" ? "standard input" : name);
+			out.write(" <==\n");
+		}
+		first = false;
+
+		// Lines are found with memchr, only the pages up to the last one are touched
+		uint64_t remaining = arguments.count;
+		off_t start = lseek(fd, 0, SEEK_CUR);
+		uint64_t consumed = 0;
+		int error = remaining == 0 ? 0 : visitInput(fd, [&](std::string_view data) {
+			size_t take = data.size();
+			if (arguments.bytes) {
+				take = std::min<uint64_t>(remaining, data.size());
+				remaining -= take;
+			} else {
+				const char* end = data.data() + data.size();
+				const char* position = data.data();
+				while (remaining > 0 && position < end) {
+					const void* newline = std::memchr(position, '\n', end - position);
+					if (!newline) {
+						position = end;
+						break;
+					}
+					position = static_cast<const char*>(newline) + 1;
+					--remaining;
+				}
+				take = position - data.data();
+			}
+			out.write(data.substr(0, take));
+			consumed += take;
+			return remaining > 0 && !out.failed();
+		});
+		// Like the real head, a seekable stdin is left right after what was copied
+		if (name == "-" && start >= 0) {
+			lseek(fd, start + consumed, SEEK_SET);
+		}
+		closeInput(name, fd);
+		if (error) {
+			writeAll(fds[STDERR_FILENO], "head: error reading '" + std::string(name) + "': " + std::strerror(error) + "\n");
+			status = 1;
+		}
+		if (out.failed()) {
+			return brokenPipeStatus;
+		}
+	}
+	return status;
+}
+
+int wcBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	UtilityArguments arguments;
+	parseWc(commandData.words, arguments);
+	bool named = !arguments.files.empty();
+	if (!named) {
+		arguments.files.push_back("-");
+	}
+
+	// The columns are as wide as the total size of the regular files, or 7 if there is anything else
+	// A single count of a single input is not padded at all
+	size_t width = 1;
+	if (arguments.files.size() > 1 || (arguments.lines && arguments.bytes)) {
+		uint64_t regularTotal = 0;
+		size_t minimum = 1;
+		for (size_t i = 0; i < arguments.files.size(); ++i) {
+			struct stat status{};
+			bool found = arguments.files[i] == "-" ? fstat(fds[STDIN_FILENO], &status) == 0 : stat(std::string(arguments.files[i]).c_str(), &status) == 0;
+			if (!found) {
+				if (i == 0) {
+					regularTotal = 0;
+					minimum = 1;
+					break;
+				}
+				continue;
+			}
+			if (!S_ISREG(status.st_mode)) {
+				minimum = 7;
+			} else {
+				regularTotal += status.st_size;
+			}
+		}
+		for (; regularTotal >= 10; regularTotal /= 10) {
+			++width;
+		}
+		width = std::max(width, minimum);
+	}
+
+	auto writeCounts = [&](uint64_t lines, uint64_t bytes, std::string_view name) {
+		if (arguments.lines) {
+			out.writePadded(lines, width);
+		}
+		if (arguments.bytes) {
+			if (arguments.lines) {
+				out.put(' ');
+			}
+			out.writePadded(bytes, width);
+		}
+		if (!name.empty()) {
+			out.put(' ');
+			out.write(name);
+		}
+		out.put('\n');
+	};
+
+	int status = 0;
+	uint64_t totalLines = 0;
+	uint64_t totalBytes = 0;
+	for (std::string_view name : arguments.files) {
+		int fd = openInput(name, fds);
+		if (fd < 0) {
+			writeAll(fds[STDERR_FILENO], "wc: " + std::string(name) + ": " + std::strerror(errno) + "\n");
+			status = 1;
+			continue;
+		}
+		uint64_t lines = 0;
+		uint64_t bytes = 0;
+		int error = 0;
+		struct stat fileStatus{};
+		off_t offset = lseek(fd, 0, SEEK_CUR);
+		if (!arguments.lines && offset >= 0 && fstat(fd, &fileStatus) == 0 && S_ISREG(fileStatus.st_mode) && fileStatus.st_size > 0) {
+			// The size of a regular file is known without reading it
+			bytes = fileStatus.st_size > offset ? fileStatus.st_size - offset : 0;
+			lseek(fd, 0, SEEK_END);
+		} else {
+			error = visitInput(fd, [&](std::string_view data) {
+				if (arguments.lines) {
+					lines += countNewlines(data.data(), data.size());
+				}
+				bytes += data.size();
+				return true;
+			});
+		}
+		closeInput(name, fd);
+		if (error) {
+			writeAll(fds[STDERR_FILENO], "wc: " + std::string(name) + ": " + std::strerror(error) + "\n");
+			status = 1;
+		}
+		writeCounts(lines, bytes, named ? name : "");
+		totalLines += lines;
+		totalBytes += bytes;
+	}
+	if (arguments.files.size() > 1) {
+		writeCounts(totalLines, totalBytes, "total");
+	}
+	return out.failed() ? brokenPipeStatus : status;
+}
+
+int trueBuiltin(CommandData&, const std::array<int, 3>&, OutputSink&) {
+	return 0;
+}
+
+int falseBuiltin(CommandData&, const std::array<int, 3>&, OutputSink&) {
+	return 1;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+
+#include "shell.hpp"
+
+// --------------------------------------------------------------
+// Fast builtins standing in for common coreutils
+// --------------------------------------------------------------
+
+// cat, head, wc, true and false run inside the shell and write straight to their stdout:
+// cat copies with copy_file_range, sendfile or splice, head and wc look at mapped files and
+// count newlines with SIMD. Only the options they implement exactly are taken, anything else
+// runs the real program. FASTUTILS=off always runs the real programs.
+
+// The fast builtin for the command and its arguments, nullptr if the program has to run
+// readsStdin is set if the builtin would read its stdin
+BuiltinHandler findFastUtility(std::span<const Word> words, bool& readsStdin);
+
+// Number of newlines in the buffer
+size_t countNewlines(const char* data, size_t size);
+
+int catBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int headBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int wcBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int trueBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int falseBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
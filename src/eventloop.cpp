@@ -0,0 +1,80 @@
+#include "eventloop.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+EventLoop::EventLoop() : epollFd(epoll_create1(EPOLL_CLOEXEC)) {
+}
+
+EventLoop::~EventLoop() {
+	if (epollFd != -1) {
+		close(epollFd);
+	}
+}
+
+bool EventLoop::watch(int fd, Handler handler) {
+	struct epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epollFd == -1 || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		return false;
+	}
+	handlers[fd] = std::move(handler);
+	return true;
+}
+
+void EventLoop::unwatch(int fd) {
+	if (handlers.erase(fd)) {
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+	}
+}
+
+bool EventLoop::runOnce(int timeout) {
+	std::array<struct epoll_event, 8> events;
+	int ready = epoll_wait(epollFd, events.data(), events.size(), timeout);
+	if (ready < 0) {
+		return errno == EINTR;
+	}
+	for (int i = 0; i < ready; ++i) {
+		// A handler may unwatch descriptors, its own included, so it is looked up for every event and run from a copy
+		auto found = handlers.find(events[i].data.fd);
+		if (found != handlers.end()) {
+			Handler handler = found->second;
+			handler();
+		}
+	}
+	return true;
+}
+
+Timer::Timer() : timerFd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) {
+}
+
+Timer::~Timer() {
+	if (timerFd != -1) {
+		close(timerFd);
+	}
+}
+
+void Timer::arm(std::chrono::milliseconds delay) {
+	struct itimerspec value{};
+	// A zero it_value would disarm the timer
+	auto nanoseconds = std::max<long long>(std::chrono::nanoseconds(delay).count(), 1);
+	value.it_value.tv_sec = nanoseconds / 1000000000;
+	value.it_value.tv_nsec = nanoseconds % 1000000000;
+	timerfd_settime(timerFd, 0, &value, nullptr);
+}
+
+void Timer::disarm() {
+	struct itimerspec value{};
+	timerfd_settime(timerFd, 0, &value, nullptr);
+}
+
+bool Timer::expired() {
+	uint64_t expirations = 0;
+	return read(timerFd, &expirations, sizeof(expirations)) == sizeof(expirations) && expirations > 0;
+}
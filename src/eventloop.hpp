@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+
+// --------------------------------------------------------------
+// Event loop of the interactive prompt
+// --------------------------------------------------------------
+
+// Waits for several descriptors at once with epoll and calls the handler of every one that became readable
+class EventLoop {
+public:
+	using Handler = std::function<void()>;
+
+	EventLoop();
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+	~EventLoop();
+
+	// Returns false if the descriptor cannot be waited for, e.g. a regular file
+	bool watch(int fd, Handler handler);
+	void unwatch(int fd);
+
+	// Wait until a descriptor is readable and run the handlers, timeout in milliseconds, -1 waits forever
+	// Returns false if waiting failed for another reason than a signal
+	bool runOnce(int timeout = -1);
+
+private:
+	int epollFd;
+	std::unordered_map<int, Handler> handlers;
+};
+
+// A one shot timer whose descriptor becomes readable when it expires
+class Timer {
+public:
+	Timer();
+	Timer(const Timer&) = delete;
+	Timer& operator=(const Timer&) = delete;
+	~Timer();
+
+	int fd() const { return timerFd; }
+
+	// Expire after the delay, restarting the timer if it was already running
+	void arm(std::chrono::milliseconds delay);
+	void disarm();
+
+	// Consume the expiration, true if the timer had expired
+	bool expired();
+
+private:
+	int timerFd;
+};
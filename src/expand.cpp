@@ -0,0 +1,400 @@
+#include "expand.hpp"
+
+#include <charconv>
+#include <unistd.h>
+
+#include "glob.hpp"
+#include "parser.hpp"
+#include "shell.hpp"
+#include "variables.hpp"
+
+namespace {
+
+bool isSpecialParameter(char c) {
+	return c == '?' || c == '$' || c == '!' || c == '#' || c == '@' || c == '*';
+}
+
+bool isDigit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+// The positional parameters joined into one word, with the first character of IFS like "$*"
+std::string joinedParameters() {
+	const char* ifs = getVariable("IFS");
+	std::string value;
+	for (size_t i = 0; i < positionalParameters.size(); ++i) {
+		if (i > 0 && (!ifs || *ifs)) {
+			value += ifs ? *ifs : ' ';
+		}
+		value += positionalParameters[i];
+	}
+	return value;
+}
+
+// The value of a parameter, returns false if it is not set
+bool parameterValue(std::string_view name, std::string& value) {
+	if (!name.empty() && isDigit(name[0])) {
+		size_t index = 0;
+		std::from_chars(name.data(), name.data() + name.size(), index);
+		if (index == 0) {
+			value = shellName;
+			return true;
+		}
+		if (index > positionalParameters.size()) {
+			return false;
+		}
+		value = positionalParameters[index - 1];
+		return true;
+	}
+	if (name == "#") {
+		value = std::to_string(positionalParameters.size());
+		return true;
+	}
+	if (name == "@" || name == "*") {
+		value = joinedParameters();
+		return true;
+	}
+	if (name == "?") {
+		value = std::to_string(lastExitStatus);
+		return true;
+	}
+	if (name == "$") {
+		value = std::to_string(getpid());
+		return true;
+	}
+	if (name == "!") {
+		if (lastBackgroundPid <= 0) {
+			return false;
+		}
+		value = std::to_string(lastBackgroundPid);
+		return true;
+	}
+	const char* variable = getVariable(name);
+	if (!variable) {
+		return false;
+	}
+	value = variable;
+	return true;
+}
+
+// Expand the ${...} whose contents are inner: ${NAME}, ${#NAME}, ${NAME:-word} and ${NAME-word}
+bool expandBraces(std::string_view inner, std::string& value, std::string& error) {
+	bool length = inner.size() > 1 && inner[0] == '#';
+	std::string_view rest = length ? inner.substr(1) : inner;
+
+	size_t nameEnd = 0;
+	if (!rest.empty() && isSpecialParameter(rest[0])) {
+		nameEnd = 1;
+	} else if (!rest.empty() && isDigit(rest[0])) {
+		// ${10} is the tenth positional parameter, $10 would be $1 followed by a 0
+		while (nameEnd < rest.size() && isDigit(rest[nameEnd])) {
+			++nameEnd;
+		}
+	} else {
+		while (nameEnd < rest.size() && isVariableName(rest.substr(0, nameEnd + 1))) {
+			++nameEnd;
+		}
+	}
+	std::string_view name = rest.substr(0, nameEnd);
+	std::string_view operation = rest.substr(nameEnd);
+	if (name.empty() || (length && !operation.empty())) {
+		error = "${" + std::string(inner) + "}: bad substitution";
+		return false;
+	}
+
+	bool set = parameterValue(name, value);
+	if (length) {
+		value = std::to_string(set ? value.size() : 0);
+		return true;
+	}
+	if (operation.empty()) {
+		return true;
+	}
+
+	// The default is used if the parameter is unset, with the colon also if it is empty
+	bool colon = operation.starts_with(":-");
+	if (!colon && !operation.starts_with("-")) {
+		error = "${" + std::string(inner) + "}: bad substitution";
+		return false;
+	}
+	if (set && !(colon && value.empty())) {
+		return true;
+	}
+	std::vector<std::string> fields;
+	if (!expandWord(operation.substr(colon ? 2 : 1), fields, false, error)) {
+		return false;
+	}
+	value = fields.empty() ? std::string() : std::move(fields[0]);
+	return true;
+}
+
+// Expand the $ at text[pos], which has to start an expansion, returns the position after it or npos on errors
+size_t expandDollar(std::string_view text, size_t pos, std::string& value, std::string& error) {
+	char next = text[pos + 1];
+	if (next == '(' || next == '{') {
+		size_t end = expansionEnd(text, pos + 1);
+		if (end == std::string_view::npos) {
+			error = std::string("unexpected EOF while looking for matching `") + (next == '(' ? ")" : "}") + "'";
+			return end;
+		}
+		std::string_view inner = text.substr(pos + 2, end - pos - 3);
+		if (next == '(') {
+			value = commandSubstitution(inner);
+			return end;
+		}
+		return expandBraces(inner, value, error) ? end : std::string_view::npos;
+	}
+
+	// $NAME takes the longest name, $1 and the special parameters a single character
+	size_t end = pos + 2;
+	if (!isSpecialParameter(next) && !isDigit(next)) {
+		while (end < text.size() && isVariableName(text.substr(pos + 1, end - pos))) {
+			++end;
+		}
+	}
+	if (!parameterValue(text.substr(pos + 1, end - pos - 1), value)) {
+		value.clear();
+	}
+	return end;
+}
+
+bool isPatternCharacter(char c) {
+	return c == '*' || c == '?' || c == '[' || c == ']' || c == '\\';
+}
+
+// Only unquoted pattern characters and the results of unquoted expansions can make a field a pattern
+// Looking at the word as written spares quoted words like "${PATH}" from looking at what they expand to
+bool mayHavePattern(std::string_view text) {
+	bool doubleQuoted = false;
+	for (size_t pos = 0; pos < text.size(); ++pos) {
+		char c = text[pos];
+		if (c == '\\') {
+			++pos;
+		} else if (c == '"') {
+			doubleQuoted = !doubleQuoted;
+		} else if (doubleQuoted) {
+			// A $(...) or ${...} in double quotes may have quotes of its own
+			if (c == '$' && pos + 1 < text.size() && (text[pos + 1] == '(' || text[pos + 1] == '{')) {
+				pos = expansionEnd(text, pos + 1);
+				if (pos == std::string_view::npos) {
+					return true;
+				}
+				--pos;
+			}
+		} else if (c == '\'') {
+			pos = text.find('\'', pos + 1);
+			if (pos == std::string_view::npos) {
+				return true;
+			}
+		} else if (c == '*' || c == '?' || c == '[' || c == '$') {
+			return true;
+		}
+	}
+	return false;
+}
+
+// A field being built, along with the pattern pathname expansion matches it against
+// Quoted characters are escaped in the pattern, so only unquoted * ? and [ match file names
+// The pattern is only built once an unquoted one shows up, most fields never need it
+struct FieldBuilder {
+	FieldBuilder(std::vector<std::string>& fields, bool glob) : fields(fields), glob(glob) {}
+
+	void quoted(std::string_view text) {
+		started = true;
+		if (glob && !hasPattern) {
+			for (size_t i = 0; i < text.size(); ++i) {
+				if (isPatternCharacter(text[i])) {
+					escaped.push_back(field.size() + i);
+				}
+			}
+		} else if (glob) {
+			for (char c : text) {
+				if (isPatternCharacter(c)) {
+					pattern += '\\';
+				}
+				pattern += c;
+			}
+		}
+		field.append(text);
+	}
+
+	void unquoted(char c) {
+		started = true;
+		if (glob && !hasPattern && (c == '*' || c == '?' || c == '[')) {
+			buildPattern();
+		}
+		field += c;
+		if (hasPattern) {
+			pattern += c;
+		}
+	}
+
+	// The field so far with its quoted pattern characters escaped
+	void buildPattern() {
+		size_t next = 0;
+		for (size_t i = 0; i < field.size(); ++i) {
+			if (next < escaped.size() && escaped[next] == i) {
+				pattern += '\\';
+				++next;
+			}
+			pattern += field[i];
+		}
+		hasPattern = true;
+	}
+
+	// A field whose pattern matches nothing stays as it is
+	// With keepPattern the field is the pattern itself, for case to match against
+	void finish() {
+		if (keepPattern) {
+			if (!hasPattern) {
+				buildPattern();
+			}
+			fields.push_back(std::move(pattern));
+		} else if (!hasPattern || expandPathname(pattern, fields) == 0) {
+			fields.push_back(std::move(field));
+		}
+		field.clear();
+		pattern.clear();
+		escaped.clear();
+		started = false;
+		hasPattern = false;
+	}
+
+	std::vector<std::string>& fields;
+	bool glob;
+	bool keepPattern{false};
+	std::string field{};
+	std::string pattern{};
+	std::vector<size_t> escaped{}; // Positions of quoted pattern characters in the field, until the pattern is built
+	bool started{false}; // Quotes make a field even if it stays empty
+	bool hasPattern{false};
+};
+
+} // namespace
+
+namespace {
+
+// Expand text into field, with split the results of unquoted expansions are split on IFS
+bool expandInto(std::string_view text, FieldBuilder& field, bool split, std::string& error) {
+	const char* ifsVariable = split ? getVariable("IFS") : nullptr;
+	std::string_view ifs = !split ? "" : ifsVariable ? ifsVariable : " \t\n";
+	std::string value;
+	size_t pos = 0;
+	while (pos < text.size()) {
+		char c = text[pos];
+		if (c == '\'') {
+			size_t end = text.find('\'', pos + 1);
+			field.quoted(text.substr(pos + 1, end - pos - 1));
+			pos = end + 1;
+		} else if (c == '"' && split && text.substr(pos).starts_with("\"$@\"")) {
+			// "$@" makes a field of every positional parameter, and none at all without them
+			for (size_t i = 0; i < positionalParameters.size(); ++i) {
+				if (i > 0) {
+					field.finish();
+				}
+				field.quoted(positionalParameters[i]);
+			}
+			pos += 4;
+		} else if (c == '"') {
+			field.quoted("");
+			for (++pos; pos < text.size() && text[pos] != '"';) {
+				if (text[pos] == '\\' && pos + 1 < text.size() && std::string_view("\\$\"`\n").find(text[pos + 1]) != std::string_view::npos) {
+					field.quoted(text.substr(pos + 1, 1));
+					pos += 2;
+				} else if (text[pos] == '$' && startsExpansion(text, pos)) {
+					pos = expandDollar(text, pos, value, error);
+					if (pos == std::string_view::npos) {
+						return false;
+					}
+					field.quoted(value);
+				} else {
+					field.quoted(text.substr(pos++, 1));
+				}
+			}
+			++pos;
+		} else if (c == '\\') {
+			field.quoted(pos + 1 < text.size() ? text.substr(pos + 1, 1) : "");
+			pos += 2;
+		} else if (c == '$' && startsExpansion(text, pos)) {
+			pos = expandDollar(text, pos, value, error);
+			if (pos == std::string_view::npos) {
+				return false;
+			}
+			// Unquoted results are split: IFS whitespace is trimmed and collapsed, any other IFS character
+			// ends a field, an empty one too, along with the IFS whitespace around it
+			bool whitespaceEnded = false; // The last field was ended by IFS whitespace
+			for (char v : value) {
+				if (ifs.find(v) == std::string_view::npos) {
+					field.unquoted(v);
+				} else if (v == ' ' || v == '\t' || v == '\n') {
+					if (field.started) {
+						field.finish();
+						whitespaceEnded = true;
+					}
+				} else {
+					if (!field.started && !whitespaceEnded) {
+						field.quoted("");
+					}
+					if (field.started) {
+						field.finish();
+					}
+					whitespaceEnded = false;
+				}
+			}
+		} else {
+			field.unquoted(c);
+			++pos;
+		}
+	}
+	return true;
+}
+
+} // namespace
+
+bool expandWord(std::string_view text, std::vector<std::string>& fields, bool split, std::string& error) {
+	FieldBuilder field(fields, split && mayHavePattern(text));
+	if (!expandInto(text, field, split, error)) {
+		return false;
+	}
+	if (field.started || !split) {
+		field.finish();
+	}
+	return true;
+}
+
+bool expandPattern(std::string_view text, std::string& pattern, std::string& error) {
+	std::vector<std::string> fields;
+	FieldBuilder field(fields, true);
+	field.keepPattern = true;
+	if (!expandInto(text, field, false, error)) {
+		return false;
+	}
+	field.finish();
+	pattern = std::move(fields[0]);
+	return true;
+}
+
+bool expandHereDocument(std::string_view body, std::string& result, std::string& error) {
+	std::string value;
+	size_t pos = 0;
+	while (pos < body.size()) {
+		char c = body[pos];
+		if (c == '\\' && pos + 1 < body.size() && std::string_view("\\$`\n").find(body[pos + 1]) != std::string_view::npos) {
+			// An escaped newline joins the lines
+			if (body[pos + 1] != '\n') {
+				result += body[pos + 1];
+			}
+			pos += 2;
+		} else if (c == '$' && startsExpansion(body, pos)) {
+			pos = expandDollar(body, pos, value, error);
+			if (pos == std::string_view::npos) {
+				return false;
+			}
+			result += value;
+		} else {
+			result += c;
+			++pos;
+		}
+	}
+	return true;
+}
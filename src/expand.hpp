@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// --------------------------------------------------------------
+// Word expansion
+// --------------------------------------------------------------
+
+// Expand $NAME, ${NAME}, $?, $$, $!, the positional parameters $0 $1 ${10} $# $@ $* and $(...)
+// in a word as written and remove its quotes
+// With split set, the results of unquoted expansions are split into fields on IFS, a word
+// that expands to nothing disappears, a word that is "$@" makes a field of every parameter and
+// a field with an unquoted * ? or [ is replaced by the paths it matches, if there are any.
+// Otherwise the word always makes exactly one field
+// Returns false and sets error if an expansion is malformed
+bool expandWord(std::string_view text, std::vector<std::string>& fields, bool split, std::string& error);
+
+// Expand a pattern of case into a pattern for fnmatch, quoted pattern characters are escaped
+bool expandPattern(std::string_view text, std::string& pattern, std::string& error);
+
+// Expand the body of a here-document whose delimiter was not quoted
+// Quotes are kept as they are, only $ and backslashes in front of $ \ ` and newlines are special
+bool expandHereDocument(std::string_view body, std::string& result, std::string& error);
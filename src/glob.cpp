@@ -0,0 +1,481 @@
+#include "glob.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+
+// Parse the bracket expression whose [ is at pattern[pos] into the bytes it accepts, set may be nullptr
+// Returns the position after the closing ], or npos if there is none, the [ is a literal then
+size_t parseBracket(std::string_view pattern, size_t pos, std::bitset<256>* set) {
+	size_t i = pos + 1;
+	bool negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+	if (negate) {
+		++i;
+	}
+	std::bitset<256> accepted;
+	// A ] right at the start is part of the set
+	for (bool first = true; i < pattern.size() && (pattern[i] != ']' || first); first = false) {
+		if (pattern[i] == '[' && i + 1 < pattern.size() && pattern[i + 1] == ':') {
+			size_t end = pattern.find(":]", i + 2);
+			if (end != std::string_view::npos) {
+				std::string_view name = pattern.substr(i + 2, end - i - 2);
+				for (int c = 0; c < 256; ++c) {
+					bool member = name == "alpha" ? std::isalpha(c) : name == "digit" ? std::isdigit(c) :
+						name == "alnum" ? std::isalnum(c) : name == "upper" ? std::isupper(c) :
+						name == "lower" ? std::islower(c) : name == "space" ? std::isspace(c) :
+						name == "punct" ? std::ispunct(c) : name == "xdigit" ? std::isxdigit(c) : false;
+					accepted[c] = accepted[c] || member;
+				}
+				i = end + 2;
+				continue;
+			}
+		}
+		auto next = [&]() {
+			if (pattern[i] == '\\' && i + 1 < pattern.size()) {
+				++i;
+			}
+			return static_cast<unsigned char>(pattern[i++]);
+		};
+		int low = next();
+		int high = low;
+		if (i + 1 < pattern.size() && pattern[i] == '-' && pattern[i + 1] != ']') {
+			++i;
+			high = next();
+		}
+		for (int c = low; c <= high; ++c) {
+			accepted.set(c);
+		}
+	}
+	if (i >= pattern.size()) {
+		return std::string_view::npos;
+	}
+	if (set) {
+		*set = negate ? ~accepted : accepted;
+	}
+	return i + 1;
+}
+
+// A component without pattern characters, with its escapes removed
+std::string unescape(std::string_view component) {
+	std::string literal;
+	for (size_t i = 0; i < component.size(); ++i) {
+		if (component[i] == '\\' && i + 1 < component.size()) {
+			++i;
+		}
+		literal += component[i];
+	}
+	return literal;
+}
+
+std::string joinPath(std::string_view directory, std::string_view name) {
+	std::string path(directory);
+	if (!path.empty() && path.back() != '/') {
+		path += '/';
+	}
+	return path.append(name);
+}
+
+int openDirectory(const std::string& path) {
+	return open(path.empty() ? "." : path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Read the entries of an open directory with getdents64, without . and ..
+// d_type tells directories from other files, so matching a name never needs a stat
+template <typename Visit>
+bool readEntries(int fd, std::vector<char>& buffer, Visit visit) {
+	while (true) {
+		ssize_t bytes = getdents64(fd, buffer.data(), buffer.size());
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes <= 0) {
+			return bytes == 0;
+		}
+		for (ssize_t offset = 0; offset < bytes;) {
+			const auto* entry = reinterpret_cast<const struct dirent64*>(buffer.data() + offset);
+			offset += entry->d_reclen;
+			std::string_view name = entry->d_name;
+			if (name != "." && name != "..") {
+				visit(name, entry->d_type);
+			}
+		}
+	}
+}
+
+// Symbolic links and file systems without d_type need a stat to tell if an entry is a directory
+bool isDirectory(const std::string& path, unsigned char type) {
+	if (type != DT_LNK && type != DT_UNKNOWN) {
+		return type == DT_DIR;
+	}
+	struct stat status{};
+	return stat(path.c_str(), &status) == 0 && S_ISDIR(status.st_mode);
+}
+
+// --------------------------------------------------------------
+// Directory listings cached while a command is expanded
+// --------------------------------------------------------------
+
+struct ListingEntry {
+	std::string name{};
+	unsigned char type{DT_UNKNOWN};
+};
+
+std::unordered_map<std::string, std::vector<ListingEntry>> listingCache;
+int cacheScopes = 0;
+
+// The entries of a directory, read once per cache scope, nullptr if it cannot be read
+const std::vector<ListingEntry>* cachedListing(const std::string& directory) {
+	auto cached = listingCache.find(directory);
+	if (cached != listingCache.end()) {
+		return &cached->second;
+	}
+	int fd = openDirectory(directory);
+	if (fd == -1) {
+		return nullptr;
+	}
+	std::vector<char> buffer(32 * 1024);
+	std::vector<ListingEntry> entries;
+	bool complete = readEntries(fd, buffer, [&](std::string_view name, unsigned char type) {
+		entries.push_back({std::string(name), type});
+	});
+	close(fd);
+	if (!complete) {
+		return nullptr;
+	}
+	return &listingCache.emplace(directory, std::move(entries)).first->second;
+}
+
+// --------------------------------------------------------------
+// Parallel walk of the trees below **
+// --------------------------------------------------------------
+
+// The trees below some directories, read by one or more threads
+struct TreeWalk {
+	const ComponentMatcher* matcher{nullptr}; // The entries to collect, nullptr for every entry that is not hidden
+	bool directoriesOnly{false};
+	bool linkedDirectories{false}; // Links to directories are collected as directories, they are never walked into
+	std::mutex lock;
+	std::condition_variable changed;
+	std::vector<std::string> pending{}; // Directories still to be read
+	size_t busy{0};                     // Threads reading a directory, they may add more
+	std::vector<std::string> results{};
+};
+
+// Read one directory of a walk, collecting its matching entries and the subdirectories to read next
+// Hidden directories and symbolic links are not followed, like with bash's globstar
+void walkDirectory(const TreeWalk& walk, const std::string& path, std::vector<char>& buffer,
+		std::vector<std::string>& subdirectories, std::vector<std::string>& results) {
+	int fd = openDirectory(path);
+	if (fd == -1) {
+		return;
+	}
+	readEntries(fd, buffer, [&](std::string_view name, unsigned char type) {
+		bool directory = type == DT_DIR;
+		if (type == DT_UNKNOWN) {
+			// d_name is null terminated, so the view can be passed on as it is
+			struct stat status{};
+			directory = fstatat(fd, name.data(), &status, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(status.st_mode);
+		}
+		bool wanted = walk.matcher ? walk.matcher->matches(name) : name[0] != '.';
+		bool linkedDirectory = walk.linkedDirectories && type == DT_LNK && isDirectory(joinPath(path, name), type);
+		if (wanted && (directory || linkedDirectory || !walk.directoriesOnly)) {
+			results.push_back(joinPath(path, name));
+		}
+		if (directory && name[0] != '.') {
+			subdirectories.push_back(joinPath(path, name));
+		}
+	});
+	close(fd);
+}
+
+// Take directories from the walk until none are left and no other thread can add more
+void walkWorker(TreeWalk& walk) {
+	std::vector<char> buffer(32 * 1024);
+	std::vector<std::string> subdirectories;
+	std::vector<std::string> results;
+	std::unique_lock<std::mutex> guard(walk.lock);
+	while (true) {
+		walk.changed.wait(guard, [&] { return !walk.pending.empty() || walk.busy == 0; });
+		if (walk.pending.empty()) {
+			break;
+		}
+		std::string path = std::move(walk.pending.back());
+		walk.pending.pop_back();
+		++walk.busy;
+		guard.unlock();
+		walkDirectory(walk, path, buffer, subdirectories, results);
+		guard.lock();
+		--walk.busy;
+		std::move(subdirectories.begin(), subdirectories.end(), std::back_inserter(walk.pending));
+		if (!subdirectories.empty() || walk.busy == 0) {
+			walk.changed.notify_all();
+		}
+		subdirectories.clear();
+	}
+	std::move(results.begin(), results.end(), std::back_inserter(walk.results));
+}
+
+// Read the trees below the pending directories of the walk
+// Small trees are read by the calling thread alone, threads only start for trees with many directories
+void walkTrees(TreeWalk& walk) {
+	constexpr size_t inlineDirectories = 64;
+	std::vector<char> buffer(32 * 1024);
+	std::vector<std::string> subdirectories;
+	for (size_t visited = 0; !walk.pending.empty() && visited < inlineDirectories; ++visited) {
+		std::string path = std::move(walk.pending.back());
+		walk.pending.pop_back();
+		walkDirectory(walk, path, buffer, subdirectories, walk.results);
+		std::move(subdirectories.begin(), subdirectories.end(), std::back_inserter(walk.pending));
+		subdirectories.clear();
+	}
+	if (walk.pending.empty()) {
+		return;
+	}
+	size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 8);
+	std::vector<std::jthread> workers;
+	for (size_t i = 1; i < threads; ++i) {
+		workers.emplace_back([&walk] { walkWorker(walk); });
+	}
+	walkWorker(walk);
+}
+
+} // namespace
+
+// --------------------------------------------------------------
+// Component matcher
+// --------------------------------------------------------------
+
+ComponentMatcher::ComponentMatcher(std::string_view pattern) {
+	std::vector<std::bitset<256>> atoms;
+	std::vector<bool> isStar;
+	for (size_t pos = 0; pos < pattern.size();) {
+		std::bitset<256> set;
+		char c = pattern[pos];
+		if (c == '*') {
+			// ** inside a component is the same as *
+			if (isStar.empty() || !isStar.back()) {
+				atoms.emplace_back();
+				isStar.push_back(true);
+			}
+			++pos;
+			continue;
+		}
+		if (c == '?') {
+			set.set();
+			++pos;
+		} else if (size_t end = c == '[' ? parseBracket(pattern, pos, &set) : std::string_view::npos; end != std::string_view::npos) {
+			pos = end;
+		} else {
+			if (c == '\\' && pos + 1 < pattern.size()) {
+				c = pattern[++pos];
+			}
+			set.set(static_cast<unsigned char>(c));
+			++pos;
+		}
+		atoms.push_back(set);
+		isStar.push_back(false);
+	}
+
+	leadingDot = pattern.starts_with('.') || pattern.starts_with("\\.");
+	finalState = atoms.size();
+	words = finalState / 64 + 1;
+	accept.assign(256 * words, 0);
+	stars.assign(words, 0);
+	for (size_t i = 0; i < atoms.size(); ++i) {
+		uint64_t bit = uint64_t{1} << (i % 64);
+		if (isStar[i]) {
+			stars[i / 64] |= bit;
+			continue;
+		}
+		for (size_t c = 0; c < 256; ++c) {
+			if (atoms[i][c]) {
+				accept[c * words + i / 64] |= bit;
+			}
+		}
+	}
+}
+
+bool ComponentMatcher::matches(std::string_view name) const {
+	if (name.starts_with('.') && !leadingDot) {
+		return false;
+	}
+
+	// Most patterns have fewer than 64 atoms, their states fit into a single word
+	if (words == 1) {
+		uint64_t star = stars[0];
+		uint64_t states = 1 | (1 & star) << 1;
+		for (unsigned char c : name) {
+			states = ((states & accept[c]) << 1) | (states & star);
+			states |= (states & star) << 1; // A * can also match nothing
+			if (!states) {
+				return false;
+			}
+		}
+		return states >> finalState & 1;
+	}
+
+	std::vector<uint64_t> states(words, 0);
+	std::vector<uint64_t> next(words, 0);
+	auto skipStars = [&](std::vector<uint64_t>& set) {
+		uint64_t carry = 0;
+		for (size_t w = 0; w < words; ++w) {
+			uint64_t skipped = set[w] & stars[w];
+			set[w] |= skipped << 1 | carry;
+			carry = skipped >> 63;
+		}
+	};
+	states[0] = 1;
+	skipStars(states);
+	for (unsigned char c : name) {
+		const uint64_t* mask = &accept[c * words];
+		uint64_t carry = 0;
+		bool alive = false;
+		for (size_t w = 0; w < words; ++w) {
+			uint64_t advanced = states[w] & mask[w];
+			next[w] = advanced << 1 | carry | (states[w] & stars[w]);
+			carry = advanced >> 63;
+			alive = alive || next[w];
+		}
+		if (!alive) {
+			return false;
+		}
+		skipStars(next);
+		states.swap(next);
+	}
+	return states[finalState / 64] >> (finalState % 64) & 1;
+}
+
+// --------------------------------------------------------------
+// Pathname expansion
+// --------------------------------------------------------------
+
+GlobCacheScope::GlobCacheScope() {
+	++cacheScopes;
+}
+
+GlobCacheScope::~GlobCacheScope() {
+	if (--cacheScopes == 0) {
+		listingCache.clear();
+	}
+}
+
+bool hasGlobCharacters(std::string_view pattern) {
+	for (size_t i = 0; i < pattern.size(); ++i) {
+		char c = pattern[i];
+		if (c == '\\') {
+			++i;
+		} else if (c == '*' || c == '?' || (c == '[' && parseBracket(pattern, i, nullptr) != std::string_view::npos)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t expandPathname(std::string_view pattern, std::vector<std::string>& matches) {
+	std::vector<std::string_view> components;
+	for (size_t pos = 0; pos < pattern.size();) {
+		size_t slash = std::min(pattern.find('/', pos), pattern.size());
+		if (slash > pos) {
+			components.push_back(pattern.substr(pos, slash - pos));
+		}
+		pos = slash + 1;
+	}
+	if (components.empty()) {
+		return 0;
+	}
+	// A pattern that ends with / only matches directories
+	bool trailingSlash = pattern.ends_with('/');
+
+	// The paths matched so far, one component at a time
+	std::vector<std::string> paths = {pattern.starts_with('/') ? "/" : ""};
+	for (size_t i = 0; i < components.size() && !paths.empty(); ++i) {
+		bool last = i + 1 == components.size();
+		bool directoriesOnly = !last || trailingSlash;
+		std::string_view component = components[i];
+		std::vector<std::string> next;
+
+		if (component == "**") {
+			TreeWalk walk;
+			walk.pending = paths;
+			walk.directoriesOnly = trailingSlash;
+			walk.linkedDirectories = trailingSlash;
+			std::optional<ComponentMatcher> matcher;
+			if (i + 2 == components.size() && components[i + 1] != "**") {
+				// **/name is matched while the trees are read, instead of listing every directory twice
+				matcher.emplace(components[++i]);
+				walk.matcher = &*matcher;
+			} else {
+				// ** also matches the directory itself, at the end of a pattern as dir/ like in bash
+				for (const auto& path : paths) {
+					if (path.empty() ? !last : isDirectory(path, DT_UNKNOWN)) {
+						next.push_back(last ? joinPath(path, "") : path);
+					}
+				}
+				if (!last) {
+					// Only the directories the walk goes into lead on to the next component
+					walk.directoriesOnly = true;
+					walk.linkedDirectories = false;
+				}
+			}
+			walkTrees(walk);
+			std::move(walk.results.begin(), walk.results.end(), std::back_inserter(next));
+		} else if (!hasGlobCharacters(component)) {
+			// A literal component is only checked once the path is complete, or read by the next component
+			std::string literal = unescape(component);
+			for (const auto& path : paths) {
+				std::string candidate = joinPath(path, literal);
+				struct stat status{};
+				if (!last || (trailingSlash ? stat(candidate.c_str(), &status) == 0 && S_ISDIR(status.st_mode) : lstat(candidate.c_str(), &status) == 0)) {
+					next.push_back(std::move(candidate));
+				}
+			}
+		} else {
+			ComponentMatcher matcher(component);
+			for (const auto& path : paths) {
+				const std::vector<ListingEntry>* listing = cachedListing(path);
+				if (!listing) {
+					continue;
+				}
+				for (const auto& entry : *listing) {
+					if (!matcher.matches(entry.name)) {
+						continue;
+					}
+					std::string candidate = joinPath(path, entry.name);
+					if (!directoriesOnly || isDirectory(candidate, entry.type)) {
+						next.push_back(std::move(candidate));
+					}
+				}
+			}
+		}
+		paths = std::move(next);
+	}
+
+	if (cacheScopes == 0) {
+		listingCache.clear();
+	}
+	if (trailingSlash) {
+		for (auto& path : paths) {
+			if (!path.ends_with('/')) {
+				path += '/';
+			}
+		}
+	}
+	// Overlapping trees, as in **/**/name, find the same path more than once
+	std::sort(paths.begin(), paths.end());
+	paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+	std::move(paths.begin(), paths.end(), std::back_inserter(matches));
+	return paths.size();
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// --------------------------------------------------------------
+// Pathname expansion
+// --------------------------------------------------------------
+
+// Patterns use * ? and [...] within a path component, and ** as a whole component for any
+// number of directories, like bash's globstar. A backslash makes the next character literal.
+// Names starting with a dot only match a pattern that starts with a literal dot, . and .. never match.
+
+// True if the pattern has a * ? or [...] that is not escaped
+bool hasGlobCharacters(std::string_view pattern);
+
+// Append the paths matching the pattern to matches, sorted, returns how many there were
+size_t expandPathname(std::string_view pattern, std::vector<std::string>& matches);
+
+// A pattern for one path component, compiled into a bit-parallel automaton
+//
+// State i means that the first i atoms of the pattern matched. Every character of a name
+// advances all states at once with a few word operations, so a name is matched in one pass,
+// without backtracking, however many * the pattern has.
+class ComponentMatcher {
+public:
+	explicit ComponentMatcher(std::string_view pattern);
+
+	bool matches(std::string_view name) const;
+
+private:
+	size_t words{1};       // 64 bit words per state set
+	size_t finalState{0};  // Reached once every atom matched
+	std::vector<uint64_t> accept{}; // For every byte value the atoms that accept it, words per row
+	std::vector<uint64_t> stars{};  // Atoms that are *, they stay active and can also be skipped
+	bool leadingDot{false}; // The pattern starts with a literal dot, so hidden names may match
+};
+
+// Directory listings read while a scope is alive are reused for every pattern of the scope,
+// so `ls *.c *.h` reads the directory once. Scopes nest, the outermost one drops the listings.
+class GlobCacheScope {
+public:
+	GlobCacheScope();
+	GlobCacheScope(const GlobCacheScope&) = delete;
+	GlobCacheScope& operator=(const GlobCacheScope&) = delete;
+	~GlobCacheScope();
+};
@@ -0,0 +1,501 @@
+#include "history.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+// Map an open file read-only, returns nullptr for empty files and anything that is not a regular file
+const char* mapDescriptor(int fd, size_t& size) {
+	size = 0;
+	struct stat info;
+	void* data = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+		data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	if (data == MAP_FAILED) {
+		return nullptr;
+	}
+	size = info.st_size;
+	return static_cast<const char*>(data);
+}
+
+const char* mapWholeFile(const std::string& path, size_t& size) {
+	size = 0;
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return nullptr;
+	}
+	const char* data = mapDescriptor(fd, size);
+	close(fd);
+	return data;
+}
+
+void lockFile(int fd, int operation) {
+	while (flock(fd, operation) == -1 && errno == EINTR) {}
+}
+
+// True if the descriptor still refers to the file at path
+bool sameFile(int fd, const std::string& path) {
+	struct stat opened;
+	struct stat current;
+	return fstat(fd, &opened) == 0 && stat(path.c_str(), &current) == 0 && opened.st_dev == current.st_dev && opened.st_ino == current.st_ino;
+}
+
+// Open and lock a history file, retrying if another shell replaced it while we waited for the lock
+int openLocked(const std::string& path, int flags, int lockOperation) {
+	while (true) {
+		int fd = open(path.c_str(), flags | O_CLOEXEC, 0600);
+		if (fd == -1) {
+			return -1;
+		}
+		lockFile(fd, lockOperation);
+		if (sameFile(fd, path)) {
+			return fd;
+		}
+		close(fd); // Closing also releases the lock
+	}
+}
+
+// Write one line per entry with as few writev calls as possible
+bool writeEntries(int fd, const std::vector<const std::string*>& entries) {
+	static const char newline = '\n';
+	std::vector<iovec> iov;
+	iov.reserve(entries.size() * 2);
+	for (const std::string* entry : entries) {
+		iov.push_back({const_cast<char*>(entry->data()), entry->size()});
+		iov.push_back({const_cast<char*>(&newline), 1});
+	}
+
+	size_t index = 0;
+	while (index < iov.size()) {
+		ssize_t bytes = writev(fd, &iov[index], std::min<size_t>(iov.size() - index, IOV_MAX));
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		// Skip what was written, a partial write continues in the middle of an entry
+		size_t remaining = bytes;
+		while (remaining > 0) {
+			if (remaining >= iov[index].iov_len) {
+				remaining -= iov[index].iov_len;
+				++index;
+			} else {
+				iov[index].iov_base = static_cast<char*>(iov[index].iov_base) + remaining;
+				iov[index].iov_len -= remaining;
+				remaining = 0;
+			}
+		}
+	}
+	return true;
+}
+
+// Replace a file by writing a temporary file and renaming it over the original
+// The caller holds the lock of the original, shells appending to it notice the new file after taking the lock
+// A symlink is followed and the file it points to is replaced, with its mode kept. Anything but a
+// regular file, like /dev/null or a FIFO, is written in place so it is not turned into a regular file
+template <typename Fill>
+bool replaceFile(const std::string& path, Fill fill) {
+	std::string target = path;
+	if (char* resolved = realpath(path.c_str(), nullptr)) {
+		target = resolved;
+		std::free(resolved);
+	}
+	struct stat original;
+	if (stat(target.c_str(), &original) != 0 || !S_ISREG(original.st_mode)) {
+		int fd = open(target.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+		if (fd == -1) {
+			return false;
+		}
+		bool ok = fill(fd);
+		return close(fd) == 0 && ok;
+	}
+
+	std::string temporary = target + ".tmp";
+	int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		return false;
+	}
+	bool ok = fill(fd) && fchmod(fd, original.st_mode & 07777) == 0;
+	ok = close(fd) == 0 && ok;
+	if (!ok || std::rename(temporary.c_str(), target.c_str()) != 0) {
+		unlink(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Find where the line ending at `end` starts
+size_t lineStart(const char* data, size_t end) {
+	const void* newline = memrchr(data, '\n', end);
+	return newline ? static_cast<const char*>(newline) - data + 1 : 0;
+}
+
+} // namespace
+
+HistoryStore::~HistoryStore() {
+	unmapFile();
+}
+
+void HistoryStore::setCapacity(size_t capacity) {
+	if (capacity == ringCapacity) {
+		return;
+	}
+	// Keep the newest entries, in order, at the start of a new ring
+	size_t kept = std::min(ringCount, capacity);
+	std::vector<HistoryEntry> resized;
+	resized.reserve(kept);
+	for (size_t i = ringCount - kept; i < ringCount; ++i) {
+		resized.push_back(std::move(ring[(ringStart + i) % ringCapacity]));
+	}
+	ring = std::move(resized);
+	ringStart = 0;
+	ringCount = kept;
+	ringCapacity = capacity;
+}
+
+void HistoryStore::mapFile(const std::string& path) {
+	unmapFile();
+	fileLines.clear();
+	fileData = mapWholeFile(path, fileSize);
+	// The newline at the end of the file does not start another line
+	fileCursor = fileSize;
+	if (fileCursor > 0 && fileData[fileCursor - 1] == '\n') {
+		--fileCursor;
+	}
+}
+
+void HistoryStore::unmapFile() {
+	if (fileData) {
+		munmap(const_cast<char*>(fileData), fileSize);
+	}
+	fileData = nullptr;
+	fileSize = 0;
+	fileCursor = 0;
+}
+
+void HistoryStore::detachFile() {
+	if (!fileData) {
+		return;
+	}
+	size_t visible = ringCapacity > ringCount ? ringCapacity - ringCount : 0;
+	indexFile(visible);
+	fileLines.resize(std::min(fileLines.size(), visible));
+	for (size_t i = 0; i < fileLines.size(); ++i) {
+		fileLineAt(i);
+	}
+	unmapFile();
+}
+
+void HistoryStore::indexFile(size_t wanted) {
+	while (fileLines.size() < wanted && fileCursor > 0) {
+		size_t start = lineStart(fileData, fileCursor);
+		fileLines.push_back(HistorySlot{{}, start, fileCursor - start});
+		// Continue in front of the newline that ends the previous line
+		fileCursor = start > 0 ? start - 1 : 0;
+	}
+}
+
+const std::string& HistoryStore::fileLineAt(size_t distance) {
+	HistorySlot& line = fileLines[distance];
+	if (line.mapped) {
+		line.text.assign(fileData + line.offset, line.length);
+		line.mapped = false;
+	}
+	return line.text;
+}
+
+void HistoryStore::add(std::string_view line, bool isNew) {
+	if (ringCapacity == 0) {
+		return;
+	}
+	if (ring.size() < ringCapacity) {
+		ring.push_back(HistoryEntry{std::string(line), isNew});
+	} else {
+		HistoryEntry& entry = ring[(ringStart + ringCount) % ringCapacity];
+		entry.text.assign(line);
+		entry.isNew = isNew;
+	}
+	if (ringCount < ringCapacity) {
+		++ringCount;
+	} else {
+		ringStart = (ringStart + 1) % ringCapacity;
+	}
+	++added;
+
+	// Once the session fills the store, the lines of the file are never visible again
+	if (ringCount == ringCapacity && (fileData || !fileLines.empty())) {
+		unmapFile();
+		fileLines.clear();
+		fileLines.shrink_to_fit();
+	}
+}
+
+size_t HistoryStore::size() {
+	size_t visible = ringCapacity - ringCount;
+	indexFile(visible);
+	return ringCount + std::min(fileLines.size(), visible);
+}
+
+const std::string& HistoryStore::at(size_t index) {
+	size_t fileEntries = size() - ringCount;
+	if (index < fileEntries) {
+		return fileLineAt(fileEntries - 1 - index);
+	}
+	return ringAt(index - fileEntries).text;
+}
+
+const std::string* HistoryStore::fromEnd(size_t distance) {
+	if (distance < ringCount) {
+		return &ringAt(ringCount - 1 - distance).text;
+	}
+	if (distance >= ringCapacity) {
+		return nullptr;
+	}
+	size_t fileDistance = distance - ringCount;
+	indexFile(fileDistance + 1);
+	if (fileDistance >= fileLines.size()) {
+		return nullptr;
+	}
+	return &fileLineAt(fileDistance);
+}
+
+std::vector<const std::string*> HistoryStore::entriesSince(uint64_t sequence) const {
+	std::vector<const std::string*> entries;
+	uint64_t newer = added > sequence ? added - sequence : 0;
+	for (size_t i = ringCount - std::min<uint64_t>(newer, ringCount); i < ringCount; ++i) {
+		if (ringAt(i).isNew) {
+			entries.push_back(&ringAt(i).text);
+		}
+	}
+	return entries;
+}
+
+void HistoryStore::clear() {
+	ring.clear();
+	ringStart = ringCount = 0;
+	unmapFile();
+	fileLines.clear();
+}
+
+
+// --------------------------------------------------------------
+// History file writer
+// --------------------------------------------------------------
+
+HistoryWriter::~HistoryWriter() {
+	close();
+}
+
+bool HistoryWriter::open(const std::string& filePath, const HistoryStore& store) {
+	close();
+	path = filePath;
+	fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	markWritten(store);
+	return fd != -1;
+}
+
+void HistoryWriter::close() {
+	if (fd != -1) {
+		::close(fd);
+	}
+	fd = -1;
+}
+
+bool HistoryWriter::isFile(const std::string& other) const {
+	struct stat opened;
+	struct stat current;
+	return fd != -1 && fstat(fd, &opened) == 0 && stat(other.c_str(), &current) == 0 && opened.st_dev == current.st_dev && opened.st_ino == current.st_ino;
+}
+
+bool HistoryWriter::lock() {
+	lockFile(fd, LOCK_EX);
+	if (sameFile(fd, path)) {
+		return true;
+	}
+	// history -w or a trim replaced the file, continue with the new one
+	::close(fd);
+	fd = openLocked(path, O_WRONLY | O_APPEND | O_CREAT, LOCK_EX);
+	return fd != -1;
+}
+
+void HistoryWriter::commandAdded(const HistoryStore& store) {
+	if (fd == -1) {
+		return;
+	}
+	if (flushEvery > 0 && ++pending >= flushEvery && !deferred) {
+		flush(store);
+	}
+}
+
+void HistoryWriter::flush(const HistoryStore& store, bool exiting) {
+	if (fd == -1) {
+		return;
+	}
+	std::vector<const std::string*> entries = store.entriesSince(written);
+	if (!entries.empty() && lock()) {
+		writeEntries(fd, entries);
+		if (sync == HistorySync::Always) {
+			fdatasync(fd);
+		}
+		lockFile(fd, LOCK_UN);
+	}
+	if (exiting && sync == HistorySync::OnExit && fd != -1) {
+		fdatasync(fd);
+	}
+	markWritten(store);
+}
+
+void HistoryWriter::truncate(size_t maxLines) {
+	if (fd == -1 || !lock()) {
+		return;
+	}
+	size_t size = 0;
+	const char* data = mapWholeFile(path, size);
+	if (data) {
+		// Walk back over maxLines lines from the end of the file
+		size_t cursor = size > 0 && data[size - 1] == '\n' ? size - 1 : size;
+		size_t keepFrom = size;
+		for (size_t lines = 0; lines < maxLines && cursor > 0; ++lines) {
+			keepFrom = lineStart(data, cursor);
+			cursor = keepFrom > 0 ? keepFrom - 1 : 0;
+		}
+		if (cursor == 0 && maxLines > 0) {
+			keepFrom = 0; // The whole file fits
+		}
+
+		// Shells that mapped the old file keep reading it, shells appending to it reopen the new one
+		if (keepFrom > 0) {
+			replaceFile(path, [&](int out) {
+				for (size_t written = keepFrom; written < size;) {
+					ssize_t bytes = write(out, data + written, size - written);
+					if (bytes <= 0) {
+						return false;
+					}
+					written += bytes;
+				}
+				return true;
+			});
+		}
+		munmap(const_cast<char*>(data), size);
+	}
+	lockFile(fd, LOCK_UN);
+}
+
+bool appendHistoryEntries(const std::string& path, const std::vector<const std::string*>& entries) {
+	int fd = openLocked(path, O_WRONLY | O_APPEND | O_CREAT, LOCK_EX);
+	if (fd == -1) {
+		return false;
+	}
+	bool ok = writeEntries(fd, entries);
+	close(fd);
+	return ok;
+}
+
+bool rewriteHistoryFile(const std::string& path, const std::vector<const std::string*>& entries) {
+	// Lock the current file, so appending shells wait and then switch to the new one
+	int fd = openLocked(path, O_WRONLY | O_CREAT, LOCK_EX);
+	if (fd == -1) {
+		return false;
+	}
+	bool ok = replaceFile(path, [&](int out) { return writeEntries(out, entries); });
+	close(fd);
+	return ok;
+}
+
+bool readHistoryFile(const std::string& path, HistoryStore& store) {
+	// A shared lock keeps us from reading a batch that is only partially written
+	int fd = openLocked(path, O_RDONLY, LOCK_SH);
+	if (fd == -1) {
+		return false;
+	}
+	size_t size = 0;
+	const char* data = mapDescriptor(fd, size);
+	close(fd);
+
+	for (size_t start = 0; start < size;) {
+		const void* newline = std::memchr(data + start, '\n', size - start);
+		size_t end = newline ? static_cast<const char*>(newline) - data : size;
+		store.add(std::string_view(data + start, end - start), false);
+		start = end + 1;
+	}
+	if (data) {
+		munmap(const_cast<char*>(data), size);
+	}
+	return true;
+}
+
+// --------------------------------------------------------------
+// History expansion
+// --------------------------------------------------------------
+
+bool expandHistory(std::string_view line, HistoryStore& store, std::string& result, std::string& error) {
+	result.clear();
+	bool singleQuoted = false;
+	bool doubleQuoted = false;
+	for (size_t i = 0; i < line.size(); ++i) {
+		char c = line[i];
+		// The backslash stays, the parser removes it later
+		if (c == '\\' && !singleQuoted && i + 1 < line.size()) {
+			result += line.substr(i, 2);
+			++i;
+			continue;
+		}
+		if (c == '\'' && !doubleQuoted) {
+			singleQuoted = !singleQuoted;
+		} else if (c == '"' && !singleQuoted) {
+			doubleQuoted = !doubleQuoted;
+		}
+		if (c != '!' || singleQuoted || i + 1 == line.size()) {
+			result += c;
+			continue;
+		}
+
+		const std::string* event = nullptr;
+		size_t end = i + 1;
+		if (line[end] == '!') {
+			event = store.fromEnd(0);
+			++end;
+		} else {
+			bool relative = line[end] == '-';
+			size_t digits = end + relative;
+			end = digits;
+			while (end < line.size() && std::isdigit(static_cast<unsigned char>(line[end]))) {
+				++end;
+			}
+			if (end == digits) {
+				result += c;
+				continue;
+			}
+			size_t number = 0;
+			if (std::from_chars(line.data() + digits, line.data() + end, number).ec == std::errc{} && number > 0) {
+				if (relative) {
+					event = store.fromEnd(number - 1);
+				} else if (number <= store.size()) {
+					event = &store.at(number - 1);
+				}
+			}
+		}
+		if (!event) {
+			error = std::string(line.substr(i, end - i)) + ": event not found";
+			return false;
+		}
+		result += *event;
+		i = end - 1;
+	}
+	return true;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// --------------------------------------------------------------
+// Command history
+// --------------------------------------------------------------
+
+// A line of the history file, copied out of the mapping the first time it is used
+struct HistorySlot {
+	std::string text{};
+	size_t offset{0}; // Position of the line in the mapped file
+	size_t length{0};
+	bool mapped{true};
+};
+
+// An entry of this session, only entries that were typed in count for history -a
+struct HistoryEntry {
+	std::string text{};
+	bool isNew{true};
+};
+
+// History with a fixed capacity (HISTSIZE)
+//
+// Lines entered in this session live in a ring buffer that grows up to the capacity and then
+// overwrites its oldest entry. Older entries come from the history file, which is mapped into
+// memory and split into lines from its end only as far back as an access needs. Starting the
+// shell with a huge history file therefore costs neither time nor memory until it is used.
+class HistoryStore {
+public:
+	HistoryStore() = default;
+	HistoryStore(const HistoryStore&) = delete;
+	HistoryStore& operator=(const HistoryStore&) = delete;
+	~HistoryStore();
+
+	// Change the number of entries kept, dropping the oldest ones if needed
+	void setCapacity(size_t capacity);
+	size_t capacity() const { return ringCapacity; }
+
+	// Use the lines of a history file as the oldest entries, replacing the previous file
+	void mapFile(const std::string& path);
+
+	// Copy every visible line of the mapped file and unmap it
+	// Has to be called before the mapped file is rewritten
+	void detachFile();
+
+	// Add an entry, evicting the oldest one if the store is full
+	// Entries that are not new do not count for history -a
+	void add(std::string_view line, bool isNew = true);
+
+	// Number of entries, indexes the mapped file up to the capacity
+	size_t size();
+
+	// Entry by position, 0 is the oldest entry
+	const std::string& at(size_t index);
+
+	// Entry by distance from the newest one, indexing only as much of the file as needed
+	// Returns nullptr if there are not that many entries
+	const std::string* fromEnd(size_t distance);
+
+	// Sequence number of the newest entry, every add increments it
+	uint64_t sequence() const { return added; }
+
+	// New entries added after the given sequence number that are still in the store, oldest first
+	std::vector<const std::string*> entriesSince(uint64_t sequence) const;
+
+	void clear();
+
+private:
+	const HistoryEntry& ringAt(size_t index) const { return ring[(ringStart + index) % ringCapacity]; }
+	const std::string& fileLineAt(size_t distance);
+
+	// Split lines off the end of the unindexed part of the file until `wanted` lines are known
+	void indexFile(size_t wanted);
+	void unmapFile();
+
+	size_t ringCapacity{1000};
+	std::vector<HistoryEntry> ring{}; // Grows up to the capacity, then wraps around
+	size_t ringStart{0};
+	size_t ringCount{0};
+	uint64_t added{0}; // Number of entries ever added
+
+	const char* fileData{nullptr};
+	size_t fileSize{0};
+	size_t fileCursor{0}; // Everything in front of the cursor has not been split into lines yet
+	std::vector<HistorySlot> fileLines{}; // Indexed lines of the file, the newest first
+};
+
+// --------------------------------------------------------------
+// History file writer
+// --------------------------------------------------------------
+
+// When history writes are forced to disk
+enum class HistorySync {
+	Never,  // Leave it to the kernel
+	OnExit, // Once when the shell exits
+	Always  // After every write
+};
+
+// Appends the new entries of a HistoryStore to HISTFILE
+//
+// The file stays open with O_APPEND. Entries are batched into a single writev, every
+// `flushEvery` commands, made while holding an exclusive flock so that shells sharing
+// the file never interleave partial lines. Files are only ever replaced by renaming a new
+// one over them, never rewritten in place, so shells that mapped the old file keep a
+// consistent view and a crash can never leave a half written history behind.
+class HistoryWriter {
+public:
+	HistoryWriter() = default;
+	HistoryWriter(const HistoryWriter&) = delete;
+	HistoryWriter& operator=(const HistoryWriter&) = delete;
+	~HistoryWriter();
+
+	// Open the history file, everything already in the store counts as written
+	bool open(const std::string& path, const HistoryStore& store);
+	void close();
+
+	// Commands per write, 0 only writes on flush
+	void setFlushEvery(size_t commands) { flushEvery = commands; }
+	void setSync(HistorySync policy) { sync = policy; }
+
+	// Deferred writes are left to the caller, which flushes once flushDue() while the user is idle
+	void setDeferred(bool defer) { deferred = defer; }
+	bool flushDue() const { return fd != -1 && flushEvery > 0 && pending >= flushEvery; }
+
+	// Called after every command added to the store, writes once enough commands are pending
+	void commandAdded(const HistoryStore& store);
+
+	// Write every pending entry, syncing if the policy asks for it
+	void flush(const HistoryStore& store, bool exiting = false);
+
+	// Everything in the store up to now is in the file, e.g. after history -w rewrote it
+	void markWritten(const HistoryStore& store) { written = store.sequence(); pending = 0; }
+
+	// Keep only the last maxLines lines of the file (HISTFILESIZE)
+	// The trimmed file replaces the old one under the lock, other shells switch to it on their next write
+	void truncate(size_t maxLines);
+
+	// True if path names the file this writer appends to
+	bool isFile(const std::string& other) const;
+
+private:
+	// Take the exclusive lock, switching to a new file if ours was replaced
+	bool lock();
+
+	std::string path{};
+	int fd{-1};
+	size_t flushEvery{1};
+	size_t pending{0};
+	bool deferred{false};
+	uint64_t written{0};
+	HistorySync sync{HistorySync::Never};
+};
+
+// Append entries to a file with a single locked writev (history -a)
+bool appendHistoryEntries(const std::string& path, const std::vector<const std::string*>& entries);
+
+// Replace the contents of a file with the given entries, under the lock (history -w)
+bool rewriteHistoryFile(const std::string& path, const std::vector<const std::string*>& entries);
+
+// Add every line of a file to the store as an old entry, under a shared lock (history -r)
+bool readHistoryFile(const std::string& path, HistoryStore& store);
+
+// --------------------------------------------------------------
+// History expansion
+// --------------------------------------------------------------
+
+// Replace !! with the previous command, !n with entry n as history numbers it and !-n with the
+// n-th previous command. A ! in single quotes, after a backslash or not followed by !, a digit or
+// -digit stays as it is, so `! cmd` and `[ a != b ]` are left alone.
+// result gets the line after expansion, returns false and sets error for an event not in the store
+bool expandHistory(std::string_view line, HistoryStore& store, std::string& result, std::string& error);
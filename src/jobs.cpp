@@ -0,0 +1,165 @@
+#include "jobs.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sys/wait.h>
+
+int exitStatusFromWait(int status) {
+	if (WIFEXITED(status)) {
+		return WEXITSTATUS(status);
+	}
+	if (WIFSIGNALED(status)) {
+		return 128 + WTERMSIG(status);
+	}
+	return status;
+}
+
+Job& JobTable::add(pid_t processGroup, std::vector<pid_t> pids, std::string_view command, JobState state) {
+	int id = table.empty() ? 1 : table.rbegin()->first + 1;
+	Job& job = table[id];
+	job.id = id;
+	job.processGroup = processGroup;
+	job.command = command;
+	job.exited.assign(pids.size(), false);
+	job.pids = std::move(pids);
+	job.state = state;
+	makeCurrent(id);
+	return job;
+}
+
+void JobTable::remove(int id) {
+	table.erase(id);
+	std::erase(recent, id);
+}
+
+Job* JobTable::find(std::string_view spec) {
+	if (spec == "%%" || spec == "%+" || spec == "%") {
+		return current();
+	}
+	if (spec == "%-") {
+		return previous();
+	}
+
+	bool jobNumber = spec.starts_with('%');
+	if (jobNumber) {
+		spec.remove_prefix(1);
+	}
+	if (!spec.empty() && std::all_of(spec.begin(), spec.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+		long number = std::strtol(std::string(spec).c_str(), nullptr, 10);
+		if (jobNumber) {
+			auto it = table.find(number);
+			return it != table.end() ? &it->second : nullptr;
+		}
+		for (auto& [id, job] : table) {
+			if (std::find(job.pids.begin(), job.pids.end(), number) != job.pids.end()) {
+				return &job;
+			}
+		}
+		return nullptr;
+	}
+
+	// %name picks the job whose command starts with name
+	if (jobNumber && !spec.empty()) {
+		for (auto it = recent.rbegin(); it != recent.rend(); ++it) {
+			if (table[*it].command.starts_with(spec)) {
+				return &table[*it];
+			}
+		}
+	}
+	return nullptr;
+}
+
+Job* JobTable::current() {
+	return recent.empty() ? nullptr : &table[recent.back()];
+}
+
+Job* JobTable::previous() {
+	return recent.size() < 2 ? nullptr : &table[recent[recent.size() - 2]];
+}
+
+void JobTable::makeCurrent(int id) {
+	std::erase(recent, id);
+	recent.push_back(id);
+}
+
+char JobTable::marker(const Job& job) {
+	if (current() == &job) {
+		return '+';
+	}
+	return previous() == &job ? '-' : ' ';
+}
+
+void JobTable::update(Job& job, size_t index, int status) {
+	if (WIFSTOPPED(status)) {
+		if (job.state != JobState::Stopped) {
+			job.state = JobState::Stopped;
+			job.notified = false;
+			makeCurrent(job.id);
+		}
+		return;
+	}
+	if (WIFCONTINUED(status)) {
+		job.state = JobState::Running;
+		return;
+	}
+
+	job.exited[index] = true;
+	if (index + 1 == job.pids.size()) {
+		job.status = exitStatusFromWait(status);
+	}
+	if (std::all_of(job.exited.begin(), job.exited.end(), [](bool exited) { return exited; })) {
+		job.state = JobState::Done;
+		job.notified = false;
+	}
+}
+
+void JobTable::reap() {
+	for (auto& [id, job] : table) {
+		for (size_t i = 0; i < job.pids.size(); ++i) {
+			if (job.exited[i]) {
+				continue;
+			}
+			int status = 0;
+			pid_t result = waitpid(job.pids[i], &status, WNOHANG | WUNTRACED | WCONTINUED);
+			if (result == job.pids[i]) {
+				update(job, i, status);
+			} else if (result == -1 && errno == ECHILD) {
+				// Somebody else collected it, there is nothing left to wait for
+				update(job, i, 0);
+			}
+		}
+	}
+}
+
+void JobTable::waitFor(Job& job, bool untraced) {
+	while (job.state != JobState::Done && !(untraced && job.state == JobState::Stopped)) {
+		// Wait for the first process that is still running, the others are collected on the way
+		size_t index = std::find(job.exited.begin(), job.exited.end(), false) - job.exited.begin();
+		int status = 0;
+		pid_t result = waitpid(job.pids[index], &status, untraced ? WUNTRACED : 0);
+		if (result == -1 && errno == EINTR) {
+			continue;
+		}
+		update(job, index, result == job.pids[index] ? status : 0);
+	}
+}
+
+std::string jobStateText(const Job& job) {
+	switch (job.state) {
+		case JobState::Running:
+			return "Running";
+		case JobState::Stopped:
+			return "Stopped";
+		case JobState::Done:
+			if (job.status == 0) {
+				return "Done";
+			}
+			if (job.status > 128 && job.status - 128 < NSIG) {
+				return strsignal(job.status - 128);
+			}
+			return "Exit " + std::to_string(job.status);
+	}
+	return "";
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+// --------------------------------------------------------------
+// Job table
+// --------------------------------------------------------------
+
+// Convert a status returned by waitpid into a shell exit status
+int exitStatusFromWait(int status);
+
+enum class JobState {
+	Running,
+	Stopped,
+	Done
+};
+
+// A pipeline the shell does not wait for in the foreground, all its processes share one process group
+struct Job {
+	int id{0};
+	pid_t processGroup{0};
+	std::string command{};
+	std::vector<pid_t> pids{}; // One per external stage, or the subshell that runs the pipeline
+	std::vector<bool> exited{};
+	int status{0};             // Exit status of the last process, valid once the job is done
+	JobState state{JobState::Running};
+	bool notified{false};      // The user has been told about the current state
+};
+
+// The jobs of the shell, numbered like bash: a new job gets the highest number in use plus one
+//
+// Processes are only ever reaped through the pids of the jobs, never with waitpid(-1), so
+// the foreground commands the shell waits for itself are not taken away from it.
+class JobTable {
+public:
+	Job& add(pid_t processGroup, std::vector<pid_t> pids, std::string_view command, JobState state = JobState::Running);
+	void remove(int id);
+
+	// Look up a job by %n, %%, %+, %-, %prefix or a pid of one of its processes
+	// Returns nullptr if there is no such job
+	Job* find(std::string_view spec);
+
+	// The job fg and bg use without an argument, and the one before it
+	Job* current();
+	Job* previous();
+	void makeCurrent(int id);
+
+	// Collect every job process that changed state, without blocking
+	void reap();
+
+	// Block until the job is done, or also stopped if untraced is set
+	void waitFor(Job& job, bool untraced);
+
+	// Marker bash prints after the job number: + for the current job, - for the previous one
+	char marker(const Job& job);
+
+	std::map<int, Job>& jobs() { return table; }
+	bool empty() const { return table.empty(); }
+
+private:
+	// Record a state change reported by waitpid for one process of the job
+	void update(Job& job, size_t index, int status);
+
+	std::map<int, Job> table{};
+	std::vector<int> recent{}; // Job ids, the most recently started, stopped or resumed last
+};
+
+// Text bash uses for the state of a job in jobs and notifications, e.g. "Running" or "Exit 2"
+std::string jobStateText(const Job& job);
@@ -0,0 +1,91 @@
+#include "output.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <sys/uio.h>
+
+OutputSink::OutputSink(int fd, size_t capacity) : target(fd), buffer(new char[capacity]), capacity(capacity) {}
+
+OutputSink::OutputSink(std::string& capture, size_t capacity) : target(-1), capture(&capture), buffer(new char[capacity]), capacity(capacity) {}
+
+OutputSink::~OutputSink() {
+	flush();
+}
+
+void OutputSink::write(std::string_view data) {
+	if (used + data.size() <= capacity) {
+		std::memcpy(buffer.get() + used, data.data(), data.size());
+		used += data.size();
+		return;
+	}
+	writeOut(data);
+}
+
+void OutputSink::put(char c) {
+	if (used == capacity) {
+		flush();
+	}
+	buffer[used++] = c;
+}
+
+void OutputSink::writeNumber(uint64_t number) {
+	char digits[20];
+	auto result = std::to_chars(digits, digits + sizeof(digits), number);
+	write(std::string_view(digits, result.ptr - digits));
+}
+
+void OutputSink::writePadded(uint64_t number, size_t width) {
+	char digits[20];
+	auto result = std::to_chars(digits, digits + sizeof(digits), number);
+	for (size_t length = result.ptr - digits; length < width; ++length) {
+		put(' ');
+	}
+	write(std::string_view(digits, result.ptr - digits));
+}
+
+void OutputSink::flush() {
+	if (used > 0) {
+		writeOut({});
+	}
+}
+
+bool OutputSink::writeOut(std::string_view data) {
+	if (capture) {
+		capture->append(buffer.get(), used);
+		capture->append(data);
+		used = 0;
+		return true;
+	}
+
+	iovec iov[2] = {{buffer.get(), used}, {const_cast<char*>(data.data()), data.size()}};
+	int first = used > 0 ? 0 : 1;
+	int count = data.empty() ? 1 : 2;
+	used = 0;
+	if (writeFailed) {
+		return false;
+	}
+
+	while (first < count) {
+		ssize_t bytes = writev(target, iov + first, count - first);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// A reader that went away does not come back, other errors only lose this write
+			writeFailed = errno == EPIPE;
+			return false;
+		}
+		// Skip what was written, a partial write continues in the middle of a part
+		size_t remaining = bytes;
+		while (first < count && remaining >= iov[first].iov_len) {
+			remaining -= iov[first].iov_len;
+			++first;
+		}
+		if (first < count) {
+			iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + remaining;
+			iov[first].iov_len -= remaining;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// --------------------------------------------------------------
+// Buffered output of builtins
+// --------------------------------------------------------------
+
+// Writes to a file descriptor through a fixed size buffer
+//
+// Small writes are collected in the buffer. A write that does not fit goes out together
+// with the buffered bytes in a single writev, without being copied, so a builtin can
+// produce any amount of output with bounded memory and the first bytes leave early.
+// Once the reader is gone (EPIPE), everything else is dropped.
+class OutputSink {
+public:
+	explicit OutputSink(int fd, size_t capacity = 16 * 1024);
+	// Collect the output in memory instead, used to capture the output of a builtin in $(...)
+	explicit OutputSink(std::string& capture, size_t capacity = 4096);
+	OutputSink(const OutputSink&) = delete;
+	OutputSink& operator=(const OutputSink&) = delete;
+	~OutputSink();
+
+	void write(std::string_view data);
+	void put(char c);
+	void writeNumber(uint64_t number);
+
+	// Write the number right aligned in a field of the given width, like printf's %*llu
+	void writePadded(uint64_t number, size_t width);
+
+	void flush();
+	bool failed() const { return writeFailed; }
+	int fd() const { return target; }
+
+private:
+	// Write the buffered bytes followed by data, returns false on errors
+	bool writeOut(std::string_view data);
+
+	int target;
+	std::string* capture{nullptr};
+	std::unique_ptr<char[]> buffer;
+	size_t capacity;
+	size_t used{0};
+	bool writeFailed{false};
+};
@@ -0,0 +1,75 @@
+#include "parallel.hpp"
+
+#include <algorithm>
+
+WorkStealingQueue::WorkStealingQueue(size_t workers, size_t capacity)
+	: deques(std::make_unique<Deque[]>(std::max<size_t>(workers, 1))), workers(std::max<size_t>(workers, 1)), capacity(std::max<size_t>(capacity, 1)) {
+}
+
+// Waiters check their condition under waitLock, taking it here means none of them misses the change
+// Every push and pop changes the count by one, so one waiter is enough
+void WorkStealingQueue::wake(std::condition_variable& condition) {
+	{
+		std::lock_guard<std::mutex> guard(waitLock);
+	}
+	condition.notify_one();
+}
+
+void WorkStealingQueue::push(ParallelInput input) {
+	{
+		std::unique_lock<std::mutex> guard(waitLock);
+		space.wait(guard, [&] { return pending.load() < capacity; });
+	}
+	Deque& deque = deques[next];
+	next = (next + 1) % workers;
+	{
+		std::lock_guard<std::mutex> guard(deque.lock);
+		deque.inputs.push_back(std::move(input));
+	}
+	pending.fetch_add(1);
+	wake(available);
+}
+
+void WorkStealingQueue::close() {
+	{
+		std::lock_guard<std::mutex> guard(waitLock);
+		closed = true;
+	}
+	available.notify_all();
+}
+
+// The oldest line of the worker's own deque, or else the newest of the first other deque that has one
+bool WorkStealingQueue::take(size_t worker, ParallelInput& input) {
+	for (size_t offset = 0; offset < workers; ++offset) {
+		Deque& deque = deques[(worker + offset) % workers];
+		std::lock_guard<std::mutex> guard(deque.lock);
+		if (deque.inputs.empty()) {
+			continue;
+		}
+		if (offset == 0) {
+			input = std::move(deque.inputs.front());
+			deque.inputs.pop_front();
+		} else {
+			input = std::move(deque.inputs.back());
+			deque.inputs.pop_back();
+			stolen.fetch_add(1, std::memory_order_relaxed);
+		}
+		return true;
+	}
+	return false;
+}
+
+bool WorkStealingQueue::pop(size_t worker, ParallelInput& input) {
+	while (true) {
+		if (take(worker, input)) {
+			pending.fetch_sub(1);
+			wake(space);
+			return true;
+		}
+		std::unique_lock<std::mutex> guard(waitLock);
+		available.wait(guard, [&] { return pending.load() > 0 || closed; });
+		if (pending.load() == 0 && closed) {
+			return false;
+		}
+	}
+}
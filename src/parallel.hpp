@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// --------------------------------------------------------------
+// Work-stealing queue of the parallel builtin
+// --------------------------------------------------------------
+
+// An input line of parallel, numbered in the order it was read
+struct ParallelInput {
+	size_t sequence{0};
+	std::string line{};
+};
+
+// Spreads the input lines over the workers that run them
+//
+// Every worker owns a deque, the reader deals the lines to the workers in turn. A worker takes
+// the oldest line of its own deque and once that is empty steals the newest line of another
+// worker, so a worker stuck with a slow job does not hold back the lines queued behind it.
+// The reader blocks while the deques are full, so a long input is not read ahead in its entirety.
+class WorkStealingQueue {
+public:
+	WorkStealingQueue(size_t workers, size_t capacity);
+
+	// Deal a line to the next worker, waits while the queue holds capacity lines
+	void push(ParallelInput input);
+
+	// No more lines will come, workers that find every deque empty stop waiting
+	void close();
+
+	// Take a line for the worker, blocks while every deque is empty and lines may still come
+	// Returns false once the queue is closed and empty
+	bool pop(size_t worker, ParallelInput& input);
+
+	size_t steals() const { return stolen.load(std::memory_order_relaxed); }
+
+private:
+	struct Deque {
+		std::mutex lock;
+		std::deque<ParallelInput> inputs;
+	};
+
+	bool take(size_t worker, ParallelInput& input);
+	void wake(std::condition_variable& condition);
+
+	std::unique_ptr<Deque[]> deques;
+	size_t workers;
+	size_t capacity;
+	size_t next{0}; // The worker the reader deals the next line to
+	std::atomic<size_t> pending{0};
+	std::atomic<size_t> stolen{0};
+	bool closed{false};
+	std::mutex waitLock;
+	std::condition_variable available; // A line was pushed or the queue was closed
+	std::condition_variable space;     // A line was taken
+};
@@ -0,0 +1,1026 @@
+#include "parser.hpp"
+
+#include <algorithm>
+#include <initializer_list>
+#include <cstring>
+#include <functional>
+
+#include "bytecode.hpp"
+
+namespace {
+
+bool isNameCharacter(char c) {
+	return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+} // namespace
+
+// --------------------------------------------------------------
+// Expansions
+// --------------------------------------------------------------
+
+bool startsExpansion(std::string_view line, size_t pos) {
+	if (pos + 1 >= line.size()) {
+		return false;
+	}
+	char next = line[pos + 1];
+	return isNameCharacter(next) || next == '{' || next == '(' || next == '?' || next == '$' || next == '!' || next == '#' ||
+		next == '@' || next == '*';
+}
+
+size_t expansionEnd(std::string_view line, size_t pos) {
+	char open = line[pos];
+	char close = open == '(' ? ')' : '}';
+	int depth = 0;
+	for (size_t i = pos; i < line.size(); ++i) {
+		char c = line[i];
+		if (c == '\\') {
+			++i;
+		} else if (c == '\'') {
+			i = line.find('\'', i + 1);
+			if (i == std::string_view::npos) {
+				return i;
+			}
+		} else if (c == '"') {
+			// A double quoted string can hold expansions with quotes of their own
+			for (++i; i < line.size() && line[i] != '"'; ++i) {
+				if (line[i] == '\\') {
+					++i;
+				} else if (line[i] == '$' && i + 1 < line.size() && (line[i + 1] == '(' || line[i + 1] == '{')) {
+					i = expansionEnd(line, i + 1);
+					if (i == std::string_view::npos) {
+						return i;
+					}
+					--i;
+				}
+			}
+			if (i >= line.size()) {
+				return std::string_view::npos;
+			}
+		} else if (c == open) {
+			++depth;
+		} else if (c == close && --depth == 0) {
+			return i + 1;
+		}
+	}
+	return std::string_view::npos;
+}
+
+namespace {
+
+// --------------------------------------------------------------
+// Lexer
+// --------------------------------------------------------------
+
+enum class TokenType : uint8_t {
+	Word,
+	Redirect,
+	Pipe,
+	AndIf,
+	OrIf,
+	Semicolon,
+	DoubleSemicolon,
+	Ampersand,
+	LeftParen,
+	RightParen,
+	Newline,
+	End,
+	Error
+};
+
+struct Token {
+	TokenType type{TokenType::End};
+	Word word{};
+	RedirectOp op{RedirectOp::Output};
+	int fd{-1}; // The io number in front of a redirection, -1 if there was none
+	bool stripTabs{false};
+	std::string_view text{}; // The raw token, used for error messages
+};
+
+struct Lexer {
+	std::string_view line;
+	size_t pos{0};
+	std::pmr::memory_resource* arena;
+	std::string* error;
+};
+
+bool isMetaCharacter(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '|' || c == '&' || c == ';' || c == '<' || c == '>' || c == '(' || c == ')';
+}
+
+bool isAllDigits(std::string_view text) {
+	return !text.empty() && text.find_first_not_of("0123456789") == std::string_view::npos;
+}
+
+// Start copying the word into the arena, needed as soon as a quote or escape has to be removed
+char* beginCopy(Lexer& lexer, size_t start, size_t& length) {
+	// The unquoted word can never be longer than the rest of the line
+	char* buffer = static_cast<char*>(lexer.arena->allocate(lexer.line.size() - start, 1));
+	length = lexer.pos - start;
+	std::memcpy(buffer, lexer.line.data() + start, length);
+	return buffer;
+}
+
+// Read a word, removing quotes and escapes on the way
+bool lexWord(Lexer& lexer, Token& token) {
+	std::string_view line = lexer.line;
+	size_t start = lexer.pos;
+	char* copy = nullptr; // Only set once the word differs from the input
+	size_t length = 0;
+
+	auto append = [&](char c) {
+		if (copy) {
+			copy[length++] = c;
+		}
+	};
+
+	// Take a $ expansion as it is, the word is expanded as written once the command runs
+	auto expansion = [&]() {
+		token.word.expand = true;
+		size_t end = lexer.pos + 1;
+		if (line[end] == '(' || line[end] == '{') {
+			end = expansionEnd(line, end);
+			if (end == std::string_view::npos) {
+				*lexer.error = std::string("unexpected EOF while looking for matching `") + (line[lexer.pos + 1] == '(' ? ")" : "}") + "'";
+				return false;
+			}
+		}
+		while (lexer.pos < end) {
+			append(line[lexer.pos++]);
+		}
+		return true;
+	};
+
+	while (lexer.pos < line.size() && !isMetaCharacter(line[lexer.pos])) {
+		char c = line[lexer.pos];
+		if (c == '\'') {
+			if (!copy) {
+				copy = beginCopy(lexer, start, length);
+			}
+			size_t end = line.find('\'', lexer.pos + 1);
+			if (end == std::string_view::npos) {
+				*lexer.error = "unexpected EOF while looking for matching `''";
+				return false;
+			}
+			std::memcpy(copy + length, line.data() + lexer.pos + 1, end - lexer.pos - 1);
+			length += end - lexer.pos - 1;
+			lexer.pos = end + 1;
+			token.word.quoted = true;
+		} else if (c == '"') {
+			if (!copy) {
+				copy = beginCopy(lexer, start, length);
+			}
+			++lexer.pos;
+			while (lexer.pos < line.size() && line[lexer.pos] != '"') {
+				if (line[lexer.pos] == '$' && startsExpansion(line, lexer.pos)) {
+					if (!expansion()) {
+						return false;
+					}
+					continue;
+				}
+				// Inside double quotes a backslash only escapes \ $ " ` and newline
+				if (line[lexer.pos] == '\\' && lexer.pos + 1 < line.size() && std::strchr("\\$\"`\n", line[lexer.pos + 1])) {
+					++lexer.pos;
+				}
+				append(line[lexer.pos++]);
+			}
+			if (lexer.pos == line.size()) {
+				*lexer.error = "unexpected EOF while looking for matching `\"'";
+				return false;
+			}
+			++lexer.pos;
+			token.word.quoted = true;
+		} else if (c == '\\') {
+			if (!copy) {
+				copy = beginCopy(lexer, start, length);
+			}
+			++lexer.pos;
+			// A backslash at the end of the line continues it, so it simply disappears
+			if (lexer.pos < line.size() && line[lexer.pos] != '\n') {
+				append(line[lexer.pos]);
+			}
+			if (lexer.pos < line.size()) {
+				++lexer.pos;
+			}
+			token.word.quoted = true;
+		} else if (c == '$' && startsExpansion(line, lexer.pos)) {
+			if (!expansion()) {
+				return false;
+			}
+		} else {
+			// An unquoted * ? or [ makes the word a pattern, it is matched against file names when the command runs
+			if (c == '*' || c == '?' || c == '[') {
+				token.word.expand = true;
+			}
+			append(c);
+			++lexer.pos;
+		}
+	}
+
+	token.text = line.substr(start, lexer.pos - start);
+	token.word.text = copy && !token.word.expand ? std::string_view(copy, length) : token.text;
+
+	// NAME= with an unquoted name, the parser decides if it is in front of the command name
+	size_t nameEnd = 0;
+	while (nameEnd < token.text.size() && isNameCharacter(token.text[nameEnd])) {
+		++nameEnd;
+	}
+	token.word.assignment = nameEnd > 0 && nameEnd < token.text.size() && token.text[nameEnd] == '=' && !(token.text[0] >= '0' && token.text[0] <= '9');
+
+	// Digits directly in front of < or > are the descriptor of a redirection
+	if (!copy && lexer.pos < line.size() && (line[lexer.pos] == '<' || line[lexer.pos] == '>') && isAllDigits(token.text)) {
+		token.fd = 0;
+		for (char digit : token.text) {
+			token.fd = token.fd * 10 + (digit - '0');
+		}
+		token.type = TokenType::Redirect;
+		return true;
+	}
+	token.type = TokenType::Word;
+	return true;
+}
+
+// Read a redirection operator at the current position
+void lexRedirect(Lexer& lexer, Token& token) {
+	std::string_view rest = lexer.line.substr(lexer.pos);
+	struct Operator {
+		std::string_view text;
+		RedirectOp op;
+		int fd;
+		bool stripTabs;
+	};
+	// Longer operators first, so the longest match wins
+	static constexpr Operator operators[] = {
+		{"&>>", RedirectOp::AppendBoth, 1, false},
+		{"&>", RedirectOp::OutputBoth, 1, false},
+		{"<<<", RedirectOp::HereString, 0, false},
+		{"<<-", RedirectOp::HereDoc, 0, true},
+		{"<<", RedirectOp::HereDoc, 0, false},
+		{"<&", RedirectOp::DupInput, 0, false},
+		{"<>", RedirectOp::ReadWrite, 0, false},
+		{"<", RedirectOp::Input, 0, false},
+		{">>", RedirectOp::Append, 1, false},
+		{">&", RedirectOp::DupOutput, 1, false},
+		{">|", RedirectOp::Output, 1, false},
+		{">", RedirectOp::Output, 1, false},
+	};
+	for (const auto& candidate : operators) {
+		if (rest.starts_with(candidate.text)) {
+			token.type = TokenType::Redirect;
+			token.op = candidate.op;
+			token.stripTabs = candidate.stripTabs;
+			if (token.fd == -1) {
+				token.fd = candidate.fd;
+			}
+			token.text = rest.substr(0, candidate.text.size());
+			lexer.pos += candidate.text.size();
+			return;
+		}
+	}
+}
+
+// Read the next token, a redirection token already carries its operator but not its target
+Token nextToken(Lexer& lexer) {
+	std::string_view line = lexer.line;
+	Token token{};
+
+	// Skip blanks and comments
+	while (lexer.pos < line.size() && (line[lexer.pos] == ' ' || line[lexer.pos] == '\t')) {
+		++lexer.pos;
+	}
+	if (lexer.pos < line.size() && line[lexer.pos] == '#') {
+		lexer.pos = line.find('\n', lexer.pos);
+		if (lexer.pos == std::string_view::npos) {
+			lexer.pos = line.size();
+		}
+	}
+	if (lexer.pos == line.size()) {
+		token.type = TokenType::End;
+		return token;
+	}
+
+	char c = line[lexer.pos];
+	std::string_view rest = line.substr(lexer.pos);
+	auto take = [&](TokenType type, size_t length) {
+		token.type = type;
+		token.text = rest.substr(0, length);
+		lexer.pos += length;
+		return token;
+	};
+
+	switch (c) {
+		case '\n':
+			return take(TokenType::Newline, 1);
+		case ';':
+			return rest.starts_with(";;") ? take(TokenType::DoubleSemicolon, 2) : take(TokenType::Semicolon, 1);
+		case '|':
+			return rest.starts_with("||") ? take(TokenType::OrIf, 2) : take(TokenType::Pipe, 1);
+		case '&':
+			if (rest.starts_with("&&")) {
+				return take(TokenType::AndIf, 2);
+			}
+			if (rest.starts_with("&>")) {
+				lexRedirect(lexer, token);
+				return token;
+			}
+			return take(TokenType::Ampersand, 1);
+		case '<':
+		case '>':
+			lexRedirect(lexer, token);
+			return token;
+		case '(':
+			return take(TokenType::LeftParen, 1);
+		case ')':
+			return take(TokenType::RightParen, 1);
+		default:
+			break;
+	}
+
+	if (!lexWord(lexer, token)) {
+		token.type = TokenType::Error;
+		return token;
+	}
+	if (token.type == TokenType::Redirect) {
+		// The io number has been read, the operator follows directly
+		const char* ioNumber = token.text.data();
+		lexRedirect(lexer, token);
+		token.text = std::string_view(ioNumber, line.data() + lexer.pos - ioNumber);
+	}
+	return token;
+}
+
+// --------------------------------------------------------------
+// Parser
+// --------------------------------------------------------------
+
+struct Parser {
+	Lexer lexer;
+	Token current{};
+	const char* consumedEnd{nullptr}; // End of the last token that was consumed
+	LineReader readInput{nullptr};
+	int depth{0}; // Compound commands being parsed, inside one the end of a line is not the end of the command
+	bool readMore{false}; // Lines or here-document bodies were read from readInput
+	std::vector<Redirection*> pendingBodies{}; // Here-documents of the current line, in order
+};
+
+void advance(Parser& parser) {
+	if (!parser.current.text.empty()) {
+		parser.consumedEnd = parser.current.text.data() + parser.current.text.size();
+	}
+	parser.current = nextToken(parser.lexer);
+}
+
+bool unexpectedToken(Parser& parser) {
+	if (parser.current.type == TokenType::Error) {
+		return false; // The lexer already described the problem
+	}
+	std::string_view text = parser.current.type == TokenType::End || parser.current.type == TokenType::Newline ? "newline" : parser.current.text;
+	*parser.lexer.error = "syntax error near unexpected token `" + std::string(text) + "'";
+	return false;
+}
+
+// --------------------------------------------------------------
+// Here-documents
+// --------------------------------------------------------------
+
+// Read the body of a here-document up to the line that holds only its delimiter
+// The end of the input also ends the body, like in bash
+std::string_view readHereDocument(const Redirection& redirection, std::pmr::memory_resource* arena, LineReader readBody) {
+	std::string body;
+	std::string line;
+	while (readBody && readBody(line)) {
+		// <<- removes leading tabs from every line, the delimiter included
+		std::string_view text = line;
+		if (redirection.stripTabs) {
+			text.remove_prefix(std::min(text.find_first_not_of('\t'), text.size()));
+		}
+		if (text == redirection.target.text) {
+			break;
+		}
+		body += text;
+		body += '\n';
+	}
+	char* copy = static_cast<char*>(arena->allocate(body.size(), 1));
+	std::memcpy(copy, body.data(), body.size());
+	return std::string_view(copy, body.size());
+}
+
+// Remember the here-documents of a command that is complete, its redirections do not move anymore
+void queueBodies(Parser& parser, std::pmr::vector<Redirection>& redirections) {
+	for (auto& redirection : redirections) {
+		if (redirection.op == RedirectOp::HereDoc) {
+			parser.pendingBodies.push_back(&redirection);
+		}
+	}
+}
+
+// The bodies follow the line in the order their redirections appear on it
+void readPendingBodies(Parser& parser) {
+	for (Redirection* redirection : parser.pendingBodies) {
+		redirection->body = readHereDocument(*redirection, parser.lexer.arena, parser.readInput);
+		parser.readMore = true;
+	}
+	parser.pendingBodies.clear();
+}
+
+// --------------------------------------------------------------
+// Parser
+// --------------------------------------------------------------
+
+bool parseSimpleCommand(Parser& parser, Pipeline& pipeline);
+bool parsePipeline(Parser& parser, Pipeline& pipeline);
+CompoundCommand* parseCompound(Parser& parser);
+
+// Continue a compound command on the next line of input, after the here-documents of the current one
+bool nextLine(Parser& parser) {
+	readPendingBodies(parser);
+	std::string line;
+	if (!parser.readInput || !parser.readInput(line)) {
+		return false;
+	}
+	parser.readMore = true;
+	char* copy = static_cast<char*>(parser.lexer.arena->allocate(line.size(), 1));
+	std::memcpy(copy, line.data(), line.size());
+	parser.lexer.line = std::string_view(copy, line.size());
+	parser.lexer.pos = 0;
+	parser.current = nextToken(parser.lexer);
+	return true;
+}
+
+// Newlines are allowed after | && and ||, and between the commands of a compound command
+// Inside a compound command the end of the line is not the end of the command either, the next line is read
+bool skipNewlines(Parser& parser) {
+	while (true) {
+		if (parser.current.type == TokenType::Newline) {
+			advance(parser);
+		} else if (parser.current.type == TokenType::End && parser.depth > 0) {
+			if (!nextLine(parser)) {
+				*parser.lexer.error = "syntax error: unexpected end of file";
+				parser.current.type = TokenType::Error;
+				return false;
+			}
+		} else {
+			return true;
+		}
+	}
+}
+
+// Reserved words are only recognized unquoted and at the start of a command
+bool isReservedWord(const Token& token, std::string_view word) {
+	return token.type == TokenType::Word && token.word.text == word && !token.word.quoted;
+}
+
+bool isReservedWord(const Token& token, std::initializer_list<std::string_view> words) {
+	return std::any_of(words.begin(), words.end(), [&](std::string_view word) { return isReservedWord(token, word); });
+}
+
+// Reserved words that start a compound command, and those that may only appear inside one
+bool opensCompound(const Token& token) {
+	return isReservedWord(token, {"if", "while", "until", "for", "case", "{"});
+}
+
+bool closesCompound(const Token& token) {
+	return isReservedWord(token, {"then", "elif", "else", "fi", "do", "done", "esac", "}"});
+}
+
+bool parseRedirection(Parser& parser, std::pmr::vector<Redirection>& redirections) {
+	Redirection redirection{parser.current.fd, parser.current.op, {}, parser.current.stripTabs};
+	advance(parser);
+	if (parser.current.type != TokenType::Word) {
+		return unexpectedToken(parser);
+	}
+	redirection.target = parser.current.word;
+	redirections.push_back(redirection);
+	advance(parser);
+	return true;
+}
+
+bool expectReservedWord(Parser& parser, std::string_view word) {
+	if (!isReservedWord(parser.current, word)) {
+		return unexpectedToken(parser);
+	}
+	advance(parser);
+	return true;
+}
+
+// Parse the commands of a compound command up to one of the reserved words that end them
+// The list of a case item also ends with ;; and may be empty
+CommandList* parseCompoundList(Parser& parser, std::initializer_list<std::string_view> terminators, bool caseItem = false) {
+	std::pmr::memory_resource* resource = parser.lexer.arena;
+	auto* list = std::pmr::polymorphic_allocator<CommandList>(resource).allocate(1);
+	new (list) CommandList(resource);
+	auto terminated = [&] {
+		return (caseItem && parser.current.type == TokenType::DoubleSemicolon) || isReservedWord(parser.current, terminators);
+	};
+
+	while (true) {
+		if (!skipNewlines(parser)) {
+			return nullptr;
+		}
+		if (terminated()) {
+			break;
+		}
+		ListItem& item = list->items.emplace_back(ListItem{Pipeline(resource)});
+		if (!parsePipeline(parser, item.pipeline)) {
+			return nullptr;
+		}
+		switch (parser.current.type) {
+			case TokenType::AndIf:
+			case TokenType::OrIf:
+				item.op = parser.current.type == TokenType::AndIf ? ListOp::And : ListOp::Or;
+				advance(parser);
+				if (!skipNewlines(parser)) {
+					return nullptr;
+				}
+				if (terminated()) {
+					return unexpectedToken(parser), nullptr;
+				}
+				break;
+			case TokenType::Semicolon:
+			case TokenType::Ampersand:
+				item.op = parser.current.type == TokenType::Ampersand ? ListOp::Background : ListOp::Sequence;
+				advance(parser);
+				break;
+			case TokenType::Newline:
+			case TokenType::End:
+				break;
+			case TokenType::DoubleSemicolon:
+				if (caseItem) {
+					break;
+				}
+				[[fallthrough]];
+			default:
+				return unexpectedToken(parser), nullptr;
+		}
+	}
+	if (list->items.empty() && !caseItem) {
+		return unexpectedToken(parser), nullptr;
+	}
+	return list;
+}
+
+// if list; then list; [elif list; then list;]... [else list;] fi
+bool parseIf(Parser& parser, CompoundCommand& compound) {
+	do {
+		advance(parser);
+		Clause clause{};
+		if (!(clause.condition = parseCompoundList(parser, {"then"})) || !expectReservedWord(parser, "then") ||
+			!(clause.body = parseCompoundList(parser, {"elif", "else", "fi"}))) {
+			return false;
+		}
+		compound.clauses.push_back(clause);
+	} while (isReservedWord(parser.current, "elif"));
+	if (isReservedWord(parser.current, "else")) {
+		advance(parser);
+		Clause clause{};
+		if (!(clause.body = parseCompoundList(parser, {"fi"}))) {
+			return false;
+		}
+		compound.clauses.push_back(clause);
+	}
+	return expectReservedWord(parser, "fi");
+}
+
+// while list; do list; done and until list; do list; done
+bool parseLoop(Parser& parser, CompoundCommand& compound) {
+	advance(parser);
+	Clause clause{};
+	if (!(clause.condition = parseCompoundList(parser, {"do"})) || !expectReservedWord(parser, "do") ||
+		!(clause.body = parseCompoundList(parser, {"done"}))) {
+		return false;
+	}
+	compound.clauses.push_back(clause);
+	return expectReservedWord(parser, "done");
+}
+
+bool isName(std::string_view text) {
+	return !text.empty() && !(text[0] >= '0' && text[0] <= '9') && std::all_of(text.begin(), text.end(), isNameCharacter);
+}
+
+// for name [in word...]; do list; done
+bool parseFor(Parser& parser, CompoundCommand& compound) {
+	advance(parser);
+	if (parser.current.type != TokenType::Word || parser.current.word.quoted || parser.current.word.expand || !isName(parser.current.word.text)) {
+		return unexpectedToken(parser);
+	}
+	compound.name = parser.current.word;
+	advance(parser);
+	if (!skipNewlines(parser)) {
+		return false;
+	}
+	if (isReservedWord(parser.current, "in")) {
+		compound.hasIn = true;
+		advance(parser);
+		while (parser.current.type == TokenType::Word) {
+			compound.words.push_back(parser.current.word);
+			advance(parser);
+		}
+	}
+	if (parser.current.type == TokenType::Semicolon) {
+		advance(parser);
+	} else if (parser.current.type != TokenType::Newline && parser.current.type != TokenType::End && !isReservedWord(parser.current, "do")) {
+		return unexpectedToken(parser);
+	}
+	Clause clause{};
+	if (!skipNewlines(parser) || !expectReservedWord(parser, "do") || !(clause.body = parseCompoundList(parser, {"done"}))) {
+		return false;
+	}
+	compound.clauses.push_back(clause);
+	return expectReservedWord(parser, "done");
+}
+
+// case word in [(]pattern[|pattern]...) list ;; ... esac
+bool parseCase(Parser& parser, CompoundCommand& compound) {
+	advance(parser);
+	if (parser.current.type != TokenType::Word) {
+		return unexpectedToken(parser);
+	}
+	compound.name = parser.current.word;
+	advance(parser);
+	if (!skipNewlines(parser) || !expectReservedWord(parser, "in")) {
+		return false;
+	}
+	while (true) {
+		if (!skipNewlines(parser)) {
+			return false;
+		}
+		if (isReservedWord(parser.current, "esac")) {
+			break;
+		}
+		CaseItem& item = compound.items.emplace_back(parser.lexer.arena);
+		if (parser.current.type == TokenType::LeftParen) {
+			advance(parser);
+		}
+		while (true) {
+			if (parser.current.type != TokenType::Word) {
+				return unexpectedToken(parser);
+			}
+			item.patterns.push_back(parser.current.word);
+			advance(parser);
+			if (parser.current.type != TokenType::Pipe) {
+				break;
+			}
+			advance(parser);
+		}
+		if (parser.current.type != TokenType::RightParen) {
+			return unexpectedToken(parser);
+		}
+		advance(parser);
+		const CommandList* body = parseCompoundList(parser, {"esac"}, true);
+		if (!body) {
+			return false;
+		}
+		item.body = body->items.empty() ? nullptr : body;
+		if (parser.current.type != TokenType::DoubleSemicolon) {
+			break;
+		}
+		advance(parser);
+	}
+	return expectReservedWord(parser, "esac");
+}
+
+// { list; }
+bool parseGroup(Parser& parser, CompoundCommand& compound) {
+	advance(parser);
+	Clause clause{};
+	if (!(clause.body = parseCompoundList(parser, {"}"}))) {
+		return false;
+	}
+	compound.clauses.push_back(clause);
+	return expectReservedWord(parser, "}");
+}
+
+// The compound command that follows name() or function name, and the redirections every call applies
+bool parseFunctionBody(Parser& parser, CompoundCommand& definition) {
+	++parser.depth;
+	bool parsed = skipNewlines(parser);
+	--parser.depth;
+	if (!parsed) {
+		return false;
+	}
+	if (!opensCompound(parser.current)) {
+		return unexpectedToken(parser);
+	}
+	if (!(definition.body = parseCompound(parser))) {
+		return false;
+	}
+	while (parser.current.type == TokenType::Redirect) {
+		if (!parseRedirection(parser, definition.redirections)) {
+			return false;
+		}
+	}
+	queueBodies(parser, definition.redirections);
+	return true;
+}
+
+CompoundCommand* newCompound(Parser& parser, CompoundKind kind) {
+	auto* compound = std::pmr::polymorphic_allocator<CompoundCommand>(parser.lexer.arena).allocate(1);
+	new (compound) CompoundCommand(parser.lexer.arena);
+	compound->kind = kind;
+	return compound;
+}
+
+// function name [()] compound
+bool parseFunctionKeyword(Parser& parser, CompoundCommand& definition) {
+	advance(parser);
+	if (parser.current.type != TokenType::Word || parser.current.word.quoted || parser.current.word.expand) {
+		return unexpectedToken(parser);
+	}
+	definition.name = parser.current.word;
+	advance(parser);
+	if (parser.current.type == TokenType::LeftParen) {
+		advance(parser);
+		if (parser.current.type != TokenType::RightParen) {
+			return unexpectedToken(parser);
+		}
+		advance(parser);
+	}
+	return parseFunctionBody(parser, definition);
+}
+
+// Parse the compound command that starts at the current reserved word and compile it, nullptr on errors
+CompoundCommand* parseCompound(Parser& parser) {
+	const Token& token = parser.current;
+	CompoundKind kind = isReservedWord(token, "if") ? CompoundKind::If :
+		isReservedWord(token, "while") ? CompoundKind::While :
+		isReservedWord(token, "until") ? CompoundKind::Until :
+		isReservedWord(token, "for") ? CompoundKind::For :
+		isReservedWord(token, "case") ? CompoundKind::Case :
+		isReservedWord(token, "function") ? CompoundKind::Function : CompoundKind::Group;
+	CompoundCommand* compound = newCompound(parser, kind);
+
+	++parser.depth;
+	bool parsed = false;
+	switch (kind) {
+		case CompoundKind::If:
+			parsed = parseIf(parser, *compound);
+			break;
+		case CompoundKind::While:
+		case CompoundKind::Until:
+			parsed = parseLoop(parser, *compound);
+			break;
+		case CompoundKind::For:
+			parsed = parseFor(parser, *compound);
+			break;
+		case CompoundKind::Case:
+			parsed = parseCase(parser, *compound);
+			break;
+		case CompoundKind::Group:
+			parsed = parseGroup(parser, *compound);
+			break;
+		case CompoundKind::Function:
+			parsed = parseFunctionKeyword(parser, *compound);
+			break;
+	}
+	--parser.depth;
+	if (!parsed) {
+		return nullptr;
+	}
+	compound->program = compileCompound(*compound, parser.lexer.arena);
+	return compound;
+}
+
+bool parseSimpleCommand(Parser& parser, Pipeline& pipeline) {
+	SimpleCommand& command = pipeline.commands.emplace_back(parser.lexer.arena);
+	while (true) {
+		if (parser.current.type == TokenType::Word) {
+			// Assignments are only recognized in front of the command name
+			Word word = parser.current.word;
+			if (word.assignment && command.words.empty()) {
+				command.assignments.push_back(word);
+			} else {
+				word.assignment = false;
+				command.words.push_back(word);
+			}
+			advance(parser);
+		} else if (parser.current.type == TokenType::Redirect) {
+			if (!parseRedirection(parser, command.redirections)) {
+				return false;
+			}
+		} else if (parser.current.type == TokenType::LeftParen && command.words.size() == 1 && command.assignments.empty() &&
+			command.redirections.empty() && !command.words[0].quoted && !command.words[0].expand) {
+			// name() compound defines a function
+			CompoundCommand* definition = newCompound(parser, CompoundKind::Function);
+			definition->name = command.words[0];
+			command.words.clear();
+			advance(parser);
+			if (parser.current.type != TokenType::RightParen) {
+				return unexpectedToken(parser);
+			}
+			advance(parser);
+			if (!parseFunctionBody(parser, *definition)) {
+				return false;
+			}
+			definition->program = compileCompound(*definition, parser.lexer.arena);
+			command.compound = definition;
+			return true;
+		} else {
+			break;
+		}
+	}
+	if (command.words.empty() && command.redirections.empty() && command.assignments.empty()) {
+		return unexpectedToken(parser);
+	}
+	queueBodies(parser, command.redirections);
+	return true;
+}
+
+// A command of a pipeline, compound commands start with a reserved word
+bool parseCommand(Parser& parser, Pipeline& pipeline) {
+	if (closesCompound(parser.current)) {
+		return unexpectedToken(parser);
+	}
+	if (!opensCompound(parser.current) && !isReservedWord(parser.current, "function")) {
+		return parseSimpleCommand(parser, pipeline);
+	}
+	SimpleCommand& command = pipeline.commands.emplace_back(parser.lexer.arena);
+	CompoundCommand* compound = parseCompound(parser);
+	if (!compound) {
+		return false;
+	}
+	command.compound = compound;
+	// The redirections after a function definition belong to its body
+	if (compound->kind != CompoundKind::Function) {
+		while (parser.current.type == TokenType::Redirect) {
+			if (!parseRedirection(parser, command.redirections)) {
+				return false;
+			}
+		}
+		queueBodies(parser, command.redirections);
+	}
+	return true;
+}
+
+// Tokens that end a pipeline, `time` may be followed directly by one of them
+bool endsPipeline(const Token& token) {
+	switch (token.type) {
+		case TokenType::AndIf:
+		case TokenType::OrIf:
+		case TokenType::Semicolon:
+		case TokenType::DoubleSemicolon:
+		case TokenType::Ampersand:
+		case TokenType::Newline:
+		case TokenType::End:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool parsePipeline(Parser& parser, Pipeline& pipeline) {
+	const char* start = parser.current.text.data();
+	std::string_view startLine = parser.lexer.line;
+	// A pipeline that goes on over several lines, a loop for example, shows the part on its first line
+	auto setText = [&] {
+		const char* end = parser.consumedEnd;
+		if (start && (end < startLine.data() || end > startLine.data() + startLine.size())) {
+			end = startLine.data() + startLine.size();
+		}
+		pipeline.text = start && end > start ? std::string_view(start, end - start) : std::string_view{};
+	};
+	if (isReservedWord(parser.current, "time")) {
+		pipeline.timed = true;
+		advance(parser);
+		if (isReservedWord(parser.current, "-p")) {
+			pipeline.posixTime = true;
+			advance(parser);
+		}
+		// A bare time reports the times of nothing, like bash
+		if (endsPipeline(parser.current)) {
+			setText();
+			return true;
+		}
+	}
+	if (isReservedWord(parser.current, "!")) {
+		pipeline.negated = true;
+		advance(parser);
+	}
+	if (!parseCommand(parser, pipeline)) {
+		return false;
+	}
+	while (parser.current.type == TokenType::Pipe) {
+		advance(parser);
+		if (!skipNewlines(parser) || !parseCommand(parser, pipeline)) {
+			return false;
+		}
+	}
+	setText();
+	return true;
+}
+
+} // namespace
+
+const CommandList* parseLine(std::string_view line, ParseArena& arena, std::string& error, LineReader readInput) {
+	std::pmr::memory_resource* resource = &arena.resource;
+	auto* list = std::pmr::polymorphic_allocator<CommandList>(resource).allocate(1);
+	new (list) CommandList(resource);
+
+	Parser parser{Lexer{line, 0, resource, &error}};
+	parser.readInput = readInput;
+	advance(parser);
+	skipNewlines(parser);
+
+	while (parser.current.type != TokenType::End) {
+		ListItem& item = list->items.emplace_back(ListItem{Pipeline(resource)});
+		if (!parsePipeline(parser, item.pipeline)) {
+			return nullptr;
+		}
+
+		switch (parser.current.type) {
+			case TokenType::AndIf:
+			case TokenType::OrIf:
+				item.op = parser.current.type == TokenType::AndIf ? ListOp::And : ListOp::Or;
+				advance(parser);
+				skipNewlines(parser);
+				// The right hand side of && and || is mandatory
+				if (parser.current.type == TokenType::End) {
+					return unexpectedToken(parser), nullptr;
+				}
+				break;
+			case TokenType::Semicolon:
+			case TokenType::Ampersand:
+				item.op = parser.current.type == TokenType::Ampersand ? ListOp::Background : ListOp::Sequence;
+				advance(parser);
+				skipNewlines(parser);
+				break;
+			case TokenType::Newline:
+				skipNewlines(parser);
+				break;
+			case TokenType::End:
+				break;
+			default:
+				return unexpectedToken(parser), nullptr;
+		}
+	}
+	readPendingBodies(parser);
+	list->readInput = parser.readMore;
+	return list;
+}
+
+// --------------------------------------------------------------
+// Parsed lines of repeated commands
+// --------------------------------------------------------------
+
+namespace {
+
+// Whether the line may define a function, which has to keep its tree after the line is done
+// The check is rough: a word that starts a compound command anywhere in the line counts, quoted or not
+bool mayKeepTree(std::string_view line) {
+	if (line.find('(') != std::string_view::npos) {
+		return true;
+	}
+	for (std::string_view word : {"if", "while", "until", "for", "case", "function", "{"}) {
+		for (size_t pos = line.find(word); pos != std::string_view::npos; pos = line.find(word, pos + 1)) {
+			size_t end = pos + word.size();
+			bool startsWord = pos == 0 || std::string_view(" \t\n;&|").find(line[pos - 1]) != std::string_view::npos;
+			bool endsWord = end == line.size() || std::string_view(" \t\n;&|").find(line[end]) != std::string_view::npos;
+			if (startsWord && endsWord) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+} // namespace
+
+LineCache::LineCache(size_t capacity) : capacity(std::max<size_t>(capacity, 1)) {
+}
+
+const CommandList* LineCache::parse(std::string_view line, ParseArena& arena, std::string& error, LineReader readInput,
+	std::shared_ptr<const ParsedLine>& held) {
+	size_t hash = std::hash<std::string_view>{}(line);
+	auto found = entries.find(hash);
+	if (found != entries.end() && found->second.line->text == line) {
+		found->second.lastUsed = ++clock;
+		held = found->second.line;
+		return held->list;
+	}
+
+	// The first time a line shows up it is parsed into the caller's arena, like any other line
+	size_t& slot = seen[hash % seen.size()];
+	bool admit = slot == hash;
+	slot = hash;
+	if (!admit && !mayKeepTree(line)) {
+		return parseLine(line, arena, error, readInput);
+	}
+
+	auto parsed = std::make_shared<ParsedLine>(line);
+	parsed->list = parseLine(parsed->text, parsed->arena, error, readInput);
+	if (!parsed->list) {
+		return nullptr;
+	}
+	held = parsed;
+	if (!admit || parsed->list->readInput) {
+		return parsed->list;
+	}
+
+	if (found == entries.end() && entries.size() >= capacity) {
+		entries.erase(std::min_element(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+			return a.second.lastUsed < b.second.lastUsed;
+		}));
+	}
+	// A line whose hash collides with a cached one takes its place
+	entries[hash] = Entry{std::move(parsed), ++clock};
+	return held->list;
+}
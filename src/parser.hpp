@@ -0,0 +1,216 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// --------------------------------------------------------------
+// Syntax tree of a line of input
+// --------------------------------------------------------------
+
+// A word after quote removal, or as written if it has to be expanded when the command runs
+// The text points into the input line, or into the arena if quotes or escapes had to be removed
+struct Word {
+	std::string_view text{};
+	bool quoted{false}; // Part of the word was quoted or escaped
+	bool expand{false}; // Contains $ expansions or pattern characters, text is then the word as written, quotes included
+	bool assignment{false}; // NAME=value in front of the command name
+};
+
+enum class RedirectOp : uint8_t {
+	Input,      // <
+	Output,     // > and >|
+	Append,     // >>
+	DupInput,   // <&
+	DupOutput,  // >&
+	ReadWrite,  // <>
+	HereDoc,    // << and <<-
+	HereString, // <<<
+	OutputBoth, // &>
+	AppendBoth  // &>>
+};
+
+struct Redirection {
+	int fd{1};
+	RedirectOp op{RedirectOp::Output};
+	Word target{}; // File, descriptor number or - for n>&m, delimiter of a here-document
+	bool stripTabs{false}; // Set for <<-
+	std::string_view body{}; // Lines of a here-document up to its delimiter, each ending with a newline
+};
+
+struct CompoundCommand;
+
+// A command with its arguments and redirections, e.g. `ls -l > out.txt`
+// A stage that is a compound command has no words, its redirections apply to the whole compound
+struct SimpleCommand {
+	explicit SimpleCommand(std::pmr::memory_resource* arena) : assignments(arena), words(arena), redirections(arena) {}
+
+	std::pmr::vector<Word> assignments; // NAME=value words in front of the command name
+	std::pmr::vector<Word> words;
+	std::pmr::vector<Redirection> redirections;
+	const CompoundCommand* compound{nullptr}; // if, while, until, for, case, { } or a function definition
+};
+
+// Commands connected with |, optionally negated with ! and timed with the time keyword
+struct Pipeline {
+	explicit Pipeline(std::pmr::memory_resource* arena) : commands(arena) {}
+
+	std::pmr::vector<SimpleCommand> commands; // Empty for a bare `time`
+	std::string_view text{}; // The pipeline as it was written, shown by jobs
+	bool negated{false};
+	bool timed{false};
+	bool posixTime{false}; // time -p, report in the POSIX format instead of TIMEFORMAT
+};
+
+// The operator that follows a pipeline in a list
+enum class ListOp : uint8_t {
+	Sequence,  // ; or the end of the line
+	And,       // &&
+	Or,        // ||
+	Background // &
+};
+
+struct ListItem {
+	Pipeline pipeline;
+	ListOp op{ListOp::Sequence};
+};
+
+// Everything on one line of input, or the commands inside a compound command
+struct CommandList {
+	explicit CommandList(std::pmr::memory_resource* arena) : items(arena) {}
+
+	std::pmr::vector<ListItem> items;
+	bool readInput{false}; // Lines or here-document bodies following the line were read, set on the whole line
+};
+
+enum class CompoundKind : uint8_t {
+	If,
+	While,
+	Until,
+	For,
+	Case,
+	Group,   // { list; }
+	Function // name() compound, defines the function when it runs
+};
+
+// A condition and the commands it guards, an else or the body of a for loop or group has no condition
+struct Clause {
+	const CommandList* condition{nullptr};
+	const CommandList* body{nullptr};
+};
+
+// An item of a case, `a|b) list ;;`, the list may be empty
+struct CaseItem {
+	explicit CaseItem(std::pmr::memory_resource* arena) : patterns(arena) {}
+
+	std::pmr::vector<Word> patterns;
+	const CommandList* body{nullptr};
+};
+
+struct Program;
+
+struct CompoundCommand {
+	explicit CompoundCommand(std::pmr::memory_resource* arena) : clauses(arena), words(arena), items(arena), redirections(arena) {}
+
+	CompoundKind kind{CompoundKind::Group};
+	Word name{}; // Variable of a for loop, subject of a case or name of a function
+	std::pmr::vector<Clause> clauses; // if, elif and else, the condition and body of a loop, the body of a group
+	std::pmr::vector<Word> words; // What a for loop iterates over
+	bool hasIn{false}; // A for loop without in iterates over the positional parameters
+	std::pmr::vector<CaseItem> items;
+	const CompoundCommand* body{nullptr}; // The body of a function
+	std::pmr::vector<Redirection> redirections; // Redirections of a function's body, applied on every call
+	const Program* program{nullptr}; // The command compiled to bytecode, in the same arena
+};
+
+// --------------------------------------------------------------
+// Expansions
+// --------------------------------------------------------------
+
+// A $ at pos starts an expansion if a name, a special parameter, ${ or $( follows
+bool startsExpansion(std::string_view text, size_t pos);
+
+// Find the end of the ${...} or $(...) whose opening bracket is at pos, quotes and nested groups included
+// Returns npos if it is not closed
+size_t expansionEnd(std::string_view text, size_t pos);
+
+// --------------------------------------------------------------
+// Parser
+// --------------------------------------------------------------
+
+// Memory for the tree of one line
+// Typical lines fit into the inline buffer, so parsing them does not touch the heap
+struct ParseArena {
+	ParseArena() = default;
+	ParseArena(const ParseArena&) = delete;
+	ParseArena& operator=(const ParseArena&) = delete;
+
+	// Forget the previous tree and start again at the beginning of the inline buffer
+	void reset() { resource.release(); }
+
+	alignas(std::max_align_t) std::array<std::byte, 16 * 1024> buffer;
+	std::pmr::monotonic_buffer_resource resource{buffer.data(), buffer.size()};
+};
+
+// Reads the next line of input without its newline, returns false at the end of the input
+using LineReader = bool (*)(std::string& line);
+
+// Parse a line in a single pass, returns nullptr and sets error on a syntax error
+// A compound command that is not complete at the end of the line continues on the lines readInput
+// returns, they are copied into the arena. The bodies of here-documents follow the line they are
+// on, they are read with readInput once the parser leaves that line. Compound commands are compiled
+// to bytecode as soon as they are parsed.
+// The tree points into both the line and the arena, so it is only valid as long as they are
+const CommandList* parseLine(std::string_view line, ParseArena& arena, std::string& error, LineReader readInput = nullptr);
+
+// --------------------------------------------------------------
+// Parsed lines of repeated commands
+// --------------------------------------------------------------
+
+// A line along with its tree, which points into both of them
+// The constructor keeps the arena's buffer from being zeroed, which value initialization would do
+struct ParsedLine {
+	explicit ParsedLine(std::string_view text) : text(text) {}
+
+	std::string text;
+	ParseArena arena;
+	const CommandList* list{nullptr};
+};
+
+// Trees of the lines that were run repeatedly, least recently used ones are dropped
+//
+// The tree only depends on the text of the line: variables, PATH and the hash table are looked at
+// when a command runs, so an entry stays valid until it is evicted. A line is only kept the second
+// time it shows up, lines run once, like most lines of a script, never pay for a copy. Lines that
+// read more input, the rest of a compound command or here-document bodies, are never kept.
+//
+// Lines that may hold compound commands are always parsed into memory of their own, so a function
+// they define can keep its tree once the line is done.
+class LineCache {
+public:
+	explicit LineCache(size_t capacity = 64);
+	LineCache(const LineCache&) = delete;
+	LineCache& operator=(const LineCache&) = delete;
+
+	// The tree of the line, from the cache or parsed into arena, nullptr and error on a syntax error
+	// held owns the tree if it is not in arena, it stays alive while it runs even if running it evicts the entry
+	const CommandList* parse(std::string_view line, ParseArena& arena, std::string& error, LineReader readInput,
+		std::shared_ptr<const ParsedLine>& held);
+
+private:
+	struct Entry {
+		std::shared_ptr<const ParsedLine> line{};
+		uint64_t lastUsed{0};
+	};
+
+	std::unordered_map<size_t, Entry> entries; // By hash of the text, the text is compared on a hit
+	std::array<size_t, 256> seen{}; // Hashes of lines that were parsed once, a second time admits them
+	size_t capacity;
+	uint64_t clock{0};
+};
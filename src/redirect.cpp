@@ -0,0 +1,221 @@
+#include "redirect.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+bool isAllDigits(std::string_view text) {
+	return !text.empty() && text.find_first_not_of("0123456789") == std::string_view::npos;
+}
+
+// Write all of text, returns false on errors, including a full pipe that does not block
+bool writeFully(int fd, std::string_view text) {
+	while (!text.empty()) {
+		ssize_t bytes = write(fd, text.data(), text.size());
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		text.remove_prefix(bytes);
+	}
+	return true;
+}
+
+} // namespace
+
+int contentDescriptor(std::string_view text) {
+	// A pipe holds the whole text if it fits its capacity, the write end must not block if it does not
+	int pipeFds[2];
+	if (pipe2(pipeFds, O_CLOEXEC) == 0) {
+		int capacity = fcntl(pipeFds[1], F_GETPIPE_SZ);
+		bool written = capacity >= 0 && text.size() <= static_cast<size_t>(capacity) &&
+			fcntl(pipeFds[1], F_SETFL, O_NONBLOCK) == 0 && writeFully(pipeFds[1], text);
+		close(pipeFds[1]);
+		if (written) {
+			return pipeFds[0];
+		}
+		close(pipeFds[0]);
+	}
+
+	int fd = memfd_create("here-document", MFD_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	if (!writeFully(fd, text) || lseek(fd, 0, SEEK_SET) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+RedirectionPlan::RedirectionPlan(const std::array<int, 3>& standardFds) {
+	targets.reserve(4);
+	for (int fd = 0; fd < 3; ++fd) {
+		targets.emplace_back(fd, standardFds[fd]);
+	}
+}
+
+RedirectionPlan::~RedirectionPlan() {
+	for (int fd : opened) {
+		close(fd);
+	}
+}
+
+int RedirectionPlan::source(int fd) const {
+	for (const auto& [target, sourceFd] : targets) {
+		if (target == fd) {
+			return sourceFd;
+		}
+	}
+	// Descriptors without redirections are inherited from the shell
+	return fd;
+}
+
+void RedirectionPlan::set(int fd, int sourceFd) {
+	for (auto& [target, current] : targets) {
+		if (target == fd) {
+			current = sourceFd;
+			return;
+		}
+	}
+	targets.emplace_back(fd, sourceFd);
+}
+
+// Remember a descriptor the plan opened, so it is closed with the plan
+int RedirectionPlan::keep(int fd) {
+	if (fd != -1) {
+		opened.push_back(fd);
+	}
+	return fd;
+}
+
+bool RedirectionPlan::add(std::span<const Redirection> redirections, std::string& error) {
+	for (const auto& redirection : redirections) {
+		if (!addOne(redirection, error)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool RedirectionPlan::addOne(const Redirection& redirection, std::string& error) {
+	std::string target(redirection.target.text);
+	int flags = 0;
+	bool both = false;
+	switch (redirection.op) {
+		case RedirectOp::Input:
+			flags = O_RDONLY;
+			break;
+		case RedirectOp::Output:
+			flags = O_WRONLY | O_CREAT | O_TRUNC;
+			break;
+		case RedirectOp::OutputBoth:
+			flags = O_WRONLY | O_CREAT | O_TRUNC;
+			both = true;
+			break;
+		case RedirectOp::Append:
+			flags = O_WRONLY | O_CREAT | O_APPEND;
+			break;
+		case RedirectOp::AppendBoth:
+			flags = O_WRONLY | O_CREAT | O_APPEND;
+			both = true;
+			break;
+		case RedirectOp::ReadWrite:
+			flags = O_RDWR | O_CREAT;
+			break;
+		case RedirectOp::DupInput:
+		case RedirectOp::DupOutput:
+			// n>&- closes n, n>&m makes n a copy of what m currently points to
+			if (target == "-") {
+				set(redirection.fd, -1);
+				return true;
+			}
+			if (isAllDigits(target)) {
+				int sourceFd = source(std::atoi(target.c_str()));
+				if (sourceFd == -1 || fcntl(sourceFd, F_GETFD) == -1) {
+					error = target + ": Bad file descriptor";
+					return false;
+				}
+				set(redirection.fd, sourceFd);
+				return true;
+			}
+			// >&file is the old way to write &>file
+			if (redirection.op == RedirectOp::DupOutput && redirection.fd == 1) {
+				flags = O_WRONLY | O_CREAT | O_TRUNC;
+				both = true;
+				break;
+			}
+			error = target + ": ambiguous redirect";
+			return false;
+		case RedirectOp::HereDoc:
+		case RedirectOp::HereString: {
+			// A here-string is its word followed by a newline
+			std::string_view text = redirection.body;
+			if (redirection.op == RedirectOp::HereString) {
+				target += '\n';
+				text = target;
+			}
+			int fd = keep(contentDescriptor(text));
+			if (fd == -1) {
+				error = std::string("cannot create here-document: ") + std::strerror(errno);
+				return false;
+			}
+			set(redirection.fd, fd);
+			return true;
+		}
+	}
+
+	int fd = keep(open(target.c_str(), flags | O_CLOEXEC, 0666));
+	if (fd == -1) {
+		error = target + ": " + std::strerror(errno);
+		return false;
+	}
+	set(redirection.fd, fd);
+	if (both) {
+		set(STDERR_FILENO, fd);
+	}
+	return true;
+}
+
+int RedirectionPlan::fileActions(posix_spawn_file_actions_t& actions) {
+	// The child applies the actions one after the other, so a source that is itself redirected
+	// would already be overwritten when it is copied, like stdout in 3>&1 1>&2 2>&3
+	// Such sources are copied above every target first
+	int above = 3;
+	for (const auto& [target, sourceFd] : targets) {
+		above = std::max(above, target + 1);
+	}
+	for (auto& [target, sourceFd] : targets) {
+		bool overwritten = sourceFd != -1 && sourceFd != target && std::any_of(targets.begin(), targets.end(),
+			[&](const auto& other) { return other.first == sourceFd && other.second != sourceFd; });
+		if (overwritten) {
+			int copy = keep(fcntl(sourceFd, F_DUPFD_CLOEXEC, above));
+			if (copy == -1) {
+				return errno;
+			}
+			sourceFd = copy;
+		}
+	}
+
+	// A file opened right onto its target, like 3>file with 3 free, is close-on-exec as well
+	// A dup2 onto itself clears that in the child (glibc 2.29), so it is queued even then
+	for (const auto& [target, sourceFd] : targets) {
+		int error = 0;
+		if (sourceFd == -1) {
+			error = posix_spawn_file_actions_addclose(&actions, target);
+		} else {
+			error = posix_spawn_file_actions_adddup2(&actions, sourceFd, target);
+		}
+		if (error != 0) {
+			return error;
+		}
+	}
+	return 0;
+}
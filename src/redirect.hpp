@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <span>
+#include <spawn.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "parser.hpp"
+
+// --------------------------------------------------------------
+// Redirections
+// --------------------------------------------------------------
+
+// The descriptors a command ends up with after its redirections
+//
+// Nothing is applied to the shell itself: every descriptor of the command is described by
+// the descriptor of the shell it becomes a copy of. An external command gets them through
+// posix_spawn file actions in the child, a builtin gets its stdin, stdout and stderr passed in.
+class RedirectionPlan {
+public:
+	// Start with the descriptors the command would use without redirections, e.g. the ends of its pipes
+	explicit RedirectionPlan(const std::array<int, 3>& standardFds);
+	RedirectionPlan(const RedirectionPlan&) = delete;
+	RedirectionPlan& operator=(const RedirectionPlan&) = delete;
+	~RedirectionPlan(); // Closes the files and here-documents the redirections opened
+
+	// Apply the redirections in order, returns false and sets error if one of them fails
+	bool add(std::span<const Redirection> redirections, std::string& error);
+
+	// The shell descriptor behind a descriptor of the command, -1 if it is closed
+	int source(int fd) const;
+
+	// Stdin, stdout and stderr for a builtin
+	std::array<int, 3> standard() const { return {source(0), source(1), source(2)}; }
+
+	// Describe the plan as file actions, returns the error of posix_spawn_file_actions_*
+	int fileActions(posix_spawn_file_actions_t& actions);
+
+private:
+	bool addOne(const Redirection& redirection, std::string& error);
+	void set(int fd, int sourceFd);
+	int keep(int fd);
+
+	std::vector<std::pair<int, int>> targets{}; // Descriptor of the command and its source in the shell
+	std::vector<int> opened{};
+};
+
+// A descriptor to read text from, used for here-documents and here-strings
+// Text that fits is written into a pipe up front, anything larger goes into an anonymous file
+int contentDescriptor(std::string_view text);
@@ -0,0 +1,3180 @@
+#include <array>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <charconv>
+#include <cstring>
+#include <csignal>
+#include <fnmatch.h>
+#include <optional>
+#include <spawn.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <readline/readline.h>
+#include <readline/history.h>	
+
+#include "shell.hpp"
+
+#include "builtins.hpp"
+#include "bytecode.hpp"
+#include "completion.hpp"
+#include "coreutils.hpp"
+#include "eventloop.hpp"
+#include "expand.hpp"
+#include "glob.hpp"
+#include "jobs.hpp"
+#include "parallel.hpp"
+#include "redirect.hpp"
+#include "variables.hpp"
+
+HistoryStore commandHistory; // Command history, bounded by HISTSIZE
+HistoryWriter historyWriter; // Appends new commands to HISTFILE as they are entered
+
+std::string PATH; // Copy of $PATH, taken from the environment on the first command lookup
+bool pathSynced = false;
+
+int lastExitStatus = 0; // Exit status of the last foreground command, as reported by $?
+pid_t lastBackgroundPid = 0; // The last process started in the background, as reported by $!
+
+size_t navigationOffset = 0; // How many entries the arrow keys moved back from the newest one
+size_t historyFileSize = 1000; // Number of lines kept in the history file (HISTFILESIZE)
+uint64_t historyAppendMark = 0; // Newest entry already written by history -a to a file other than HISTFILE
+
+bool exitRequested = false; // Set by the exit builtin
+bool timeEveryPipeline = false; // -t, time every pipeline as if it started with the time keyword
+
+OutputSink shellOutput(STDOUT_FILENO, 64 * 1024); // The shell's stdout, collects builtin output until a command is started
+
+JobTable jobTable; // Pipelines started with & and stopped foreground pipelines
+bool jobControl = false; // Interactive on a terminal, every pipeline gets its own process group
+pid_t shellProcessGroup = 0;
+volatile sig_atomic_t childStateChanged = 0; // Set by the SIGCHLD handler, cleared when the jobs are reaped
+std::string_view foregroundText{}; // The pipeline running in the foreground, for the job table if it gets stopped
+
+std::vector<std::string> positionalParameters; // $1, $2, ... of the script or of the function that runs
+std::string shellName = "shell"; // $0, the path of the script
+
+// A function keeps the tree of the line that defined it alive, the line may be long gone when it is called
+struct ShellFunction {
+	std::shared_ptr<const ParsedLine> tree{};
+	const CompoundCommand* definition{nullptr};
+};
+std::unordered_map<std::string, ShellFunction> functions;
+std::shared_ptr<const ParsedLine> activeTree; // Tree of the line or function that runs, if it is not in a stack arena
+
+// break, continue and return stop the commands that run until the loop or function they are for takes them
+// Interrupt, a foreground command killed with ^C under job control, stops everything up to the prompt
+enum class LoopControl : uint8_t { None, Break, Continue, Return, Interrupt };
+LoopControl loopControl = LoopControl::None;
+int controlCount = 0; // Loops break and continue still have to leave
+int loopDepth = 0; // Loops that run in the current function call, or outside of any
+int functionDepth = 0;
+constexpr int maxFunctionDepth = 1000; // Deeper recursion is an error instead of a stack overflow
+
+// --------------------------------------------------------------
+// Builtin registry
+// --------------------------------------------------------------
+
+int cdBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int pwdBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int echoBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int typeBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int exitBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int historyBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int hashBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int jobsBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int waitBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int fgBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int bgBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int killBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int exportBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int unsetBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int parallelBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int breakBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int continueBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+int returnBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+
+// Adding a builtin only takes a handler and an entry here, the lookup table is built at compile time
+// Completion offers the builtins in this order
+constexpr auto builtins = makeBuiltinTable<BuiltinHandler>({
+	{"cd", cdBuiltin},
+	{"pwd", pwdBuiltin},
+	{"echo", echoBuiltin},
+	{"type", typeBuiltin},
+	{"exit", exitBuiltin},
+	{"history", historyBuiltin},
+	{"hash", hashBuiltin},
+	{"jobs", jobsBuiltin},
+	{"wait", waitBuiltin},
+	{"fg", fgBuiltin},
+	{"bg", bgBuiltin},
+	{"kill", killBuiltin},
+	{"export", exportBuiltin},
+	{"unset", unsetBuiltin},
+	{"parallel", parallelBuiltin},
+	{"break", breakBuiltin},
+	{"continue", continueBuiltin},
+	{"return", returnBuiltin},
+	{":", trueBuiltin},
+});
+
+BuiltinHandler findBuiltin(std::string_view name) {
+	const auto* entry = builtins.find(name);
+	return entry ? entry->handler : nullptr;
+}
+// --------------------------------------------------------------
+// Utility functions
+// --------------------------------------------------------------
+
+// Function to split a string by a delimiter
+// This function takes a string and a delimiter character as input and returns a vector of strings
+std::vector<std::string> split(const std::string& str, char delimiter) {
+    std::vector<std::string> tokens;
+    size_t start = 0;
+    size_t end = str.find(delimiter);
+    while (end != std::string::npos) {
+        tokens.push_back(str.substr(start, end - start));
+        start = end + 1;
+        end = str.find(delimiter, start);
+    }
+    tokens.push_back(str.substr(start, end));
+    return tokens;
+}
+
+// Write the whole buffer, stopping early if the reader went away
+void writeAll(int fd, std::string_view data) {
+	size_t written = 0;
+	while (written < data.size()) {
+		ssize_t bytes = write(fd, data.data() + written, data.size() - written);
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes <= 0) {
+			return;
+		}
+		written += bytes;
+	}
+}
+
+// --------------------------------------------------------------
+// Command hash table
+// --------------------------------------------------------------
+
+// A directory from PATH, what we know about it is valid as long as its mtime does not change
+// The sorted names of its entries are only read once completion needs them
+struct PathDirectory {
+	std::string path{};
+	struct timespec mtime{};
+	bool checked{false};
+	bool listed{false};
+	unsigned int misses{0}; // Lookups that stat'ed a candidate here in vain
+	std::vector<std::string> entries{};
+};
+
+// A remembered command location, like the entries of bash's hash table
+struct HashEntry {
+	std::string path{};
+	size_t directoryIndex{0};
+	unsigned int hits{0};
+};
+
+std::string hashedPATH; // Value of PATH the hash table was built for
+std::vector<PathDirectory> pathDirectories;
+std::unordered_map<std::string, HashEntry> commandHashTable;
+
+// Sorted, duplicate free names of every entry in PATH, used for completion
+std::vector<std::string> executableIndex;
+bool executableIndexDirty = true;
+
+bool isExecutableFile(const std::string& path) {
+	// Only regular files that we are allowed to execute can be run as commands
+	struct stat info;
+	return stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode) && access(path.c_str(), X_OK) == 0;
+}
+
+bool sameMtime(const struct timespec& a, const struct timespec& b) {
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+void resetHashTable() {
+	commandHashTable.clear();
+}
+
+void syncShellVariable(std::string_view name);
+
+void syncPathDirectories() {
+	if (!pathSynced) {
+		syncShellVariable("PATH");
+	}
+	// Rebuild the directory list and drop every remembered location when PATH is reassigned
+	if (!pathDirectories.empty() && hashedPATH == PATH) {
+		return;
+	}
+	hashedPATH = PATH;
+	pathDirectories.clear();
+	commandHashTable.clear();
+	executableIndexDirty = true;
+	for (const auto& path : split(PATH, ':')) {
+		pathDirectories.push_back(PathDirectory{path.empty() ? "." : path});
+	}
+}
+
+void invalidateDirectory(size_t directoryIndex) {
+	// Forget every command that was found in the given directory
+	std::erase_if(commandHashTable, [directoryIndex](const auto& entry) {
+		return entry.second.directoryIndex == directoryIndex;
+	});
+}
+
+// Read the names in a directory, d_type lets us skip subdirectories without a stat
+void listDirectory(PathDirectory& directory) {
+	directory.entries.clear();
+	if (DIR* dir = opendir(directory.path.c_str())) {
+		while (const dirent* entry = readdir(dir)) {
+			if (entry->d_type == DT_DIR || entry->d_name[0] == '.') {
+				continue;
+			}
+			directory.entries.emplace_back(entry->d_name);
+		}
+		closedir(dir);
+	}
+	std::sort(directory.entries.begin(), directory.entries.end());
+}
+
+// Check a directory for changes, returns true if it was modified since we last looked at it
+// A changed directory loses its remembered commands and its listing, which is read again when needed
+bool refreshDirectory(size_t directoryIndex) {
+	PathDirectory& directory = pathDirectories[directoryIndex];
+	struct stat info;
+	if (stat(directory.path.c_str(), &info) != 0) {
+		info.st_mtim = {};
+	}
+	if (directory.checked && sameMtime(directory.mtime, info.st_mtim)) {
+		return false;
+	}
+	directory.mtime = info.st_mtim;
+	directory.checked = true;
+	directory.listed = false;
+	directory.misses = 0;
+	directory.entries.clear();
+	invalidateDirectory(directoryIndex);
+	executableIndexDirty = true;
+	return true;
+}
+
+// Refresh the directories whose mtime changed and rebuild the completion index if needed
+void refreshExecutableIndex() {
+	syncPathDirectories();
+	for (size_t i = 0; i < pathDirectories.size(); ++i) {
+		refreshDirectory(i);
+		if (!pathDirectories[i].listed) {
+			listDirectory(pathDirectories[i]);
+			pathDirectories[i].listed = true;
+		}
+	}
+	if (!executableIndexDirty) {
+		return;
+	}
+	executableIndex.clear();
+	for (const auto& directory : pathDirectories) {
+		executableIndex.insert(executableIndex.end(), directory.entries.begin(), directory.entries.end());
+	}
+	std::sort(executableIndex.begin(), executableIndex.end());
+	executableIndex.erase(std::unique(executableIndex.begin(), executableIndex.end()), executableIndex.end());
+	executableIndexDirty = false;
+}
+
+// Look up the absolute path of a command, filling the hash table on the first lookup
+bool hashLookup(const std::string& name, std::string& foundPath, bool countHit) {
+	if (name.empty()) {
+		return false;
+	}
+	// Commands containing a slash are never searched for in PATH
+	if (name.find('/') != std::string::npos) {
+		if (!isExecutableFile(name)) {
+			return false;
+		}
+		foundPath = name;
+		return true;
+	}
+
+	syncPathDirectories();
+
+	auto entry = commandHashTable.find(name);
+	if (entry != commandHashTable.end()) {
+		// A single stat of the directory tells us if the remembered location is still valid
+		if (!refreshDirectory(entry->second.directoryIndex)) {
+			entry->second.hits += countHit;
+			foundPath = entry->second.path;
+			return true;
+		}
+	}
+
+	// Search the directories in order, a listing shared with the completion index saves the stat
+	// of every directory that does not have the command
+	// A short lived shell only stat's the candidates, a directory is listed once it missed twice
+	for (size_t i = 0; i < pathDirectories.size(); ++i) {
+		refreshDirectory(i);
+		PathDirectory& directory = pathDirectories[i];
+		if (!directory.listed && directory.misses >= 2) {
+			listDirectory(directory);
+			directory.listed = true;
+		}
+		if (directory.listed && !std::binary_search(directory.entries.begin(), directory.entries.end(), name)) {
+			continue;
+		}
+		std::string commandPath = directory.path + "/" + name;
+		if (!isExecutableFile(commandPath)) {
+			++directory.misses;
+		} else {
+			commandHashTable[name] = HashEntry{commandPath, i, countHit ? 1u : 0u};
+			foundPath = commandPath;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool searchPath(const CommandData& commandData, std::string& foundPath) {
+	return hashLookup(std::string(commandData.command), foundPath);
+}
+
+// Build the argument list of an external command, starting with the command name itself
+std::vector<std::string> commandArguments(const CommandData& commandData) {
+	std::vector<std::string> arguments;
+	arguments.reserve(commandData.words.size());
+	for (const auto& word : commandData.words) {
+		arguments.emplace_back(word.text);
+	}
+	return arguments;
+}
+
+// Null-terminated view of the arguments, as expected by execv and posix_spawn
+std::vector<char*> argumentVector(std::vector<std::string>& arguments) {
+	std::vector<char*> argv;
+	argv.reserve(arguments.size() + 1);
+	for (auto& argument : arguments) {
+		argv.push_back(argument.data());
+	}
+	argv.push_back(nullptr);
+	return argv;
+}
+
+// --------------------------------------------------------------
+// Function to handle the autocompletion of commands
+// --------------------------------------------------------------
+
+// Function to generate command matches
+char* commandGenerator(const char *text, int state)
+{
+    static size_t commandsListIndex, programListIndex;
+	static std::string prefix;
+
+    if (!state) {
+        commandsListIndex = 0;
+		prefix = text;
+		// Only directories that changed since the last completion are read again
+		refreshExecutableIndex();
+		programListIndex = std::lower_bound(executableIndex.begin(), executableIndex.end(), prefix) - executableIndex.begin();
+    }
+
+	// Check to see if the command is in the list of commands
+    while (commandsListIndex < builtins.entries().size()) {
+		std::string_view name = builtins.entries()[commandsListIndex++].name;
+		if (name.starts_with(prefix)) {
+			return strndup(name.data(), name.size());
+		}
+	}
+
+	// The index is sorted, so the programs matching the prefix directly follow the lower bound
+	if (programListIndex < executableIndex.size() && executableIndex[programListIndex].starts_with(prefix)) {
+		return strdup(executableIndex[programListIndex++].c_str());
+	}
+
+    return nullptr;
+}
+
+DirectoryCache completionDirectories; // Listings of the directories arguments were completed in, read in the background
+constexpr auto completionWait = std::chrono::milliseconds(100); // Longer than this and the prompt takes what was read so far
+
+// Function to generate file name matches for an argument, from the directory the text up to its last slash names
+char* argumentGenerator(const char *text, int state)
+{
+	static std::vector<CompletionEntry> matches;
+	static size_t matchIndex;
+	static std::string directoryText;
+
+	if (!state) {
+		matches.clear();
+		matchIndex = 0;
+		std::string_view word = text;
+		size_t slash = word.rfind('/');
+		directoryText = slash == std::string_view::npos ? "" : std::string(word.substr(0, slash + 1));
+		std::string directory = directoryText.empty() ? "." : directoryText;
+		if (directory.starts_with("~/")) {
+			const char* home = getVariable("HOME");
+			directory.replace(0, 1, home ? home : "");
+		}
+		bool complete = completionDirectories.lookup(directory, word.substr(directoryText.size()), completionWait, matches);
+		// A directory is completed up to its slash, so Tab goes on into it
+		// A listing still being read may miss the name the user wants, so a single match does not end the word either
+		if (matches.size() == 1 && (matches[0].directory || !complete)) {
+			rl_completion_suppress_append = 1;
+		}
+	}
+
+	if (matchIndex < matches.size()) {
+		const CompletionEntry& entry = matches[matchIndex++];
+		return strdup((directoryText + entry.name + (entry.directory ? "/" : "")).c_str());
+	}
+	return nullptr;
+}
+
+char** commandCompletion(const char *text, int start, int end)
+{
+	// Arguments are completed from our own listings, readline's file name completion would block on slow directories
+	rl_attempted_completion_over = 1;
+ 	if (start != 0) {
+		return rl_completion_matches(text, argumentGenerator);
+    }
+
+    return rl_completion_matches(text, commandGenerator);
+}
+
+
+// --------------------------------------------------------------
+// Function to read non-interactive input in large blocks
+// --------------------------------------------------------------
+
+LineInput* activeInput = nullptr; // The input the shell reads its own stdin from, if any
+
+// Read shared stdin without taking anything past the next newline, a line costs three calls instead of one per byte
+// tee copies what the pipe holds into our own pipe without consuming it, then only the line is read for real
+ssize_t readUpToNewline(LineInput& input, char* to, size_t size) {
+	ssize_t peeked = input.peekPipe[0] == -1 ? -1 : tee(input.fd, input.peekPipe[1], std::min<size_t>(size, 4096), 0);
+	if (peeked == -1) {
+		return errno == EINTR ? -1 : read(input.fd, to, 1);
+	}
+	for (ssize_t copied = 0; copied < peeked;) {
+		ssize_t bytes = read(input.peekPipe[0], to + copied, peeked - copied);
+		if (bytes <= 0) {
+			return -1;
+		}
+		copied += bytes;
+	}
+	const void* newline = std::memchr(to, '\n', peeked);
+	size_t lineSize = newline ? static_cast<const char*>(newline) - to + 1 : peeked;
+	return read(input.fd, to, lineSize);
+}
+
+bool readLine(LineInput& input, std::string& line) {
+	while (true) {
+		// Hand out the next complete line from the buffer
+		const char* begin = input.buffer.data() + input.start;
+		const char* newline = static_cast<const char*>(std::memchr(begin, '\n', input.end - input.start));
+		if (newline) {
+			line.assign(begin, newline);
+			input.start += newline - begin + 1;
+			return true;
+		}
+		if (input.eof) {
+			// The last line may not end with a newline
+			if (input.start == input.end) {
+				return false;
+			}
+			line.assign(begin, input.end - input.start);
+			input.start = input.end;
+			return true;
+		}
+
+		// Move the partial line to the front and read the next block behind it
+		std::memmove(input.buffer.data(), begin, input.end - input.start);
+		input.end -= input.start;
+		input.start = 0;
+		if (input.end == input.buffer.size()) {
+			input.buffer.resize(input.buffer.size() * 2);
+		}
+		char* to = input.buffer.data() + input.end;
+		size_t space = input.buffer.size() - input.end;
+		ssize_t bytes = input.lineReads ? readUpToNewline(input, to, space) : read(input.fd, to, space);
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes <= 0) {
+			input.eof = true;
+		} else {
+			input.end += bytes;
+		}
+	}
+}
+
+// Give the part of stdin we buffered but did not use back to the commands we start
+// This only works if stdin is seekable, the same limitation bash has
+void syncInput() {
+	if (!activeInput || activeInput->start == activeInput->end) {
+		return;
+	}
+	if (lseek(activeInput->fd, -static_cast<off_t>(activeInput->end - activeInput->start), SEEK_CUR) != -1) {
+		activeInput->start = activeInput->end = 0;
+	}
+}
+
+// --------------------------------------------------------------
+// Function to handle history commands
+// --------------------------------------------------------------
+
+int historyNavFct (int count, int key) {
+	// If you press the up arrow, go to the previous command
+	if (key == 65) {
+		if (commandHistory.fromEnd(navigationOffset)) {
+			navigationOffset++;
+		}
+	// If you press the down arrow, go to the next command
+	} else if (key == 66) {
+		if (navigationOffset > 0) {
+			navigationOffset--;
+		}
+	}
+	// Clear current line and write the command to the line
+	// Only the entries we navigate over are read from the history file
+	const std::string* command = navigationOffset > 0 ? commandHistory.fromEnd(navigationOffset - 1) : nullptr;
+	rl_replace_line(command ? command->c_str() : "", 1);
+	rl_point = rl_end;
+	rl_redisplay();
+	return 0;
+}
+
+// Set up readline once, before the first prompt: completion and the arrow keys walking the history
+// Scripts and -c never get here, so they do not pay for readline and its inputrc
+void initLineEditing() {
+	rl_initialize();
+	rl_attempted_completion_function = commandCompletion;
+	rl_command_func_t historyNavFct;
+	rl_bind_keyseq ("\\e[A", historyNavFct); // ascii code for UP ARROW
+	rl_bind_keyseq ("\\e[B", historyNavFct); // ascii code for DOWN ARROW
+}
+
+void AddToHistory(const std::string& command) {
+	// Add the command to the history and start navigating from the newest entry again
+	navigationOffset = 0;
+	commandHistory.add(command);
+	historyWriter.commandAdded(commandHistory);
+}
+
+void loadHistoryFromFile(const std::string& path) {
+	// Load the command history from the file
+	readHistoryFile(path, commandHistory);
+}
+
+void saveHistoryToFile(const std::string& path) {
+	// Save the command history to the file, keeping at most HISTFILESIZE lines
+	// size() indexes everything first, so the collected entries stay where they are
+	size_t size = commandHistory.size();
+	std::vector<const std::string*> entries;
+	entries.reserve(std::min(size, historyFileSize));
+	for (size_t i = size - std::min(size, historyFileSize); i < size; ++i) {
+		entries.push_back(&commandHistory.at(i));
+	}
+	if (rewriteHistoryFile(path, entries) && historyWriter.isFile(path)) {
+		historyWriter.markWritten(commandHistory);
+	}
+}
+
+void appendHistoryToFile(const std::string& path) {
+	// Append the commands entered since the last append to the file
+	if (historyWriter.isFile(path)) {
+		historyWriter.flush(commandHistory);
+		return;
+	}
+	std::vector<const std::string*> entries = commandHistory.entriesSince(historyAppendMark);
+	if (entries.empty() || appendHistoryEntries(path, entries)) {
+		historyAppendMark = commandHistory.sequence();
+	}
+}
+
+// HISTFSYNC picks when history writes are forced to disk: always, exit or never (the default)
+HistorySync historySyncPolicy() {
+	const char* value = getVariable("HISTFSYNC");
+	std::string_view policy = value ? value : "";
+	if (policy == "always") {
+		return HistorySync::Always;
+	}
+	return policy == "exit" ? HistorySync::OnExit : HistorySync::Never;
+}
+
+// Read a history limit from a variable, negative or invalid values keep the default
+size_t historyLimit(const char* name, size_t fallback) {
+	const char* value = getVariable(name);
+	if (!value || !*value || !std::all_of(value, value + std::strlen(value), ::isdigit)) {
+		return fallback;
+	}
+	return std::strtoull(value, nullptr, 10);
+}
+
+void loadHistoryOnStartup() {
+	// Size the history and map the file, its lines are only read when they are used
+	commandHistory.setCapacity(historyLimit("HISTSIZE", 1000));
+	historyFileSize = historyLimit("HISTFILESIZE", commandHistory.capacity());
+	const char* historyFile = getVariable("HISTFILE");
+	std::string path = historyFile ? historyFile : ".";
+	commandHistory.mapFile(path);
+
+	// Commands are appended as they are entered, every HISTFLUSH commands (0 waits for the exit)
+	historyWriter.setFlushEvery(historyLimit("HISTFLUSH", 1));
+	historyWriter.setSync(historySyncPolicy());
+	historyWriter.open(path, commandHistory);
+}
+
+// Write the commands that are still pending and trim HISTFILE to HISTFILESIZE lines
+void saveHistoryOnExit() {
+	historyWriter.flush(commandHistory, true);
+	historyWriter.truncate(historyFileSize);
+	historyWriter.close();
+}
+
+int historyBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	std::span<const Word> args = commandData.words.subspan(1);
+
+	// Load history from file
+	if (args.size() > 1 && args[0].text == "-r") {
+		if (!commandData.subshell) {
+			loadHistoryFromFile(std::string(args[1].text));
+		}
+		return 0;
+	}
+	// Save history to file
+	if (args.size() > 1 && args[0].text == "-w") {
+		saveHistoryToFile(std::string(args[1].text));
+		return 0;
+	}
+	// Append history to file
+	if (args.size() > 1 && args[0].text == "-a") {
+		appendHistoryToFile(std::string(args[1].text));
+		return 0;
+	}
+
+	// Print the command history
+	size_t historySize = commandHistory.size();
+	size_t historyIndex{0};
+	// Check if the user specified an index
+	if (!args.empty() && !args[0].text.empty() && std::all_of(args[0].text.begin(), args[0].text.end(), ::isdigit)) {
+		// Print the last n commands if the user specified an index, a count too large for size_t shows them all
+		size_t index = 0;
+		std::from_chars(args[0].text.data(), args[0].text.data() + args[0].text.size(), index);
+		if (index > 0 && index <= historySize) {
+			historyIndex = historySize - index;
+		}
+	}
+
+	// Stream the entries straight to the output, stopping early if nobody reads them anymore
+	for (; historyIndex < historySize && !out.failed(); ++historyIndex) {
+		out.writePadded(historyIndex + 1, 5);
+		out.write("  ");
+		out.write(commandHistory.at(historyIndex));
+		out.put('\n');
+	}
+	return 0;
+}
+
+// --------------------------------------------------------------
+// Functions to handle navigation commands
+// --------------------------------------------------------------
+
+int pwdBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	// Get the current working directory, it may have been removed under us
+	std::error_code error;
+	std::filesystem::path current = std::filesystem::current_path(error);
+	if (error) {
+		writeAll(fds[STDERR_FILENO], "pwd: " + error.message() + "\n");
+		return 1;
+	}
+	out.write(current.native());
+	out.put('\n');
+	return 0;
+}
+
+int cdBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	const char* home = getVariable("HOME");
+	std::string path = commandData.words.size() > 1 ? std::string(commandData.words[1].text) : home ? home : ".";
+	// Check to see if you are trying to change to the home directory
+	if (path == "~") {
+		path = home ? home : ".";
+	}
+
+	// A cd that runs in a subshell only checks that it could change to the directory
+	int result = 0;
+	if (!commandData.subshell) {
+		result = chdir(path.c_str());
+	} else if (struct stat status; stat(path.c_str(), &status) != 0) {
+		result = -1;
+	} else if (!S_ISDIR(status.st_mode)) {
+		errno = ENOTDIR;
+		result = -1;
+	} else {
+		result = access(path.c_str(), X_OK);
+	}
+	if (result != 0) {
+		writeAll(fds[STDERR_FILENO], "cd: " + path + ": " + std::strerror(errno) + "\n");
+		return 1;
+	}
+	return 0;
+}
+
+// --------------------------------------------------------------
+// Function to handle the base shell commands
+// --------------------------------------------------------------
+
+int echoBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	// Quotes and escapes were already removed by the parser, the words only have to be joined
+	for (size_t i = 1; i < commandData.words.size(); ++i) {
+		if (i > 1) {
+			out.put(' ');
+		}
+		out.write(commandData.words[i].text);
+	}
+	out.put('\n'); // Add a newline at the end of the output
+	return 0;
+}
+
+int typeBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	int status = 0;
+	for (const auto& word : commandData.words.subspan(1)) {
+		std::string name(word.text);
+		std::string commandPath{};
+
+		// Functions come before builtins, like when they are called
+		if (functions.contains(name)) {
+			out.write(name);
+			out.write(" is a function\n");
+		// Check if the command is in the list of builtin commands
+		} else if (builtins.find(name)) {
+			out.write(name);
+			out.write(" is a shell builtin\n");
+		// If the command is not a builtin, check if it is in a path
+		} else if (hashLookup(name, commandPath, false)) {
+			out.write(name);
+			out.write(" is ");
+			out.write(commandPath);
+			out.put('\n');
+		// If the command is neither a builtin nor in the path, print not found, in order with the other names
+		} else {
+			out.write(name);
+			out.write(": not found\n");
+			status = 1;
+		}
+	}
+	return status;
+}
+
+// Leave the shell, a pipeline stage that is not the last one only leaves its own subshell
+int exitBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	int status = lastExitStatus;
+	if (commandData.words.size() > 1) {
+		status = std::atoi(std::string(commandData.words[1].text).c_str()) & 0xff;
+	}
+	if (!commandData.subshell) {
+		exitRequested = true;
+	}
+	return status;
+}
+
+// The count of break and continue, the status return leaves a function with
+// Returns false and reports a word that is not a number
+bool builtinNumber(const CommandData& commandData, const std::array<int, 3>& fds, int& number) {
+	if (commandData.words.size() < 2) {
+		return true;
+	}
+	std::string_view text = commandData.words[1].text;
+	auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+	if (error != std::errc{} || end != text.data() + text.size()) {
+		writeAll(fds[STDERR_FILENO], std::string(commandData.words[0].text) + ": " + std::string(text) + ": numeric argument required\n");
+		return false;
+	}
+	return true;
+}
+
+// break [n] and continue [n] act on the nth enclosing loop, loops outside of the function that runs do not count
+// A pipeline stage that is not the last one runs as if in a subshell, it has no loops to leave
+int loopControlBuiltin(CommandData& commandData, const std::array<int, 3>& fds, LoopControl control) {
+	int count = 1;
+	if (!builtinNumber(commandData, fds, count)) {
+		return 1;
+	}
+	if (count < 1) {
+		writeAll(fds[STDERR_FILENO], std::string(commandData.words[0].text) + ": " + std::to_string(count) + ": loop count out of range\n");
+		return 1;
+	}
+	if (loopDepth == 0) {
+		writeAll(fds[STDERR_FILENO], std::string(commandData.words[0].text) + ": only meaningful in a `for', `while', or `until' loop\n");
+		return 0;
+	}
+	if (!commandData.subshell) {
+		loopControl = control;
+		controlCount = std::min(count, loopDepth);
+	}
+	return 0;
+}
+
+int breakBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	return loopControlBuiltin(commandData, fds, LoopControl::Break);
+}
+
+int continueBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	return loopControlBuiltin(commandData, fds, LoopControl::Continue);
+}
+
+// Leave the function that runs with the given status, or the status of the last command
+int returnBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	int status = lastExitStatus;
+	if (!builtinNumber(commandData, fds, status)) {
+		return 2;
+	}
+	if (functionDepth == 0) {
+		writeAll(fds[STDERR_FILENO], "return: can only `return' from a function\n");
+		return 1;
+	}
+	if (!commandData.subshell) {
+		loopControl = LoopControl::Return;
+	}
+	return status & 0xff;
+}
+
+// --------------------------------------------------------------
+// Function to handle the hash builtin
+// --------------------------------------------------------------
+
+int hashBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	std::span<const Word> args = commandData.words.subspan(1);
+
+	// List the remembered commands together with how often they were used
+	if (args.empty()) {
+		if (commandHashTable.empty()) {
+			out.write("hash: hash table empty\n");
+			return 0;
+		}
+		// Pointers into the table, sorted by name, so listing neither copies nor looks anything up again
+		std::vector<const std::pair<const std::string, HashEntry>*> entries;
+		entries.reserve(commandHashTable.size());
+		for (const auto& entry : commandHashTable) {
+			entries.push_back(&entry);
+		}
+		std::sort(entries.begin(), entries.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+
+		out.write("hits\tcommand\n");
+		for (const auto* entry : entries) {
+			out.writePadded(entry->second.hits, 4);
+			out.put('\t');
+			out.write(entry->second.path);
+			out.put('\n');
+		}
+		return 0;
+	}
+
+	// Forget every remembered location
+	if (args[0].text == "-r") {
+		resetHashTable();
+		return 0;
+	}
+
+	// Prefill the table with the given commands
+	int status = 0;
+	for (const auto& word : args) {
+		std::string name(word.text);
+		std::string commandPath{};
+		if (!hashLookup(name, commandPath, false)) {
+			writeAll(fds[STDERR_FILENO], "hash: " + name + ": not found\n");
+			status = 1;
+		}
+	}
+	return status;
+}
+
+// --------------------------------------------------------------
+// Functions to handle variables
+// --------------------------------------------------------------
+
+// The shell keeps a copy of PATH, which it uses for every command
+void syncShellVariable(std::string_view name) {
+	if (name == "PATH") {
+		const char* value = getVariable(name);
+		PATH = value ? value : "";
+		pathSynced = true;
+	}
+}
+
+void assignVariable(std::string_view name, std::string_view value) {
+	setVariable(name, value);
+	syncShellVariable(name);
+}
+
+int exportBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	std::span<const Word> args = commandData.words.subspan(1);
+	if (!args.empty() && args[0].text == "-p") {
+		args = args.subspan(1);
+	}
+
+	// Without names list the exported variables the way bash does, so they can be read back
+	if (args.empty()) {
+		std::vector<std::string_view> entries;
+		for (char** variable = environ; *variable; ++variable) {
+			entries.emplace_back(*variable);
+		}
+		std::sort(entries.begin(), entries.end());
+		for (std::string_view entry : entries) {
+			size_t equals = entry.find('=');
+			out.write("declare -x ");
+			out.write(entry.substr(0, equals));
+			out.write("=\"");
+			for (char c : entry.substr(equals + 1)) {
+				if (c == '"' || c == '\\' || c == '$' || c == '`') {
+					out.put('\\');
+				}
+				out.put(c);
+			}
+			out.write("\"\n");
+		}
+		return 0;
+	}
+
+	int status = 0;
+	for (const auto& word : args) {
+		size_t equals = word.text.find('=');
+		std::string_view name = word.text.substr(0, equals);
+		if (!isVariableName(name)) {
+			writeAll(fds[STDERR_FILENO], "export: `" + std::string(word.text) + "': not a valid identifier\n");
+			status = 1;
+			continue;
+		}
+		if (commandData.subshell) {
+			continue;
+		}
+		if (equals != std::string_view::npos) {
+			assignVariable(name, word.text.substr(equals + 1));
+		}
+		exportVariable(name);
+	}
+	return status;
+}
+
+int unsetBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	int status = 0;
+	bool function = false; // -f unsets functions
+	for (const auto& word : commandData.words.subspan(1)) {
+		if (word.text == "-v" || word.text == "-f") {
+			function = word.text == "-f";
+			continue;
+		}
+		if (function) {
+			// A function that runs keeps its own copy of the definition
+			if (!commandData.subshell) {
+				functions.erase(std::string(word.text));
+			}
+			continue;
+		}
+		if (!isVariableName(word.text)) {
+			writeAll(fds[STDERR_FILENO], "unset: `" + std::string(word.text) + "': not a valid identifier\n");
+			status = 1;
+			continue;
+		}
+		if (!commandData.subshell) {
+			unsetVariable(word.text);
+			syncShellVariable(word.text);
+		}
+	}
+	return status;
+}
+
+// --------------------------------------------------------------
+// Function to redirect the input and output of a command
+// --------------------------------------------------------------
+
+// Apply the redirections of a command to its plan, reporting a failure on the shell's stderr
+bool planRedirections(const CommandData& commandData, RedirectionPlan& plan) {
+	std::string error;
+	if (plan.add(commandData.redirections, error)) {
+		return true;
+	}
+	shellOutput.flush();
+	writeAll(STDERR_FILENO, "shell: " + error + "\n");
+	return false;
+}
+
+// --------------------------------------------------------------
+// Function to start external commands
+// --------------------------------------------------------------
+
+// Start an external command with the descriptors its redirections describe
+// processGroup is -1 to stay in the shell's group, 0 to start a new one, or the group to join
+// Returns 0 or the error reported by posix_spawn
+int spawnCommand(const std::string& commandPath, const CommandData& commandData, RedirectionPlan& redirections, pid_t& pid, pid_t processGroup = -1) {
+	std::vector<std::string> arguments = commandArguments(commandData);
+	std::vector<char*> argv = argumentVector(arguments);
+
+	// Buffered output of earlier builtins has to come before the output of the command
+	shellOutput.flush();
+	syncInput();
+
+	// The redirections are applied in the child, the shell's own descriptors stay as they are
+	posix_spawn_file_actions_t fileActions;
+	posix_spawn_file_actions_init(&fileActions);
+	if (int error = redirections.fileActions(fileActions); error != 0) {
+		posix_spawn_file_actions_destroy(&fileActions);
+		return error;
+	}
+
+	// The shell ignores SIGPIPE and, under job control, the stop signals, the commands it starts should not
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+	sigset_t defaultSignals;
+	sigemptyset(&defaultSignals);
+	for (int signal : {SIGPIPE, SIGTSTP, SIGTTIN, SIGTTOU}) {
+		sigaddset(&defaultSignals, signal);
+	}
+	posix_spawnattr_setsigdefault(&attributes, &defaultSignals);
+	short flags = POSIX_SPAWN_SETSIGDEF;
+	if (processGroup != -1) {
+		posix_spawnattr_setpgroup(&attributes, processGroup);
+		flags |= POSIX_SPAWN_SETPGROUP;
+	}
+	posix_spawnattr_setflags(&attributes, flags);
+
+	// Assignments in front of the command only go into its environment
+	std::vector<std::string> assignments;
+	std::vector<char*> environment;
+	char** envp = environ;
+	if (!commandData.assignments.empty()) {
+		for (const auto& word : commandData.assignments) {
+			assignments.emplace_back(word.text);
+		}
+		for (char** variable = environ; *variable; ++variable) {
+			std::string_view entry = *variable;
+			std::string_view name = entry.substr(0, entry.find('=') + 1);
+			if (std::none_of(assignments.begin(), assignments.end(), [&](const std::string& assignment) { return assignment.starts_with(name); })) {
+				environment.push_back(*variable);
+			}
+		}
+		for (auto& assignment : assignments) {
+			environment.push_back(assignment.data());
+		}
+		environment.push_back(nullptr);
+		envp = environment.data();
+	}
+
+	int error = posix_spawn(&pid, commandPath.c_str(), &fileActions, &attributes, argv.data(), envp);
+	posix_spawnattr_destroy(&attributes);
+	posix_spawn_file_actions_destroy(&fileActions);
+	return error;
+}
+
+// --------------------------------------------------------------
+// Job control
+// --------------------------------------------------------------
+
+void childStateHandler(int) {
+	childStateChanged = 1;
+}
+
+// Catch SIGCHLD, and take over the terminal if the shell is interactive
+void initJobs() {
+	struct sigaction action{};
+	action.sa_handler = childStateHandler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGCHLD, &action, nullptr);
+
+	if (!interactiveShell || !isatty(STDIN_FILENO)) {
+		return;
+	}
+	// Started in the background, wait until we are put into the foreground like bash does
+	while (tcgetpgrp(STDIN_FILENO) != getpgrp()) {
+		kill(-getpgrp(), SIGTTIN);
+	}
+	signal(SIGTSTP, SIG_IGN);
+	signal(SIGTTIN, SIG_IGN);
+	signal(SIGTTOU, SIG_IGN);
+	setpgid(0, 0);
+	shellProcessGroup = getpid();
+	tcsetpgrp(STDIN_FILENO, shellProcessGroup);
+	jobControl = true;
+}
+
+// Give the terminal to a process group, 0 gives it back to the shell
+void giveTerminal(pid_t processGroup) {
+	if (jobControl) {
+		tcsetpgrp(STDIN_FILENO, processGroup ? processGroup : shellProcessGroup);
+	}
+}
+
+// Format a job like bash's jobs, e.g. "[1]+  Running                 sleep 10 &"
+std::string formatJob(const Job& job, bool showPid) {
+	std::string state = jobStateText(job);
+	std::string line = "[" + std::to_string(job.id) + "]" + jobTable.marker(job) + " ";
+	if (showPid) {
+		line += std::to_string(job.processGroup);
+	}
+	line += " " + state + std::string(state.size() < 24 ? 24 - state.size() : 1, ' ') + job.command;
+	return line + (job.state == JobState::Running ? " &\n" : "\n");
+}
+
+// Collect the job processes that changed state since the last SIGCHLD
+void reapJobs() {
+	if (childStateChanged) {
+		childStateChanged = 0;
+		jobTable.reap();
+	}
+}
+
+bool hasJobNotice(const Job& job) {
+	return job.state != JobState::Running && !job.notified && interactiveShell;
+}
+
+// Tell an interactive user about jobs that finished or were stopped, like bash before each prompt
+void notifyJobs() {
+	reapJobs();
+	for (auto it = jobTable.jobs().begin(); it != jobTable.jobs().end();) {
+		Job& job = it->second;
+		++it;
+		if (!hasJobNotice(job)) {
+			continue;
+		}
+		shellOutput.flush();
+		writeAll(STDERR_FILENO, formatJob(job, false));
+		job.notified = true;
+		if (job.state == JobState::Done) {
+			jobTable.remove(job.id);
+		}
+	}
+}
+
+// Wait for the processes of a foreground pipeline, statuses and usages get the result of each one
+// Under job control a pipeline that gets stopped moves into the job table, false is returned then
+bool waitForeground(const std::vector<pid_t>& pids, std::vector<int>& statuses, const std::vector<ResourceUsage*>& usages) {
+	for (size_t i = 0; i < pids.size(); ++i) {
+		if (pids[i] == -1) {
+			continue;
+		}
+		int status = 0;
+		struct rusage childUsage{};
+		pid_t result;
+		while ((result = wait4(pids[i], &status, jobControl ? WUNTRACED : 0, &childUsage)) == -1 && errno == EINTR) {}
+		if (result == -1) {
+			statuses[i] = 127;
+			continue;
+		}
+
+		if (WIFSTOPPED(status)) {
+			// Everything from this stage on is still around, the stages before it have exited
+			std::vector<pid_t> remaining;
+			std::copy_if(pids.begin() + i, pids.end(), std::back_inserter(remaining), [](pid_t pid) { return pid != -1; });
+			Job& job = jobTable.add(getpgid(pids[i]), remaining, foregroundText, JobState::Stopped);
+			giveTerminal(0);
+			shellOutput.flush();
+			writeAll(STDERR_FILENO, "\n" + formatJob(job, false));
+			job.notified = true;
+			statuses.back() = 128 + WSTOPSIG(status);
+			return false;
+		}
+		statuses[i] = exitStatusFromWait(status);
+		if (usages[i]) {
+			*usages[i] = usageFromRusage(childUsage);
+		}
+	}
+	giveTerminal(0);
+	return true;
+}
+
+// --------------------------------------------------------------
+// Functions to handle the job control builtins
+// --------------------------------------------------------------
+
+// The job named by a builtin's argument, or the current job without one
+Job* jobArgument(const CommandData& commandData, std::string_view builtin, const std::array<int, 3>& fds) {
+	std::string_view spec = commandData.words.size() > 1 ? commandData.words[1].text : "%+";
+	Job* job = jobTable.find(spec);
+	if (!job) {
+		writeAll(fds[STDERR_FILENO], std::string(builtin) + ": " + std::string(spec == "%+" ? "current" : spec) + ": no such job\n");
+	}
+	return job;
+}
+
+int jobsBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	reapJobs();
+	bool showPid = false;
+	bool onlyPids = false;
+	std::vector<Job*> selected;
+	for (const auto& word : commandData.words.subspan(1)) {
+		if (word.text == "-l") {
+			showPid = true;
+		} else if (word.text == "-p") {
+			onlyPids = true;
+		} else if (Job* job = jobTable.find(word.text)) {
+			selected.push_back(job);
+		} else {
+			writeAll(fds[STDERR_FILENO], "jobs: " + std::string(word.text) + ": no such job\n");
+			return 1;
+		}
+	}
+	if (selected.empty()) {
+		for (auto& [id, job] : jobTable.jobs()) {
+			selected.push_back(&job);
+		}
+	}
+
+	std::vector<int> finished;
+	for (Job* job : selected) {
+		if (onlyPids) {
+			out.writeNumber(job->processGroup);
+			out.put('\n');
+		} else {
+			out.write(formatJob(*job, showPid));
+		}
+		job->notified = true;
+		if (job->state == JobState::Done) {
+			finished.push_back(job->id);
+		}
+	}
+	// Like in bash a finished job is listed once and then forgotten
+	for (int id : finished) {
+		jobTable.remove(id);
+	}
+	return 0;
+}
+
+// Wait for the given jobs or pids, or for every job, returns the status of the last one
+int waitBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	reapJobs();
+	std::vector<int> ids;
+	int status = 0;
+	for (const auto& word : commandData.words.subspan(1)) {
+		Job* job = jobTable.find(word.text);
+		if (!job) {
+			writeAll(fds[STDERR_FILENO], "wait: " + std::string(word.text) + ": no such job\n");
+			status = 127;
+			continue;
+		}
+		ids.push_back(job->id);
+	}
+	if (commandData.words.size() == 1) {
+		for (const auto& [id, job] : jobTable.jobs()) {
+			ids.push_back(id);
+		}
+	}
+
+	for (int id : ids) {
+		auto it = jobTable.jobs().find(id);
+		if (it == jobTable.jobs().end()) {
+			continue; // Named twice
+		}
+		Job& job = it->second;
+		jobTable.waitFor(job, jobControl);
+		if (job.state == JobState::Stopped) {
+			status = 128 + SIGTSTP;
+			continue;
+		}
+		status = job.status;
+		jobTable.remove(id);
+	}
+	return commandData.words.size() == 1 ? 0 : status;
+}
+
+int fgBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	if (!jobControl) {
+		writeAll(fds[STDERR_FILENO], "fg: no job control\n");
+		return 1;
+	}
+	reapJobs();
+	Job* job = jobArgument(commandData, "fg", fds);
+	if (!job) {
+		return 1;
+	}
+	if (job->state == JobState::Done) {
+		writeAll(fds[STDERR_FILENO], "fg: job has terminated\n");
+		jobTable.remove(job->id);
+		return 1;
+	}
+
+	// Print the command, hand it the terminal and continue it
+	out.write(job->command);
+	out.put('\n');
+	out.flush();
+	foregroundText = job->command;
+	giveTerminal(job->processGroup);
+	job->state = JobState::Running;
+	kill(-job->processGroup, SIGCONT);
+	jobTable.waitFor(*job, true);
+	giveTerminal(0);
+
+	if (job->state == JobState::Stopped) {
+		writeAll(STDERR_FILENO, "\n" + formatJob(*job, false));
+		job->notified = true;
+		return 128 + SIGTSTP;
+	}
+	int status = job->status;
+	jobTable.remove(job->id);
+	return status;
+}
+
+int bgBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	if (!jobControl) {
+		writeAll(fds[STDERR_FILENO], "bg: no job control\n");
+		return 1;
+	}
+	reapJobs();
+	Job* job = jobArgument(commandData, "bg", fds);
+	if (!job) {
+		return 1;
+	}
+	if (job->state != JobState::Stopped) {
+		writeAll(fds[STDERR_FILENO], "bg: job " + std::to_string(job->id) + " already in background\n");
+		return 0;
+	}
+	job->state = JobState::Running;
+	jobTable.makeCurrent(job->id);
+	kill(-job->processGroup, SIGCONT);
+	out.write("[" + std::to_string(job->id) + "]" + jobTable.marker(*job) + " " + job->command + " &\n");
+	return 0;
+}
+
+// Names kill accepts, with or without the SIG prefix
+constexpr std::pair<std::string_view, int> signalNames[] = {
+	{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"ILL", SIGILL}, {"TRAP", SIGTRAP}, {"ABRT", SIGABRT},
+	{"BUS", SIGBUS}, {"FPE", SIGFPE}, {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"SEGV", SIGSEGV}, {"USR2", SIGUSR2},
+	{"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+	{"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {"URG", SIGURG}, {"XCPU", SIGXCPU}, {"XFSZ", SIGXFSZ},
+	{"VTALRM", SIGVTALRM}, {"PROF", SIGPROF}, {"WINCH", SIGWINCH}, {"IO", SIGIO}, {"SYS", SIGSYS},
+};
+
+// A signal given by number or name, returns -1 if there is no such signal
+int parseSignal(std::string_view text) {
+	if (!text.empty() && std::all_of(text.begin(), text.end(), ::isdigit)) {
+		int number = std::atoi(std::string(text).c_str());
+		return number < NSIG ? number : -1;
+	}
+	if (text.starts_with("SIG")) {
+		text.remove_prefix(3);
+	}
+	for (const auto& [name, number] : signalNames) {
+		if (name == text) {
+			return number;
+		}
+	}
+	return -1;
+}
+
+// kill [-s signal | -n number | -signal] pid | %job ..., and kill -l
+int killBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	std::span<const Word> args = commandData.words.subspan(1);
+	if (!args.empty() && args[0].text == "-l") {
+		for (const auto& [name, number] : signalNames) {
+			out.write(name);
+			out.put(&name == &signalNames[std::size(signalNames) - 1].first ? '\n' : ' ');
+		}
+		return 0;
+	}
+
+	int signal = SIGTERM;
+	if (!args.empty() && (args[0].text == "-s" || args[0].text == "-n") && args.size() > 1) {
+		signal = parseSignal(args[1].text);
+		args = args.subspan(2);
+	} else if (!args.empty() && args[0].text.size() > 1 && args[0].text[0] == '-') {
+		signal = parseSignal(args[0].text.substr(1));
+		args = args.subspan(1);
+	}
+	if (signal < 0) {
+		writeAll(fds[STDERR_FILENO], "kill: invalid signal specification\n");
+		return 1;
+	}
+	if (args.empty()) {
+		writeAll(fds[STDERR_FILENO], "kill: usage: kill [-s sigspec | -n signum | -sigspec] pid | jobspec ... or kill -l\n");
+		return 2;
+	}
+
+	int status = 0;
+	for (const auto& word : args) {
+		std::string target(word.text);
+		if (target.starts_with('%')) {
+			Job* job = jobTable.find(target);
+			if (!job) {
+				writeAll(fds[STDERR_FILENO], "kill: " + target + ": no such job\n");
+				status = 1;
+				continue;
+			}
+			kill(-job->processGroup, signal);
+			// A stopped job only sees the signal once it runs again
+			if (job->state == JobState::Stopped && signal != SIGSTOP && signal != SIGTSTP) {
+				kill(-job->processGroup, SIGCONT);
+			}
+		} else if (std::string_view digits = std::string_view(target).substr(target.starts_with('-') ? 1 : 0);
+			digits.empty() || !std::all_of(digits.begin(), digits.end(), ::isdigit)) {
+			// Only a pid, or a process group as a negative pid, is checked before atoi could turn it into 0
+			writeAll(fds[STDERR_FILENO], "kill: " + target + ": arguments must be process or job IDs\n");
+			status = 1;
+		} else if (kill(std::atoi(target.c_str()), signal) == -1) {
+			writeAll(fds[STDERR_FILENO], "kill: (" + target + ") - " + std::strerror(errno) + "\n");
+			status = 1;
+		}
+	}
+	return status;
+}
+
+// --------------------------------------------------------------
+// Function to handle unknown commands
+// --------------------------------------------------------------
+
+void RunUnknownCommand(CommandData& commandData, RedirectionPlan& redirections) {
+	// Check to see if the command has been executed already
+	if (commandData.commandExecuted) {return;}
+
+	std::string commandPath{};
+	// Check if the command is in the path
+	if (searchPath(commandData, commandPath)) {
+		// If the command is found in the path spawn it directly, without going through /bin/sh
+		commandData.commandExecuted = true;
+
+		// Under job control the command gets its own process group and the terminal
+		pid_t pid;
+		int error = spawnCommand(commandPath, commandData, redirections, pid, jobControl ? 0 : -1);
+		if (error != 0) {
+			shellOutput.flush();
+			writeAll(redirections.source(STDERR_FILENO), std::string(commandData.command) + ": " + std::strerror(error) + "\n");
+			lastExitStatus = 126;
+			return;
+		}
+		giveTerminal(pid);
+
+		// Wait for the command to finish and remember its exit status
+		std::vector<int> statuses = {0};
+		waitForeground({pid}, statuses, {commandData.usage});
+		lastExitStatus = statuses[0];
+		return; // Exit the function after executing the command
+
+	// If the command is not found in the list of commands or the path, print not found
+	}else{
+		// The message goes to the command's stderr, so 2>/dev/null silences it
+		shellOutput.flush();
+		writeAll(redirections.source(STDERR_FILENO), std::string(commandData.command) + ": command not found\n");
+		commandData.commandExecuted = true;
+		lastExitStatus = 127;
+	}
+}
+
+// --------------------------------------------------------------
+// Function to handle pipes and process execution
+// --------------------------------------------------------------
+
+// Run a builtin found in the registry with its output going to out, returns its exit status
+int runBuiltinCommand(CommandData& commandData, BuiltinHandler handler, const std::array<int, 3>& fds, OutputSink& out) {
+	commandData.commandExecuted = true;
+	// Stderr is unbuffered, so output the shell still buffers has to go out first
+	if (fds[STDERR_FILENO] == STDERR_FILENO) {
+		shellOutput.flush();
+	}
+	int status = 0;
+	if (!commandData.usage) {
+		status = handler(commandData, fds, out);
+	} else {
+		// A builtin runs inside the shell, so it is charged what the shell used while it ran
+		struct rusage before{};
+		struct rusage after{};
+		getrusage(RUSAGE_SELF, &before);
+		status = handler(commandData, fds, out);
+		getrusage(RUSAGE_SELF, &after);
+		*commandData.usage = usageBetween(before, after);
+	}
+	// Interactively the output shows up as soon as the builtin is done, scripts keep collecting it
+	if (interactiveShell) {
+		out.flush();
+	}
+	return status;
+}
+
+// The fast builtin that stands in for an external command, nullptr if the program has to run
+// It never waits for a terminal: unlike a program it could not be stopped or interrupted there
+BuiltinHandler fastUtility(const CommandData& commandData, const RedirectionPlan& redirections) {
+	bool readsStdin = false;
+	BuiltinHandler handler = findFastUtility(commandData.words, readsStdin);
+	if (!handler || (readsStdin && isatty(redirections.source(STDIN_FILENO)))) {
+		return nullptr;
+	}
+	// Like a program it reads the shell's own input from the line after its command, not from the end of our buffer
+	if (readsStdin && activeInput && redirections.source(STDIN_FILENO) == activeInput->fd) {
+		syncInput();
+	}
+	return handler;
+}
+
+size_t substitutionCount = 0; // Number of $(...) run so far, tells commandFromAst if its command ran one
+
+// Commands without $ or patterns in their words and here-documents run on the parsed line as it is
+bool needsExpansion(const SimpleCommand& simpleCommand) {
+	auto expands = [](const Word& word) { return word.expand; };
+	return std::any_of(simpleCommand.assignments.begin(), simpleCommand.assignments.end(), expands) ||
+		std::any_of(simpleCommand.words.begin(), simpleCommand.words.end(), expands) ||
+		std::any_of(simpleCommand.redirections.begin(), simpleCommand.redirections.end(), [](const Redirection& redirection) {
+			if (redirection.op == RedirectOp::HereDoc) {
+				return !redirection.target.quoted && redirection.body.find_first_of("$\\") != std::string_view::npos;
+			}
+			return redirection.target.expand;
+		});
+}
+
+// Expand the assignments, words and redirections of a command into commandData.expansion
+// Reports malformed expansions and ambiguous redirects and returns false
+bool expandCommand(const SimpleCommand& simpleCommand, CommandData& commandData) {
+	GlobCacheScope globCache; // Patterns of the command that look into the same directory read it once
+	auto expansion = std::make_unique<ExpandedCommand>();
+	std::vector<std::string> fields;
+	std::string error;
+	auto fail = [](const std::string& message) {
+		shellOutput.flush();
+		writeAll(STDERR_FILENO, "shell: " + message + "\n");
+		return false;
+	};
+
+	// The value of an assignment is not split
+	for (const auto& word : simpleCommand.assignments) {
+		if (!word.expand) {
+			expansion->assignments.push_back(word);
+			continue;
+		}
+		size_t equals = word.text.find('=');
+		fields.clear();
+		if (!expandWord(word.text.substr(equals + 1), fields, false, error)) {
+			return fail(error);
+		}
+		const std::string& text = expansion->text.emplace_back(std::string(word.text.substr(0, equals + 1)) + fields[0]);
+		expansion->assignments.push_back(Word{text, word.quoted, false, true});
+	}
+
+	for (const auto& word : simpleCommand.words) {
+		if (!word.expand) {
+			expansion->words.push_back(word);
+			continue;
+		}
+		fields.clear();
+		if (!expandWord(word.text, fields, true, error)) {
+			return fail(error);
+		}
+		for (auto& field : fields) {
+			expansion->words.push_back(Word{expansion->text.emplace_back(std::move(field)), word.quoted});
+		}
+	}
+
+	for (const auto& redirection : simpleCommand.redirections) {
+		Redirection& expanded = expansion->redirections.emplace_back(redirection);
+		if (redirection.op == RedirectOp::HereDoc) {
+			// A quoted delimiter keeps the body as it is
+			if (!redirection.target.quoted) {
+				std::string body;
+				if (!expandHereDocument(redirection.body, body, error)) {
+					return fail(error);
+				}
+				expanded.body = expansion->text.emplace_back(std::move(body));
+			}
+			continue;
+		}
+		if (redirection.target.expand) {
+			fields.clear();
+			if (!expandWord(redirection.target.text, fields, true, error)) {
+				return fail(error);
+			}
+			if (fields.size() != 1) {
+				return fail(std::string(redirection.target.text) + ": ambiguous redirect");
+			}
+			expanded.target = Word{expansion->text.emplace_back(std::move(fields[0])), redirection.target.quoted};
+		}
+	}
+
+	commandData.assignments = expansion->assignments;
+	commandData.words = expansion->words;
+	commandData.redirections = expansion->redirections;
+	commandData.expansion = std::move(expansion);
+	return true;
+}
+
+// Prepare a simple command from the parsed line for execution, expanding it if needed
+CommandData commandFromAst(const SimpleCommand& simpleCommand) {
+	CommandData commandData{};
+	if (!needsExpansion(simpleCommand)) {
+		commandData.assignments = simpleCommand.assignments;
+		commandData.words = simpleCommand.words;
+		commandData.redirections = simpleCommand.redirections;
+	} else {
+		size_t substitutions = substitutionCount;
+		commandData.expansionFailed = !expandCommand(simpleCommand, commandData);
+		if (substitutionCount != substitutions) {
+			commandData.substitutionStatus = lastExitStatus;
+		}
+	}
+	if (!commandData.words.empty()) {
+		commandData.command = commandData.words[0].text;
+	}
+	return commandData;
+}
+
+// PIPESIZE sizes the pipes between the stages of a pipeline, in bytes or with a k or m suffix
+// Large pipes let producer and consumer run for longer before one has to wait for the other
+// Returns 0 to keep the kernel's default
+size_t pipelinePipeSize() {
+	const char* value = getVariable("PIPESIZE");
+	if (!value || !*value) {
+		return 0;
+	}
+	std::string_view text = value;
+	size_t size = 0;
+	auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), size);
+	std::string_view suffix(end, text.data() + text.size() - end);
+	if (error != std::errc{} || suffix.size() > 1) {
+		return 0;
+	}
+	if (suffix == "k" || suffix == "K") {
+		size <<= 10;
+	} else if (suffix == "m" || suffix == "M") {
+		size <<= 20;
+	} else if (!suffix.empty()) {
+		return 0;
+	}
+
+	// Without privileges the kernel refuses anything above pipe-max-size, so ask for at most that
+	static size_t maximum = [] {
+		size_t limit = 1024 * 1024;
+		int fd = open("/proc/sys/fs/pipe-max-size", O_RDONLY | O_CLOEXEC);
+		if (fd != -1) {
+			char digits[32];
+			ssize_t bytes = read(fd, digits, sizeof(digits));
+			if (bytes > 0) {
+				std::from_chars(digits, digits + bytes, limit);
+			}
+			close(fd);
+		}
+		return limit;
+	}();
+	return std::min(size, maximum);
+}
+
+// Compound commands and functions, defined with the interpreter below
+void runProgram(const Program& program);
+const ShellFunction* findFunction(std::string_view name);
+void callFunction(CommandData& commandData, const ShellFunction& function);
+
+// Run a compound command, function or builtin of a pipeline in a copy of the shell, with the descriptors of its plan
+// processGroup works like for spawnCommand, returns the pid or -1 if fork failed
+pid_t startSubshellStage(const SimpleCommand& simpleCommand, CommandData& commandData, const RedirectionPlan& redirections,
+	const std::vector<std::array<int, 2>>& pipes, pid_t processGroup) {
+	shellOutput.flush();
+	syncInput();
+	pid_t pid = fork();
+	if (pid != 0) {
+		if (pid > 0 && processGroup != -1) {
+			setpgid(pid, processGroup == 0 ? pid : processGroup);
+		}
+		return pid;
+	}
+
+	if (processGroup != -1) {
+		setpgid(0, processGroup);
+	}
+	// A loop writing into a pipe whose reader is gone has to end like a command would
+	for (int number : {SIGPIPE, SIGTSTP, SIGTTIN, SIGTTOU}) {
+		signal(number, SIG_DFL);
+	}
+	// Copies first, a descriptor of the plan may be one of those it replaces
+	std::array<int, 3> fds = redirections.standard();
+	std::array<int, 3> copies{};
+	for (int fd = 0; fd < 3; ++fd) {
+		copies[fd] = fds[fd] == -1 ? -1 : fcntl(fds[fd], F_DUPFD_CLOEXEC, 10);
+	}
+	for (int fd = 0; fd < 3; ++fd) {
+		if (copies[fd] == -1) {
+			close(fd);
+		} else {
+			dup2(copies[fd], fd);
+			close(copies[fd]);
+		}
+	}
+	// The other stages only see the end of their input once every copy of the pipes is closed
+	for (const auto& ends : pipes) {
+		close(ends[0]);
+		close(ends[1]);
+	}
+
+	// The subshell runs like a script, and must not move the offset of the shell's input
+	jobControl = false;
+	interactiveShell = false;
+	activeInput = nullptr;
+	jobTable = JobTable{};
+	if (simpleCommand.compound) {
+		runProgram(*simpleCommand.compound->program);
+	} else if (const ShellFunction* function = findFunction(commandData.command)) {
+		callFunction(commandData, *function);
+	} else if (BuiltinHandler handler = findBuiltin(commandData.command)) {
+		lastExitStatus = runBuiltinCommand(commandData, handler, {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}, shellOutput);
+	} else {
+		lastExitStatus = 0; // Only redirections
+	}
+	shellOutput.flush();
+	_exit(lastExitStatus);
+}
+
+// Run a pipeline of several commands, usages gets the resources of every stage if it is timed
+// A background pipeline only has external stages, they are left running as a job
+void runPipes(const Pipeline& pipeline, std::vector<ResourceUsage>* usages, bool background) {
+	std::vector<CommandData> commandsData;
+	commandsData.reserve(pipeline.commands.size());
+	for (const auto& simpleCommand : pipeline.commands) {
+		commandsData.push_back(commandFromAst(simpleCommand));
+		if (usages) {
+			commandsData.back().usage = &(*usages)[commandsData.size() - 1];
+		}
+	}
+
+    // Create pipes for inter-process communication
+	// They are close-on-exec so a command only inherits the two ends it uses
+	int numPipes = commandsData.size() - 1;
+    std::vector<std::array<int, 2>> pipes(numPipes);
+
+	// Create all pipes
+    for (int i = 0; i < numPipes; i++) {
+        if (pipe2(pipes[i].data(), O_CLOEXEC) == -1) {
+            shellOutput.flush();
+			writeAll(STDERR_FILENO, "Error creating pipe " + std::to_string(i) + "\n");
+			for (int j = 0; j < i; j++) {
+				close(pipes[j][0]);
+				close(pipes[j][1]);
+			}
+            return;
+        }
+    }
+
+	// The kernel rounds the size up to whole pages, a size it refuses keeps the default
+	size_t pipeSize = numPipes > 0 ? pipelinePipeSize() : 0;
+	if (pipeSize > 0) {
+		for (const auto& ends : pipes) {
+			fcntl(ends[1], F_SETPIPE_SZ, static_cast<int>(pipeSize));
+		}
+	}
+
+	size_t lastStage = commandsData.size() - 1;
+	std::vector<pid_t> pids(commandsData.size(), -1);
+	std::vector<bool> builtin(commandsData.size());
+	std::vector<BuiltinHandler> handlers(commandsData.size(), nullptr);
+	std::vector<int> statuses(commandsData.size(), 0);
+	// Stages a fast builtin runs instead of cat, head or wc, with their redirections already planned
+	std::vector<BuiltinHandler> fastHandlers(commandsData.size(), nullptr);
+	std::vector<std::unique_ptr<RedirectionPlan>> fastRedirections(commandsData.size());
+
+	// Under job control, and for every background job, the stages share a process group of their own
+	bool ownGroup = jobControl || background;
+	pid_t processGroup = 0;
+
+	// Without job control a background job must not read the terminal, it gets /dev/null like in bash
+	int firstInput = STDIN_FILENO;
+	if (background && !jobControl) {
+		firstInput = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	}
+
+	// Start the external stages first, so the output of every builtin already has a reader
+    for (size_t i = 0; i < commandsData.size(); i++) {
+		// Compound commands and functions run in a subshell of their own, like external commands
+		// A stage with only redirections is handled like a builtin that does nothing
+		bool subshellStage = pipeline.commands[i].compound || (!commandsData[i].words.empty() && findFunction(commandsData[i].command));
+		if (const auto* entry = subshellStage ? nullptr : builtins.find(commandsData[i].command)) {
+			handlers[i] = entry->handler;
+		}
+		builtin[i] = !subshellStage && (commandsData[i].words.empty() || handlers[i]);
+		if (builtin[i]) {
+			continue;
+		}
+
+		auto redirections = std::make_unique<RedirectionPlan>(std::array<int, 3>{i > 0 ? pipes[i-1][0] : firstInput, i < lastStage ? pipes[i][1] : STDOUT_FILENO, STDERR_FILENO});
+		std::string commandPath{};
+		bool planned = !commandsData[i].expansionFailed && planRedirections(commandsData[i], *redirections);
+		// A background job cannot run inside the shell
+		if (planned && !background && !subshellStage && (fastHandlers[i] = fastUtility(commandsData[i], *redirections))) {
+			builtin[i] = true;
+			fastRedirections[i] = std::move(redirections);
+			continue;
+		}
+		if (!planned) {
+			statuses[i] = 1;
+		} else if (subshellStage) {
+			pids[i] = startSubshellStage(pipeline.commands[i], commandsData[i], *redirections, pipes, ownGroup ? processGroup : -1);
+			if (pids[i] == -1) {
+				std::string message = std::string("shell: fork: ") + std::strerror(errno) + "\n";
+				shellOutput.flush();
+				writeAll(STDERR_FILENO, message);
+				statuses[i] = 1;
+			}
+		} else if (!searchPath(commandsData[i], commandPath)) {
+			// The message goes to the stage's stderr, so 2>/dev/null silences it
+			shellOutput.flush();
+			writeAll(redirections->source(STDERR_FILENO), std::string(commandsData[i].command) + ": command not found\n");
+			statuses[i] = 127;
+		} else if (int error = spawnCommand(commandPath, commandsData[i], *redirections, pids[i], ownGroup ? processGroup : -1); error != 0) {
+			shellOutput.flush();
+			writeAll(redirections->source(STDERR_FILENO), std::string(commandsData[i].command) + ": " + std::strerror(error) + "\n");
+			pids[i] = -1;
+			statuses[i] = 126;
+		}
+		if (pids[i] != -1 && ownGroup && processGroup == 0) {
+			// The first command leads the group, a foreground group gets the terminal right away
+			processGroup = pids[i];
+			if (!background) {
+				giveTerminal(processGroup);
+			}
+		}
+		// The child has its own copy of the write end now
+		if (i < lastStage) {
+			close(pipes[i][1]);
+		}
+    }
+
+	// A builtin reads what an external command or a fast builtin before it writes, like parallel does,
+	// a fast builtin reads whatever is before it
+	// Other read ends are closed, writers see EPIPE then instead of blocking on a builtin that does not read
+	std::vector<bool> builtinReads(commandsData.size());
+	for (int i = 0; i < numPipes; i++) {
+		builtinReads[i + 1] = builtin[i + 1] && (!builtin[i] || fastHandlers[i] || fastHandlers[i + 1]) && !background;
+		if (!builtinReads[i + 1]) {
+			close(pipes[i][0]);
+		}
+	}
+	if (firstInput != STDIN_FILENO) {
+		close(firstInput);
+	}
+
+	if (background) {
+		std::vector<pid_t> started;
+		std::copy_if(pids.begin(), pids.end(), std::back_inserter(started), [](pid_t pid) { return pid != -1; });
+		if (!started.empty()) {
+			Job& job = jobTable.add(processGroup, started, pipeline.text);
+			lastBackgroundPid = started.back();
+			if (interactiveShell) {
+				writeAll(STDERR_FILENO, "[" + std::to_string(job.id) + "] " + std::to_string(started.back()) + "\n");
+			}
+		}
+		lastExitStatus = started.empty() ? statuses[lastStage] : 0;
+		return;
+	}
+
+	// Fast builtins that share the pipeline with other stages inside the shell get a thread each,
+	// the builtins run one after the other and would otherwise wait for each other's pipes
+	// They write to their descriptors themselves and never touch shellOutput, it is flushed before
+	std::vector<std::jthread> fastStages;
+	if (std::count(builtin.begin(), builtin.end(), true) > 1) {
+		for (size_t i = 0; i < commandsData.size(); i++) {
+			if (!fastHandlers[i]) {
+				continue;
+			}
+			shellOutput.flush();
+			fastStages.emplace_back([&, i] {
+				std::array<int, 3> fds = fastRedirections[i]->standard();
+				commandsData[i].commandExecuted = true;
+				struct rusage before{};
+				getrusage(RUSAGE_THREAD, &before);
+				{
+					OutputSink out(fds[STDOUT_FILENO], std::max<size_t>(pipeSize, 64 * 1024));
+					statuses[i] = fastHandlers[i](commandsData[i], fds, out);
+				}
+				if (commandsData[i].usage) {
+					struct rusage after{};
+					getrusage(RUSAGE_THREAD, &after);
+					*commandsData[i].usage = usageBetween(before, after);
+				}
+				if (builtinReads[i]) {
+					close(pipes[i-1][0]);
+				}
+				if (i < lastStage) {
+					close(pipes[i][1]);
+				}
+			});
+		}
+	}
+
+	// A builtin that writes into the pipeline while a later builtin reads from it would fill the pipes before
+	// that reader started, the builtins in front of the last one that reads run in a subshell instead
+	size_t lastReader = 0;
+	for (size_t i = 0; i < commandsData.size(); i++) {
+		if (builtinReads[i] && !(fastHandlers[i] && !fastStages.empty())) {
+			lastReader = i;
+		}
+	}
+
+	// Run the builtins inside the shell and write their output straight into the pipe
+	// A trailing builtin runs like bash's lastpipe, its effects stay in the shell
+	for (size_t i = 0; i < commandsData.size(); i++) {
+		if (!builtin[i] || (fastHandlers[i] && !fastStages.empty())) {
+			continue;
+		}
+		RedirectionPlan redirections({builtinReads[i] ? pipes[i-1][0] : STDIN_FILENO, i < lastStage ? pipes[i][1] : STDOUT_FILENO, STDERR_FILENO});
+		BuiltinHandler handler = fastHandlers[i] ? fastHandlers[i] : handlers[i];
+		if (fastHandlers[i] || (!commandsData[i].expansionFailed && planRedirections(commandsData[i], redirections))) {
+			std::array<int, 3> fds = fastHandlers[i] ? fastRedirections[i]->standard() : redirections.standard();
+			commandsData[i].subshell = i < lastStage;
+			// Output into a pipe or file streams through a sink of its own, flushed when the builtin is done
+			if (i < lastReader && !fastHandlers[i]) {
+				pids[i] = startSubshellStage(pipeline.commands[i], commandsData[i], redirections, pipes, ownGroup ? processGroup : -1);
+				if (pids[i] == -1) {
+					writeAll(STDERR_FILENO, std::string("shell: fork: ") + std::strerror(errno) + "\n");
+					statuses[i] = 1;
+				} else if (ownGroup && processGroup == 0) {
+					processGroup = pids[i];
+					giveTerminal(processGroup);
+				}
+			} else if (handler && fds[STDOUT_FILENO] == STDOUT_FILENO) {
+				statuses[i] = runBuiltinCommand(commandsData[i], handler, fds, shellOutput);
+			} else if (handler) {
+				// A sink as large as a big pipe fills it with a single write
+				OutputSink out(fds[STDOUT_FILENO], std::max<size_t>(pipeSize, 16 * 1024));
+				statuses[i] = runBuiltinCommand(commandsData[i], handler, fds, out);
+			}
+		} else {
+			statuses[i] = 1;
+		}
+		if (builtinReads[i]) {
+			close(pipes[i-1][0]);
+		}
+		if (i < lastStage) {
+			close(pipes[i][1]);
+		}
+	}
+	fastStages.clear(); // Joins the threads
+
+    // Wait for all child processes to finish, the pipeline reports the status of its last stage
+	std::vector<ResourceUsage*> stageUsages;
+	for (const auto& commandData : commandsData) {
+		stageUsages.push_back(commandData.usage);
+	}
+	waitForeground(pids, statuses, stageUsages);
+	lastExitStatus = statuses[lastStage];
+}
+
+// --------------------------------------------------------------
+// Function to execute a single line of input
+// --------------------------------------------------------------
+
+bool interactiveShell = true; // Prompt, history and line editing are only used interactively
+
+void runInShell(const SimpleCommand& simpleCommand, CommandData& commandData, const RedirectionPlan& redirections,
+	const ShellFunction* function, ResourceUsage* usage);
+
+void runSimpleCommand(const SimpleCommand& simpleCommand, ResourceUsage* usage) {
+	CommandData bashData = commandFromAst(simpleCommand);
+	bashData.usage = usage;
+
+	if (bashData.expansionFailed) {
+		lastExitStatus = 1;
+		return;
+	}
+
+	// The redirections only describe the command's descriptors, the shell's own are never touched,
+	// except while a compound command or a function runs inside the shell
+	RedirectionPlan redirections({STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO});
+	const ShellFunction* function = nullptr;
+	if (!planRedirections(bashData, redirections)) {
+		lastExitStatus = 1;
+	} else if (simpleCommand.compound || (!bashData.words.empty() && (function = findFunction(bashData.command)))) {
+		runInShell(simpleCommand, bashData, redirections, function, usage);
+	} else if (bashData.words.empty()) {
+		// Without a command the assignments set variables of the shell
+		for (const auto& word : bashData.assignments) {
+			size_t equals = word.text.find('=');
+			assignVariable(word.text.substr(0, equals), word.text.substr(equals + 1));
+		}
+		lastExitStatus = bashData.substitutionStatus == -1 ? 0 : bashData.substitutionStatus;
+	} else {
+		// A single lookup decides between a builtin and an external command
+		const auto* builtin = builtins.find(bashData.command);
+		if (BuiltinHandler handler = builtin ? builtin->handler : fastUtility(bashData, redirections)) {
+			std::array<int, 3> fds = redirections.standard();
+			if (fds[STDOUT_FILENO] == STDOUT_FILENO) {
+				lastExitStatus = runBuiltinCommand(bashData, handler, fds, shellOutput);
+			} else {
+				OutputSink out(fds[STDOUT_FILENO]);
+				lastExitStatus = runBuiltinCommand(bashData, handler, fds, out);
+			}
+		} else {
+			RunUnknownCommand(bashData, redirections);
+		}
+	}
+}
+
+// Print what a timed pipeline used to the shell's stderr, formatted with TIMEFORMAT
+// Pipelines of several commands also get a line per stage
+void reportTiming(const Pipeline& pipeline, const std::vector<ResourceUsage>& stages, const ResourceUsage& total) {
+	const char* timeFormat = getVariable("TIMEFORMAT");
+	std::string_view format = pipeline.posixTime ? posixTimeFormat : timeFormat ? timeFormat : defaultTimeFormat;
+	if (format.empty()) {
+		return; // An empty TIMEFORMAT turns the report off, like in bash
+	}
+
+	std::string report;
+	if (stages.size() > 1) {
+		for (size_t i = 0; i < stages.size(); ++i) {
+			const auto& words = pipeline.commands[i].words;
+			std::string name = words.empty() ? "(redirections)" : std::string(words[0].text);
+			report += "[" + std::to_string(i + 1) + "] " + name + "\t" + formatUsage("user %3U  sys %3S  maxrss %MKiB  csw %w/%c", stages[i]) + "\n";
+		}
+	}
+	report += formatUsage(format, total) + "\n";
+	shellOutput.flush();
+	writeAll(STDERR_FILENO, report);
+}
+
+void runPipeline(const Pipeline& pipeline) {
+	bool timed = pipeline.timed || timeEveryPipeline;
+	std::vector<ResourceUsage> stages(timed ? pipeline.commands.size() : 0);
+	struct timespec start{};
+	if (timed) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	}
+
+	if (pipeline.commands.size() == 1) {
+		runSimpleCommand(pipeline.commands[0], timed ? &stages[0] : nullptr);
+	} else if (pipeline.commands.size() > 1) {
+		runPipes(pipeline, timed ? &stages : nullptr, false);
+	}
+	if (pipeline.negated) {
+		lastExitStatus = lastExitStatus == 0 ? 1 : 0;
+	}
+
+	if (timed) {
+		struct timespec end{};
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ResourceUsage total{};
+		total.real = secondsBetween(start, end);
+		for (const auto& stage : stages) {
+			addUsage(total, stage);
+		}
+		reportTiming(pipeline, stages, total);
+	}
+}
+
+// Run pipelines connected with && and ||
+void runAndOr(std::span<const ListItem> andOr) {
+	ListOp previous = ListOp::Sequence;
+	for (const auto& item : andOr) {
+		// && and || only run the next pipeline depending on the status of the previous one
+		bool skip = (previous == ListOp::And && lastExitStatus != 0) || (previous == ListOp::Or && lastExitStatus == 0);
+		previous = item.op;
+		if (!skip) {
+			foregroundText = item.pipeline.text;
+			runPipeline(item.pipeline);
+		}
+		if (exitRequested || loopControl != LoopControl::None) {
+			return;
+		}
+	}
+}
+
+// Start an and-or list followed by & as a job and go on without waiting for it
+void runBackground(std::span<const ListItem> andOr) {
+	const Pipeline& first = andOr.front().pipeline;
+	const Pipeline& last = andOr.back().pipeline;
+	std::string_view text(first.text.data(), last.text.data() + last.text.size() - first.text.data());
+
+	// A pipeline of external commands is started directly, its processes make up the job
+	bool external = andOr.size() == 1 && !first.negated && !first.timed && !first.commands.empty() &&
+		std::all_of(first.commands.begin(), first.commands.end(), [](const SimpleCommand& command) {
+			return !command.words.empty() && !findBuiltin(command.words[0].text) && !findFunction(command.words[0].text);
+		});
+	if (external) {
+		runPipes(first, nullptr, true);
+		return;
+	}
+
+	// Builtins and lists run in a subshell, so they neither block the shell nor change it
+	shellOutput.flush();
+	syncInput();
+	pid_t pid = fork();
+	if (pid == -1) {
+		std::string message = std::string("shell: fork: ") + std::strerror(errno) + "\n";
+		shellOutput.flush();
+		writeAll(STDERR_FILENO, message);
+		lastExitStatus = 1;
+		return;
+	}
+	if (pid == 0) {
+		setpgid(0, 0);
+		signal(SIGTSTP, SIG_DFL);
+		signal(SIGTTIN, SIG_DFL);
+		signal(SIGTTOU, SIG_DFL);
+		if (!jobControl) {
+			int devNull = open("/dev/null", O_RDONLY);
+			dup2(devNull, STDIN_FILENO);
+			close(devNull);
+		}
+		// The subshell runs like a script, and must not move the offset of the shell's input
+		jobControl = false;
+		interactiveShell = false;
+		activeInput = nullptr;
+		jobTable = JobTable{};
+		runAndOr(andOr);
+		shellOutput.flush();
+		_exit(lastExitStatus);
+	}
+	setpgid(pid, pid);
+
+	Job& job = jobTable.add(pid, {pid}, text);
+	lastBackgroundPid = pid;
+	if (interactiveShell) {
+		writeAll(STDERR_FILENO, "[" + std::to_string(job.id) + "] " + std::to_string(pid) + "\n");
+	}
+	lastExitStatus = 0;
+}
+
+void executeList(const CommandList& list) {
+	for (size_t i = 0; i < list.items.size();) {
+		// An and-or list ends with ;, & or the end of the line
+		size_t end = i;
+		while (end + 1 < list.items.size() && (list.items[end].op == ListOp::And || list.items[end].op == ListOp::Or)) {
+			++end;
+		}
+		std::span<const ListItem> andOr(&list.items[i], end - i + 1);
+		i = end + 1;
+
+		if (andOr.back().op == ListOp::Background) {
+			runBackground(andOr);
+		} else {
+			runAndOr(andOr);
+		}
+		if (exitRequested || loopControl != LoopControl::None) {
+			return;
+		}
+	}
+}
+
+// --------------------------------------------------------------
+// Compound commands and functions
+// --------------------------------------------------------------
+
+// The redirections of a compound command or function applied to the shell's own stdin, stdout and stderr
+// while it runs, the commands inside start with them like with the shell's
+class ShellRedirection {
+public:
+	explicit ShellRedirection(const RedirectionPlan& plan) {
+		std::array<int, 3> fds = plan.standard();
+		if (fds == std::array<int, 3>{STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}) {
+			return;
+		}
+		shellOutput.flush();
+		syncInput();
+		for (int fd = 0; fd < 3; ++fd) {
+			saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+		}
+		for (int fd = 0; fd < 3; ++fd) {
+			// A plan that copies one of the shell's descriptors means the one from before
+			int source = fds[fd] >= 0 && fds[fd] < 3 ? saved[fds[fd]] : fds[fd];
+			if (fds[fd] == fd) {
+				continue;
+			}
+			changed[fd] = true;
+			if (source == -1) {
+				close(fd);
+			} else {
+				dup2(source, fd);
+			}
+		}
+	}
+
+	~ShellRedirection() {
+		if (std::none_of(changed.begin(), changed.end(), [](bool fd) { return fd; })) {
+			return;
+		}
+		shellOutput.flush();
+		for (int fd = 0; fd < 3; ++fd) {
+			if (changed[fd] && saved[fd] != -1) {
+				dup2(saved[fd], fd);
+			} else if (changed[fd]) {
+				close(fd);
+			}
+			if (saved[fd] != -1) {
+				close(saved[fd]);
+			}
+		}
+	}
+
+	ShellRedirection(const ShellRedirection&) = delete;
+	ShellRedirection& operator=(const ShellRedirection&) = delete;
+
+private:
+	std::array<int, 3> saved{-1, -1, -1};
+	std::array<bool, 3> changed{};
+};
+
+const ShellFunction* findFunction(std::string_view name) {
+	if (functions.empty()) {
+		return nullptr;
+	}
+	auto found = functions.find(std::string(name));
+	return found != functions.end() ? &found->second : nullptr;
+}
+
+// The values a for loop iterates over, false if an expansion failed
+bool forValues(const CompoundCommand& loop, std::vector<std::string>& values) {
+	if (!loop.hasIn) {
+		values = positionalParameters;
+		return true;
+	}
+	GlobCacheScope globCache;
+	std::string error;
+	for (const auto& word : loop.words) {
+		if (!word.expand) {
+			values.emplace_back(word.text);
+		} else if (!expandWord(word.text, values, true, error)) {
+			shellOutput.flush();
+			writeAll(STDERR_FILENO, "shell: " + error + "\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+// Whether a pattern of a case item matches the subject
+// A pattern without anything to expand or match is compared as it is
+bool caseItemMatches(const CaseItem& item, const std::string& subject) {
+	std::string pattern;
+	std::string error;
+	for (const auto& word : item.patterns) {
+		if (!word.expand) {
+			if (word.text == subject) {
+				return true;
+			}
+		} else if (!expandPattern(word.text, pattern, error)) {
+			shellOutput.flush();
+			writeAll(STDERR_FILENO, "shell: " + error + "\n");
+		} else if (fnmatch(pattern.c_str(), subject.c_str(), 0) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Run a compound command compiled to bytecode
+// Only running a pipeline can break out of a loop, return or exit, so that is only looked at after one
+void runProgram(const Program& program) {
+	struct LoopFrame {
+		uint32_t exit;   // The LoopEnd of the loop
+		uint32_t resume; // Where continue goes, the condition or the next value
+		int status{0};   // Of the last run of the body
+		std::vector<std::string> values{}; // What a for loop iterates over
+		size_t next{0};
+	};
+	std::vector<LoopFrame> loops;
+	std::string subject; // Of the case whose items are being matched
+	std::vector<std::string> fields;
+	std::string error;
+
+	const Instruction* code = program.code.data();
+	uint32_t size = static_cast<uint32_t>(program.code.size());
+	for (uint32_t pc = 0; pc < size;) {
+		const Instruction& instruction = code[pc];
+		switch (instruction.op) {
+			case Op::Run:
+				foregroundText = instruction.pipeline->text;
+				runPipeline(*instruction.pipeline);
+				// The shell does not see the ^C that went to the command's process group, it stops like bash
+				if (jobControl && lastExitStatus == 128 + SIGINT) {
+					loopControl = LoopControl::Interrupt;
+				}
+				++pc;
+				break;
+			case Op::Background:
+				runBackground(std::span<const ListItem>(instruction.items, instruction.target));
+				++pc;
+				break;
+			case Op::Jump:
+				pc = instruction.target;
+				continue;
+			case Op::JumpIfFailed:
+				pc = lastExitStatus != 0 ? instruction.target : pc + 1;
+				continue;
+			case Op::JumpIfSucceeded:
+				pc = lastExitStatus == 0 ? instruction.target : pc + 1;
+				continue;
+			case Op::Status:
+				lastExitStatus = static_cast<int>(instruction.target);
+				++pc;
+				continue;
+			case Op::Loop:
+				loops.push_back(LoopFrame{instruction.target, pc + 1});
+				++loopDepth;
+				++pc;
+				continue;
+			case Op::ForBegin: {
+				LoopFrame& loop = loops.emplace_back(LoopFrame{instruction.target, pc + 1});
+				++loopDepth;
+				if (!forValues(*instruction.command, loop.values)) {
+					loop.status = 1;
+				}
+				++pc;
+				continue;
+			}
+			case Op::ForNext: {
+				LoopFrame& loop = loops.back();
+				if (loop.next == loop.values.size()) {
+					pc = instruction.target;
+					continue;
+				}
+				assignVariable(instruction.command->name.text, loop.values[loop.next++]);
+				++pc;
+				continue;
+			}
+			case Op::Repeat:
+				loops.back().status = lastExitStatus;
+				pc = instruction.target;
+				continue;
+			case Op::LoopEnd:
+				lastExitStatus = loops.back().status;
+				loops.pop_back();
+				--loopDepth;
+				++pc;
+				continue;
+			case Op::Case: {
+				const Word& word = instruction.command->name;
+				fields.clear();
+				if (!word.expand) {
+					subject = word.text;
+				} else if (expandWord(word.text, fields, false, error)) {
+					subject = std::move(fields[0]);
+				} else {
+					shellOutput.flush();
+					writeAll(STDERR_FILENO, "shell: " + error + "\n");
+					lastExitStatus = 1;
+					pc = instruction.target;
+					continue;
+				}
+				++pc;
+				continue;
+			}
+			case Op::Match:
+				pc = caseItemMatches(*instruction.item, subject) ? instruction.target : pc + 1;
+				continue;
+			case Op::Define:
+				// The tree of a line parsed into a stack arena is gone once the line is done, the parser keeps
+				// lines that may define functions in memory of their own
+				functions[std::string(instruction.command->name.text)] = ShellFunction{activeTree, instruction.command};
+				lastExitStatus = 0;
+				++pc;
+				continue;
+		}
+
+		if (loopControl == LoopControl::None && !exitRequested) {
+			continue;
+		}
+		// return, exit and an interrupt leave every loop, a count of break or continue beyond the loops
+		// of this program goes on in the program that ran it
+		if (loopControl == LoopControl::Break || loopControl == LoopControl::Continue) {
+			for (; controlCount > 1 && !loops.empty(); --controlCount) {
+				loops.pop_back();
+				--loopDepth;
+			}
+		}
+		if (loops.empty() || exitRequested || loopControl == LoopControl::Return || loopControl == LoopControl::Interrupt) {
+			loopDepth -= static_cast<int>(loops.size());
+			return;
+		}
+		loops.back().status = 0;
+		pc = loopControl == LoopControl::Break ? loops.back().exit : loops.back().resume;
+		loopControl = LoopControl::None;
+	}
+}
+
+// Run a function with the arguments of the command as its positional parameters
+// Assignments in front of the call hold while it runs, and the redirections of its definition apply
+void callFunction(CommandData& commandData, const ShellFunction& called) {
+	if (functionDepth >= maxFunctionDepth) {
+		shellOutput.flush();
+		writeAll(STDERR_FILENO, std::string(commandData.command) + ": maximum function nesting level exceeded (" + std::to_string(maxFunctionDepth) + ")\n");
+		lastExitStatus = 1;
+		return;
+	}
+	// Redefining the function while it runs must not free its tree
+	ShellFunction function = called;
+	const CompoundCommand& definition = *function.definition;
+
+	std::vector<std::string> arguments;
+	for (const auto& word : commandData.words.subspan(1)) {
+		arguments.emplace_back(word.text);
+	}
+	std::swap(arguments, positionalParameters);
+	std::vector<std::pair<std::string, std::optional<std::string>>> savedVariables;
+	for (const auto& word : commandData.assignments) {
+		size_t equals = word.text.find('=');
+		std::string name(word.text.substr(0, equals));
+		const char* value = getVariable(name);
+		savedVariables.emplace_back(name, value ? std::optional<std::string>(value) : std::nullopt);
+		assignVariable(name, word.text.substr(equals + 1));
+	}
+	std::shared_ptr<const ParsedLine> callerTree = std::exchange(activeTree, function.tree);
+	int callerLoops = std::exchange(loopDepth, 0);
+	++functionDepth;
+
+	if (definition.redirections.empty()) {
+		runProgram(*definition.body->program);
+	} else {
+		SimpleCommand body(std::pmr::get_default_resource());
+		body.redirections.assign(definition.redirections.begin(), definition.redirections.end());
+		CommandData bodyData = commandFromAst(body);
+		RedirectionPlan redirections({STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO});
+		if (bodyData.expansionFailed || !planRedirections(bodyData, redirections)) {
+			lastExitStatus = 1;
+		} else {
+			ShellRedirection applied(redirections);
+			runProgram(*definition.body->program);
+		}
+	}
+	if (loopControl == LoopControl::Return) {
+		loopControl = LoopControl::None;
+	}
+
+	--functionDepth;
+	loopDepth = callerLoops;
+	activeTree = std::move(callerTree);
+	for (auto it = savedVariables.rbegin(); it != savedVariables.rend(); ++it) {
+		if (it->second) {
+			assignVariable(it->first, *it->second);
+		} else {
+			unsetVariable(it->first);
+			syncShellVariable(it->first);
+		}
+	}
+	positionalParameters = std::move(arguments);
+}
+
+// Run a compound command or call a function inside the shell, with the redirections of the command applied to it
+// A timed one is charged what the shell and the commands it waited for used meanwhile
+void runInShell(const SimpleCommand& simpleCommand, CommandData& commandData, const RedirectionPlan& redirections,
+	const ShellFunction* function, ResourceUsage* usage) {
+	struct rusage before[2]{};
+	if (usage) {
+		getrusage(RUSAGE_SELF, &before[0]);
+		getrusage(RUSAGE_CHILDREN, &before[1]);
+	}
+	{
+		ShellRedirection applied(redirections);
+		if (function) {
+			callFunction(commandData, *function);
+		} else {
+			runProgram(*simpleCommand.compound->program);
+		}
+	}
+	if (usage) {
+		struct rusage after[2]{};
+		getrusage(RUSAGE_SELF, &after[0]);
+		getrusage(RUSAGE_CHILDREN, &after[1]);
+		*usage = usageBetween(before[0], after[0]);
+		addUsage(*usage, usageBetween(before[1], after[1]));
+	}
+}
+
+LineInput* scriptInput = nullptr; // The input non-interactive lines come from, compound commands and here-documents continue in it
+
+// Read the next line of a compound command or here-document from wherever the line that started it came from
+bool readMoreInput(std::string& line) {
+	if (scriptInput) {
+		return readLine(*scriptInput, line);
+	}
+	if (!interactiveShell) {
+		return false;
+	}
+	char* buffer = readline("> ");
+	if (!buffer) {
+		return false;
+	}
+	line = buffer;
+	free(buffer);
+	return true;
+}
+
+// --------------------------------------------------------------
+// Command substitution
+// --------------------------------------------------------------
+
+// Read until the end of the file, used for the output of $(...)
+void readAll(int fd, std::string& output) {
+	char buffer[16 * 1024];
+	while (true) {
+		ssize_t bytes = read(fd, buffer, sizeof(buffer));
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes <= 0) {
+			return;
+		}
+		output.append(buffer, bytes);
+	}
+}
+
+// The command of a line that is nothing but a simple command, nullptr for anything else
+const SimpleCommand* singleCommand(const CommandList& list) {
+	if (list.items.size() == 1 && list.items[0].op != ListOp::Background) {
+		const Pipeline& pipeline = list.items[0].pipeline;
+		if (pipeline.commands.size() == 1 && !pipeline.negated && !pipeline.timed) {
+			return &pipeline.commands[0];
+		}
+	}
+	return nullptr;
+}
+
+// The pipeline of a line that is nothing but external commands, nullptr for anything else
+// A command name that comes from an expansion may turn out to be a builtin, it does not count
+const Pipeline* externalPipeline(const CommandList& list) {
+	if (list.items.size() != 1 || list.items[0].op == ListOp::Background) {
+		return nullptr;
+	}
+	const Pipeline& pipeline = list.items[0].pipeline;
+	bool external = !pipeline.negated && !pipeline.timed && !pipeline.commands.empty() &&
+		std::all_of(pipeline.commands.begin(), pipeline.commands.end(), [](const SimpleCommand& command) {
+			return !command.words.empty() && !command.words[0].expand && !findBuiltin(command.words[0].text) &&
+				!findFunction(command.words[0].text);
+		});
+	return external ? &pipeline : nullptr;
+}
+
+// Start the command of a $(...) with its stdout going into the pipe, returns the pids to wait for,
+// -1 for a stage that did not start
+// A pipeline of external commands is spawned directly, anything else runs in a copy of the shell
+// posix_spawn does not copy the shell's memory, so only the copy gets slower as the history grows
+std::vector<pid_t> startSubstitution(const CommandList& list, int outFd) {
+	if (const Pipeline* pipeline = externalPipeline(list)) {
+		size_t lastStage = pipeline->commands.size() - 1;
+		std::vector<pid_t> pids(pipeline->commands.size(), -1);
+		int input = STDIN_FILENO;
+		for (size_t i = 0; i <= lastStage; ++i) {
+			int pipeFds[2] = {-1, -1};
+			if (i < lastStage && pipe2(pipeFds, O_CLOEXEC) == -1) {
+				std::string message = std::string("shell: pipe: ") + std::strerror(errno) + "\n";
+				shellOutput.flush();
+				writeAll(STDERR_FILENO, message);
+				lastExitStatus = 1;
+				// The substitution fails as a whole, the stages already started are stopped and the caller reaps them
+				if (input != STDIN_FILENO) {
+					close(input);
+				}
+				for (pid_t pid : pids) {
+					if (pid != -1) {
+						kill(pid, SIGTERM);
+					}
+				}
+				break;
+			}
+			CommandData commandData = commandFromAst(pipeline->commands[i]);
+			RedirectionPlan redirections({input, i < lastStage ? pipeFds[1] : outFd, STDERR_FILENO});
+			std::string commandPath{};
+			if (commandData.expansionFailed || !planRedirections(commandData, redirections)) {
+				lastExitStatus = 1;
+			} else if (commandData.words.empty() || !searchPath(commandData, commandPath)) {
+				shellOutput.flush();
+				writeAll(redirections.source(STDERR_FILENO), std::string(commandData.command) + ": command not found\n");
+				lastExitStatus = 127;
+			} else if (int error = spawnCommand(commandPath, commandData, redirections, pids[i]); error != 0) {
+				shellOutput.flush();
+				writeAll(redirections.source(STDERR_FILENO), std::string(commandData.command) + ": " + std::strerror(error) + "\n");
+				lastExitStatus = 126;
+				pids[i] = -1;
+			}
+			if (input != STDIN_FILENO) {
+				close(input);
+			}
+			if (i < lastStage) {
+				close(pipeFds[1]);
+				input = pipeFds[0];
+			}
+		}
+		return pids;
+	}
+
+	shellOutput.flush();
+	syncInput();
+	pid_t pid = fork();
+	if (pid == -1) {
+		std::string message = std::string("shell: fork: ") + std::strerror(errno) + "\n";
+		shellOutput.flush();
+		writeAll(STDERR_FILENO, message);
+		lastExitStatus = 1;
+		return {};
+	}
+	if (pid == 0) {
+		dup2(outFd, STDOUT_FILENO);
+		// The subshell runs like a script, and must not move the offset of the shell's input
+		jobControl = false;
+		interactiveShell = false;
+		activeInput = nullptr;
+		jobTable = JobTable{};
+		executeList(list);
+		shellOutput.flush();
+		_exit(lastExitStatus);
+	}
+	return {pid};
+}
+
+// Run the command of a $(...) and return its output without the trailing newlines
+// A builtin on its own runs inside the shell and writes into a buffer, without a fork,
+// everything else is read from a pipe
+std::string commandSubstitution(std::string_view command) {
+	++substitutionCount;
+	ParseArena arena;
+	std::string error;
+	const CommandList* list = parseLine(command, arena, error);
+	if (!list) {
+		shellOutput.flush();
+		writeAll(STDERR_FILENO, "shell: " + error + "\n");
+		lastExitStatus = 2;
+		return {};
+	}
+
+	const SimpleCommand* single = singleCommand(*list);
+	std::string output;
+	BuiltinHandler handler = nullptr;
+	if (single && !single->words.empty() && !single->words[0].expand && single->redirections.empty() && single->assignments.empty() &&
+		!findFunction(single->words[0].text)) {
+		handler = findBuiltin(single->words[0].text);
+	}
+	if (handler) {
+		// Like in a subshell the builtin must not change the shell, exit and cd only report their status
+		CommandData commandData = commandFromAst(*single);
+		if (commandData.expansionFailed) {
+			lastExitStatus = 1;
+			return {};
+		}
+		commandData.subshell = true;
+		OutputSink capture(output);
+		lastExitStatus = runBuiltinCommand(commandData, handler, {STDIN_FILENO, -1, STDERR_FILENO}, capture);
+		capture.flush();
+	} else if (list->items.empty()) {
+		lastExitStatus = 0;
+	} else {
+		int pipeFds[2];
+		if (pipe2(pipeFds, O_CLOEXEC) == -1) {
+			std::string message = std::string("shell: pipe: ") + std::strerror(errno) + "\n";
+			shellOutput.flush();
+			writeAll(STDERR_FILENO, message);
+			lastExitStatus = 1;
+			return {};
+		}
+		std::vector<pid_t> pids = startSubstitution(*list, pipeFds[1]);
+		close(pipeFds[1]);
+		readAll(pipeFds[0], output);
+		close(pipeFds[0]);
+		// Like a pipeline the substitution reports the status of its last command
+		for (pid_t pid : pids) {
+			int status = 0;
+			if (pid == -1) {
+				continue;
+			}
+			while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+			}
+			if (pid == pids.back()) {
+				lastExitStatus = exitStatusFromWait(status);
+			}
+		}
+	}
+
+	while (!output.empty() && output.back() == '\n') {
+		output.pop_back();
+	}
+	return output;
+}
+
+// --------------------------------------------------------------
+// Function to handle the parallel builtin
+// --------------------------------------------------------------
+
+// Output of a job of parallel, kept in memory files until it is its turn to be written
+struct ParallelOutput {
+	int out{-1};
+	int err{-1};
+};
+
+// What the workers of one parallel call share
+// Parser, variables, hash table and the shell's output are not thread safe, shellLock lets one worker at a time use them
+struct ParallelRun {
+	std::string command{}; // The command template, {} stands for the input line
+	OutputSink* out{nullptr};
+	OutputSink* errors{nullptr};
+	bool keepOrder{false};
+	int jobInput{-1}; // The jobs read /dev/null, the input lines are for parallel
+	std::mutex shellLock;
+	std::map<size_t, ParallelOutput> finished{}; // Jobs done before the ones ahead of them, with -k
+	size_t nextOutput{0};
+	size_t failures{0};
+	std::atomic<bool> stopped{false}; // Nobody reads the output anymore, no more jobs are started
+};
+
+// Quote text so the parser reads it back as a single word, exactly as it is
+std::string quoteWord(std::string_view text) {
+	std::string quoted = "'";
+	for (char c : text) {
+		if (c == '\'') {
+			quoted += "'\\''";
+		} else {
+			quoted += c;
+		}
+	}
+	return quoted + "'";
+}
+
+// The command line of a job, every {} in the template replaced by the quoted input line
+// A template without {} gets the line as its last argument, like with xargs
+std::string parallelCommandLine(std::string_view command, std::string_view line) {
+	std::string quoted = quoteWord(line);
+	std::string result;
+	size_t pos = 0;
+	bool replaced = false;
+	for (size_t brace; (brace = command.find("{}", pos)) != std::string_view::npos; pos = brace + 2) {
+		result.append(command.substr(pos, brace - pos));
+		result += quoted;
+		replaced = true;
+	}
+	result.append(command.substr(pos));
+	if (!replaced) {
+		result += ' ';
+		result += quoted;
+	}
+	return result;
+}
+
+// Start the job of an input line with its stdout and stderr going into memory files
+// Returns the pid of the command, or -1 with status set if it ran inside the shell or did not start
+// The caller holds shellLock
+pid_t startParallelJob(ParallelRun& run, std::string_view line, ParallelOutput& output, int& status) {
+	output.out = memfd_create("parallel-stdout", MFD_CLOEXEC);
+	output.err = memfd_create("parallel-stderr", MFD_CLOEXEC);
+	if (output.out == -1 || output.err == -1) {
+		writeAll(run.errors->fd(), std::string("parallel: cannot buffer the output: ") + std::strerror(errno) + "\n");
+		status = 1;
+		return -1;
+	}
+
+	// The line is quoted, so it stays a single word and the template was checked to be a simple command
+	ParseArena arena;
+	std::string error;
+	std::string text = parallelCommandLine(run.command, line);
+	const CommandList* list = parseLine(text, arena, error);
+	const SimpleCommand* simpleCommand = list ? singleCommand(*list) : nullptr;
+	if (!simpleCommand) {
+		writeAll(output.err, "parallel: " + (list ? "the command has to be a simple command" : error) + "\n");
+		status = 2;
+		return -1;
+	}
+
+	CommandData commandData = commandFromAst(*simpleCommand);
+	RedirectionPlan redirections({run.jobInput, output.out, output.err});
+	if (commandData.expansionFailed || !planRedirections(commandData, redirections)) {
+		status = 1;
+		return -1;
+	}
+	if (commandData.words.empty()) {
+		status = 0;
+		return -1;
+	}
+	if (BuiltinHandler handler = findBuiltin(commandData.command)) {
+		// Like in a subshell the builtin must not change the shell, exit and cd only report their status
+		commandData.subshell = true;
+		std::array<int, 3> fds = redirections.standard();
+		OutputSink sink(fds[STDOUT_FILENO]);
+		status = runBuiltinCommand(commandData, handler, fds, sink);
+		sink.flush();
+		return -1;
+	}
+
+	std::string commandPath{};
+	pid_t pid = -1;
+	if (!searchPath(commandData, commandPath)) {
+		writeAll(redirections.source(STDERR_FILENO), std::string(commandData.command) + ": command not found\n");
+		status = 127;
+	} else if (int error = spawnCommand(commandPath, commandData, redirections, pid); error != 0) {
+		writeAll(redirections.source(STDERR_FILENO), std::string(commandData.command) + ": " + std::strerror(error) + "\n");
+		status = 126;
+		pid = -1;
+	}
+	return pid;
+}
+
+// Copy what a job wrote into one of its memory files to out
+void copyJobOutput(int fd, OutputSink& out) {
+	char buffer[16 * 1024];
+	off_t offset = 0;
+	ssize_t bytes;
+	while ((bytes = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+		out.write(std::string_view(buffer, bytes));
+		offset += bytes;
+	}
+}
+
+void closeJobOutput(ParallelOutput& output) {
+	for (int fd : {output.out, output.err}) {
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+	output = ParallelOutput{};
+}
+
+// Write the output of a finished job in one piece, stdout before stderr, the caller holds shellLock
+void writeJobOutput(ParallelRun& run, ParallelOutput& output) {
+	if (output.out != -1) {
+		copyJobOutput(output.out, *run.out);
+		run.out->flush();
+	}
+	if (output.err != -1) {
+		copyJobOutput(output.err, *run.errors);
+		run.errors->flush();
+	}
+	closeJobOutput(output);
+	if (run.out->failed()) {
+		run.stopped = true;
+	}
+}
+
+// Run jobs until the queue is empty, the shell is only used with shellLock held, never while a job runs
+void parallelWorker(ParallelRun& run, WorkStealingQueue& queue, size_t worker) {
+	ParallelInput input;
+	while (queue.pop(worker, input)) {
+		if (run.stopped) {
+			continue;
+		}
+		ParallelOutput output;
+		int status = 0;
+		pid_t pid = -1;
+		{
+			std::lock_guard<std::mutex> guard(run.shellLock);
+			pid = startParallelJob(run, input.line, output, status);
+		}
+		if (pid != -1) {
+			int waitStatus = 0;
+			while (waitpid(pid, &waitStatus, 0) == -1 && errno == EINTR) {
+			}
+			status = exitStatusFromWait(waitStatus);
+		}
+
+		std::lock_guard<std::mutex> guard(run.shellLock);
+		if (status != 0) {
+			++run.failures;
+		}
+		if (!run.keepOrder) {
+			writeJobOutput(run, output);
+			continue;
+		}
+		// With -k a job waits for the ones before it, the one that completes the sequence writes them all
+		run.finished.emplace(input.sequence, output);
+		for (auto it = run.finished.begin(); it != run.finished.end() && it->first == run.nextOutput; ++run.nextOutput) {
+			writeJobOutput(run, it->second);
+			it = run.finished.erase(it);
+		}
+	}
+}
+
+// parallel [-k] [-q] [-j jobs] [-a file] command [arguments...]
+// Runs the command for every line of stdin or the file, with {} replaced by the line or the line added at the end,
+// keeping up to jobs of them running at a time, one per core by default
+// The arguments are joined and parsed again for every job, so redirections and $ in quotes apply per job,
+// with -q they are quoted first and reach the command as they are
+// The output of a job is written in one piece once it is done, with -k in the order of the input lines
+// Returns the number of jobs that failed, at most 101, like GNU parallel
+int parallelBuiltin(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out) {
+	constexpr std::string_view usage = "parallel: usage: parallel [-k] [-q] [-j jobs] [-a file] command [arguments...]\n";
+	std::span<const Word> args = commandData.words.subspan(1);
+	size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+	bool keepOrder = false;
+	bool quote = false;
+	std::string inputFile;
+	while (!args.empty() && args[0].text.size() > 1 && args[0].text[0] == '-') {
+		std::string_view option = args[0].text;
+		args = args.subspan(1);
+		if (option == "--") {
+			break;
+		}
+		if (option == "-k" || option == "-q") {
+			(option == "-k" ? keepOrder : quote) = true;
+			continue;
+		}
+		// -j and -a take a value, -j also written together with it like -j4
+		std::string_view value = option.substr(2);
+		option = option.substr(0, 2);
+		if ((option != "-j" && option != "-a") || (value.empty() && args.empty())) {
+			writeAll(fds[STDERR_FILENO], usage);
+			return 2;
+		}
+		if (value.empty()) {
+			value = args[0].text;
+			args = args.subspan(1);
+		}
+		if (option == "-a") {
+			inputFile = value;
+			continue;
+		}
+		auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), jobs);
+		if (error != std::errc() || end != value.data() + value.size() || jobs == 0) {
+			writeAll(fds[STDERR_FILENO], "parallel: " + std::string(value) + ": invalid number of jobs\n");
+			return 2;
+		}
+	}
+	if (args.empty()) {
+		writeAll(fds[STDERR_FILENO], usage);
+		return 2;
+	}
+
+	ParallelRun run;
+	for (const auto& word : args) {
+		run.command += run.command.empty() ? "" : " ";
+		if (!quote) {
+			run.command += word.text;
+			continue;
+		}
+		// The parts around each {} are quoted on their own, so the line still replaces it
+		size_t pos = 0;
+		for (size_t brace; (brace = word.text.find("{}", pos)) != std::string_view::npos; pos = brace + 2) {
+			run.command += quoteWord(word.text.substr(pos, brace - pos)) + "{}";
+		}
+		run.command += quoteWord(word.text.substr(pos));
+	}
+	// Check the template once, so a mistake is reported once and not for every line
+	ParseArena arena;
+	std::string error;
+	std::string sample = parallelCommandLine(run.command, "");
+	const CommandList* list = parseLine(sample, arena, error);
+	if (!list || !singleCommand(*list)) {
+		writeAll(fds[STDERR_FILENO], "parallel: " + (list ? "the command has to be a simple command" : error) + "\n");
+		return 2;
+	}
+
+	LineInput input;
+	input.fd = fds[STDIN_FILENO];
+	if (!inputFile.empty()) {
+		input.fd = open(inputFile.c_str(), O_RDONLY | O_CLOEXEC);
+		if (input.fd == -1) {
+			writeAll(fds[STDERR_FILENO], "parallel: " + inputFile + ": " + std::strerror(errno) + "\n");
+			return 1;
+		}
+	} else if (activeInput && activeInput->fd == input.fd) {
+		// The lines are read from the shell's own input, starting where the shell is
+		syncInput();
+	}
+
+	OutputSink errors(fds[STDERR_FILENO]);
+	run.out = &out;
+	run.errors = &errors;
+	run.keepOrder = keepOrder;
+	run.jobInput = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	out.flush();
+
+	// The workers start on the first lines while the rest is still being read
+	WorkStealingQueue queue(jobs, jobs * 16);
+	{
+		std::vector<std::jthread> workers;
+		for (size_t worker = 0; worker < jobs; ++worker) {
+			workers.emplace_back([&run, &queue, worker] { parallelWorker(run, queue, worker); });
+		}
+		std::string line;
+		for (size_t sequence = 0; !run.stopped && readLine(input, line); ++sequence) {
+			queue.push({sequence, std::move(line)});
+		}
+		queue.close();
+	}
+
+	for (auto& [sequence, output] : run.finished) {
+		closeJobOutput(output);
+	}
+	if (!inputFile.empty()) {
+		close(input.fd);
+	}
+	if (run.jobInput != -1) {
+		close(run.jobInput);
+	}
+	return static_cast<int>(std::min<size_t>(run.failures, 101));
+}
+
+// Execute one line of input, returns false if the shell should exit
+LineCache lineCache; // Lines that are run again and again, by scripts, automation or !!, are parsed once
+
+bool executeLine(const std::string& input) {
+	std::string error;
+	// History expansion, like bash only interactively, the expanded line is shown before it runs
+	std::string expanded;
+	if (interactiveShell && input.find('!') != std::string::npos) {
+		if (!expandHistory(input, commandHistory, expanded, error)) {
+			shellOutput.flush();
+			writeAll(STDERR_FILENO, "shell: " + error + "\n");
+			return true;
+		}
+		if (expanded != input) {
+			shellOutput.write(expanded);
+			shellOutput.put('\n');
+			shellOutput.flush();
+		}
+	}
+	const std::string& line = expanded.empty() ? input : expanded;
+
+	// Add the command to the history
+	if (interactiveShell && line.find_first_not_of(" \t") != std::string::npos) {
+		AddToHistory(line);
+	}
+
+	// Collect background jobs that finished in the meantime
+	reapJobs();
+
+	// The tree of a typical line lives entirely in the arena's inline buffer, or in the cache if the line was run before
+	ParseArena arena;
+	std::shared_ptr<const ParsedLine> cached;
+	const CommandList* list = lineCache.parse(line, arena, error, readMoreInput, cached);
+	if (!list) {
+		shellOutput.flush();
+		writeAll(STDERR_FILENO, "shell: " + error + "\n");
+		lastExitStatus = 2;
+		return true;
+	}
+	std::shared_ptr<const ParsedLine> callerTree = std::exchange(activeTree, cached);
+	executeList(*list);
+	activeTree = std::move(callerTree);
+	loopControl = LoopControl::None;
+	return !exitRequested;
+}
+
+// Run every line of a script, a -c string or a piped stdin
+void runNonInteractive(LineInput& input) {
+	std::string line;
+	scriptInput = &input;
+	while (readLine(input, line)) {
+		if (!executeLine(line)) {
+			break;
+		}
+	}
+	scriptInput = nullptr;
+	shellOutput.flush();
+}
+
+// --------------------------------------------------------------
+// Interactive prompt driven by an event loop
+// --------------------------------------------------------------
+
+// SIGCHLD and SIGWINCH are blocked while the prompt waits and read from a signalfd instead,
+// commands run with them unblocked like before
+sigset_t promptSignals;
+bool promptDone = false;
+Timer* idleTimer = nullptr;
+constexpr auto idleDelay = std::chrono::milliseconds(250); // Quiet time at the prompt before deferred work runs
+
+// Work put off until the user is idle at the prompt, so it never delays the next command
+void runIdleWork() {
+	if (historyWriter.flushDue()) {
+		historyWriter.flush(commandHistory);
+	}
+	// PATH directories the last commands changed are read again before the next Tab needs them
+	if (!executableIndex.empty()) {
+		refreshExecutableIndex();
+	}
+}
+
+// Report jobs that finished while the prompt waits, then draw the prompt and the line typed so far again
+void notifyJobsAtPrompt() {
+	reapJobs();
+	if (std::none_of(jobTable.jobs().begin(), jobTable.jobs().end(), [](const auto& entry) { return hasJobNotice(entry.second); })) {
+		return;
+	}
+	// Readline writes through stdio, the line has to be gone before the notices are written
+	rl_clear_visible_line();
+	fflush(rl_outstream);
+	notifyJobs();
+	rl_forced_update_display();
+}
+
+// Called by readline with every complete line, nullptr at the end of the input
+// The handler is removed while the line runs, so a here-document can read its lines with readline
+void promptLineHandler(char* buffer) {
+	rl_callback_handler_remove();
+	if (!buffer) {
+		promptDone = true;
+		return;
+	}
+	std::string line = buffer;
+	free(buffer);
+	sigprocmask(SIG_UNBLOCK, &promptSignals, nullptr);
+	bool keepGoing = executeLine(line);
+	sigprocmask(SIG_BLOCK, &promptSignals, nullptr);
+	if (!keepGoing) {
+		promptDone = true;
+		return;
+	}
+	// The terminal may have been resized while the command ran
+	rl_reset_screen_size();
+	notifyJobs();
+	rl_callback_handler_install("$ ", promptLineHandler);
+	idleTimer->arm(idleDelay);
+}
+
+// Read and run commands until the end of the input or exit
+// Keys, signals and timers are all waited for with epoll, so job notices and deferred work
+// like history writes happen while the user is idle, not between Enter and the command
+void runInteractive() {
+	sigemptyset(&promptSignals);
+	sigaddset(&promptSignals, SIGCHLD);
+	sigaddset(&promptSignals, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &promptSignals, nullptr);
+	int signalFd = signalfd(-1, &promptSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+	Timer timer;
+	idleTimer = &timer;
+	historyWriter.setDeferred(true);
+	rl_catch_sigwinch = 0;
+
+	EventLoop loop;
+	bool keysWatched = loop.watch(STDIN_FILENO, [] {
+		rl_callback_read_char();
+		idleTimer->arm(idleDelay);
+	});
+	loop.watch(signalFd, [signalFd] {
+		struct signalfd_siginfo info;
+		bool resized = false;
+		while (read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+			if (info.ssi_signo == SIGCHLD) {
+				childStateChanged = 1;
+			} else {
+				resized = true;
+			}
+		}
+		if (resized) {
+			rl_resize_terminal();
+		}
+		notifyJobsAtPrompt();
+	});
+	loop.watch(timer.fd(), [] {
+		if (idleTimer->expired()) {
+			runIdleWork();
+		}
+	});
+
+	notifyJobs();
+	rl_callback_handler_install("$ ", promptLineHandler);
+	while (!promptDone) {
+		// Input epoll cannot wait for, like a regular file, is simply read key by key
+		if (!keysWatched) {
+			rl_callback_read_char();
+		} else if (!loop.runOnce()) {
+			break;
+		}
+	}
+	if (!promptDone) {
+		rl_callback_handler_remove();
+	}
+
+	historyWriter.setDeferred(false);
+	idleTimer = nullptr;
+	close(signalFd);
+	sigprocmask(SIG_UNBLOCK, &promptSignals, nullptr);
+}
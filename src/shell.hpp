@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+#include "history.hpp"
+#include "output.hpp"
+#include "parser.hpp"
+#include "timing.hpp"
+
+// --------------------------------------------------------------
+// Shell core, everything but main(), shared with the benchmarks
+// --------------------------------------------------------------
+
+// Words and redirections of a command after expansion, they point into text
+// A deque, so adding text never moves what the words already point to
+struct ExpandedCommand {
+	std::deque<std::string> text{};
+	std::vector<Word> assignments{};
+	std::vector<Word> words{};
+	std::vector<Redirection> redirections{};
+};
+
+// A simple command ready to be executed, the words and redirections point into the parsed line,
+// or into expansion if the command had anything to expand
+struct CommandData {
+	std::span<const Word> assignments{}; // NAME=value, only in the environment of an external command
+	std::span<const Word> words{}; // The command name followed by its arguments
+	std::span<const Redirection> redirections{};
+	std::string_view command{};
+    bool commandExecuted{false};
+	bool subshell{false}; // Builtin stages of a pipeline, except the last one, must not change the shell's state
+	bool expansionFailed{false}; // An expansion was malformed, the error has been reported and the command must not run
+	int substitutionStatus{-1}; // Exit status of the last $(...) in the command, -1 if there was none
+	ResourceUsage* usage{nullptr}; // Filled in with the resources the command used when its pipeline is timed
+	std::unique_ptr<ExpandedCommand> expansion{};
+};
+
+// A builtin gets its arguments and the stdin, stdout and stderr it ends up with after redirections,
+// writes its normal output to out, which streams to its stdout, and returns its exit status
+using BuiltinHandler = int (*)(CommandData& commandData, const std::array<int, 3>& fds, OutputSink& out);
+
+// Input of a script, a -c string or a piped stdin
+struct LineInput {
+	int fd{-1};
+	std::vector<char> buffer = std::vector<char>(64 * 1024);
+	size_t start{0};
+	size_t end{0};
+	bool eof{false};
+	// Shared stdin that syncInput cannot seek back is only read up to the next newline
+	// A pipe is peeked at through peekPipe with tee(2), anything else is read one byte at a time like bash does
+	bool lineReads{false};
+	std::array<int, 2> peekPipe{-1, -1};
+};
+
+extern HistoryStore commandHistory;
+extern OutputSink shellOutput;
+extern std::string PATH;
+extern int lastExitStatus;
+extern pid_t lastBackgroundPid;
+extern bool interactiveShell;
+extern bool timeEveryPipeline;
+extern LineInput* activeInput;
+extern std::vector<std::string> positionalParameters;
+extern std::string shellName;
+
+// Command lookup and completion
+bool hashLookup(const std::string& name, std::string& foundPath, bool countHit = true);
+bool searchPath(const CommandData& commandData, std::string& foundPath);
+void resetHashTable();
+char* commandGenerator(const char* text, int state);
+char* argumentGenerator(const char* text, int state);
+char** commandCompletion(const char* text, int start, int end);
+
+// Write the whole buffer, stopping early if the reader went away
+void writeAll(int fd, std::string_view data);
+
+// Builtins, findBuiltin returns nullptr for names that are not builtins
+BuiltinHandler findBuiltin(std::string_view name);
+int runBuiltinCommand(CommandData& commandData, BuiltinHandler handler, const std::array<int, 3>& fds, OutputSink& out);
+
+// History
+void AddToHistory(const std::string& command);
+void initLineEditing();
+void loadHistoryOnStartup();
+void saveHistoryOnExit();
+
+// Job control, notifyJobs reports finished and stopped jobs before a prompt
+void initJobs();
+void notifyJobs();
+
+// Variables, assignVariable also updates the copy the shell keeps of PATH
+void assignVariable(std::string_view name, std::string_view value);
+
+// Input and execution
+void runInteractive();
+CommandData commandFromAst(const SimpleCommand& simpleCommand);
+std::string commandSubstitution(std::string_view command);
+void runPipes(const Pipeline& pipeline, std::vector<ResourceUsage>* usages, bool background = false);
+bool executeLine(const std::string& line);
+void runNonInteractive(LineInput& input);
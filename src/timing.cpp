@@ -0,0 +1,113 @@
+#include "timing.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+
+double seconds(const struct timeval& time) {
+	return time.tv_sec + time.tv_usec / 1e6;
+}
+
+// A number of seconds with the given number of decimals, in the long form 1m2.345s if asked for
+std::string formatSeconds(double value, int precision, bool longForm) {
+	char buffer[64];
+	if (longForm) {
+		long minutes = static_cast<long>(value / 60);
+		std::snprintf(buffer, sizeof(buffer), "%ldm%.*fs", minutes, precision, value - minutes * 60.0);
+	} else {
+		std::snprintf(buffer, sizeof(buffer), "%.*f", precision, value);
+	}
+	return buffer;
+}
+
+} // namespace
+
+ResourceUsage usageFromRusage(const struct rusage& usage) {
+	ResourceUsage result{};
+	result.user = seconds(usage.ru_utime);
+	result.system = seconds(usage.ru_stime);
+	result.maxRss = usage.ru_maxrss;
+	result.voluntarySwitches = usage.ru_nvcsw;
+	result.involuntarySwitches = usage.ru_nivcsw;
+	return result;
+}
+
+ResourceUsage usageBetween(const struct rusage& before, const struct rusage& after) {
+	ResourceUsage result = usageFromRusage(after);
+	result.user -= seconds(before.ru_utime);
+	result.system -= seconds(before.ru_stime);
+	result.voluntarySwitches -= before.ru_nvcsw;
+	result.involuntarySwitches -= before.ru_nivcsw;
+	return result;
+}
+
+void addUsage(ResourceUsage& total, const ResourceUsage& stage) {
+	total.user += stage.user;
+	total.system += stage.system;
+	total.maxRss = std::max(total.maxRss, stage.maxRss);
+	total.voluntarySwitches += stage.voluntarySwitches;
+	total.involuntarySwitches += stage.involuntarySwitches;
+}
+
+double secondsBetween(const struct timespec& start, const struct timespec& end) {
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+std::string formatUsage(std::string_view format, const ResourceUsage& usage) {
+	std::string output;
+	for (size_t i = 0; i < format.size(); ++i) {
+		if (format[i] != '%' || i + 1 == format.size()) {
+			output += format[i];
+			continue;
+		}
+
+		// %[p][l]X, p is the number of decimals from 0 to 3 and l selects the long form
+		size_t start = i++;
+		int precision = 3;
+		bool longForm = false;
+		if (format[i] >= '0' && format[i] <= '9') {
+			precision = std::min(format[i++] - '0', 3);
+		}
+		if (i < format.size() && format[i] == 'l') {
+			longForm = true;
+			++i;
+		}
+		if (i == format.size()) {
+			output += format.substr(start);
+			break;
+		}
+
+		switch (format[i]) {
+			case 'R':
+				output += formatSeconds(usage.real, precision, longForm);
+				break;
+			case 'U':
+				output += formatSeconds(usage.user, precision, longForm);
+				break;
+			case 'S':
+				output += formatSeconds(usage.system, precision, longForm);
+				break;
+			case 'P':
+				output += formatSeconds(usage.real > 0 ? (usage.user + usage.system) * 100 / usage.real : 0, std::min(precision, 2), false);
+				break;
+			case 'M':
+				output += std::to_string(usage.maxRss);
+				break;
+			case 'w':
+				output += std::to_string(usage.voluntarySwitches);
+				break;
+			case 'c':
+				output += std::to_string(usage.involuntarySwitches);
+				break;
+			case '%':
+				output += '%';
+				break;
+			default:
+				// Unknown conversions are copied as they are
+				output += format.substr(start, i - start + 1);
+				break;
+		}
+	}
+	return output;
+}
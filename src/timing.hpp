@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <sys/resource.h>
+#include <time.h>
+
+// --------------------------------------------------------------
+// Resource accounting for the time keyword
+// --------------------------------------------------------------
+
+// Resources used by a pipeline or one of its stages
+struct ResourceUsage {
+	double real{0};   // Seconds of wall clock time
+	double user{0};   // Seconds of CPU time in user mode
+	double system{0}; // Seconds of CPU time in the kernel
+	long maxRss{0};   // Peak resident set size in KiB
+	long voluntarySwitches{0};
+	long involuntarySwitches{0};
+};
+
+// Usage as reported by wait4 or getrusage, without the wall clock time
+ResourceUsage usageFromRusage(const struct rusage& usage);
+
+// What the process used between two getrusage calls, the peak RSS is the later one
+ResourceUsage usageBetween(const struct rusage& before, const struct rusage& after);
+
+// Add the usage of a stage to the usage of its pipeline, the peak RSS is the largest one
+void addUsage(ResourceUsage& total, const ResourceUsage& stage);
+
+// Seconds between two CLOCK_MONOTONIC readings
+double secondsBetween(const struct timespec& start, const struct timespec& end);
+
+// The format bash uses when TIMEFORMAT is unset
+inline constexpr std::string_view defaultTimeFormat = "\nreal\t%3lR\nuser\t%3lU\nsys\t%3lS";
+
+// The format of time -p
+inline constexpr std::string_view posixTimeFormat = "real %2R\nuser %2U\nsys %2S";
+
+// Expand a TIMEFORMAT string
+// Supports bash's %[p][l]R, %[p][l]U, %[p][l]S and %P, plus %M for the peak RSS in KiB,
+// %w for voluntary and %c for involuntary context switches like GNU time, and %%
+std::string formatUsage(std::string_view format, const ResourceUsage& usage);
@@ -0,0 +1,66 @@
+#include "variables.hpp"
+
+#include <cstdlib>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+// Lets the tables be searched with a string_view, without building a string first
+struct NameHash {
+	using is_transparent = void;
+	size_t operator()(std::string_view name) const { return std::hash<std::string_view>{}(name); }
+};
+
+std::unordered_map<std::string, std::string, NameHash, std::equal_to<>> shellVariables;
+std::unordered_set<std::string, NameHash, std::equal_to<>> pendingExports; // Exported before they were set
+
+} // namespace
+
+bool isVariableName(std::string_view name) {
+	if (name.empty() || (name[0] >= '0' && name[0] <= '9')) {
+		return false;
+	}
+	for (char c : name) {
+		if (c != '_' && !(c >= 'a' && c <= 'z') && !(c >= 'A' && c <= 'Z') && !(c >= '0' && c <= '9')) {
+			return false;
+		}
+	}
+	return true;
+}
+
+const char* getVariable(std::string_view name) {
+	auto variable = shellVariables.find(name);
+	if (variable != shellVariables.end()) {
+		return variable->second.c_str();
+	}
+	return getenv(std::string(name).c_str());
+}
+
+void setVariable(std::string_view name, std::string_view value) {
+	std::string key(name);
+	if (getenv(key.c_str()) || pendingExports.erase(key)) {
+		setenv(key.c_str(), std::string(value).c_str(), 1);
+		return;
+	}
+	shellVariables.insert_or_assign(std::move(key), std::string(value));
+}
+
+void exportVariable(std::string_view name) {
+	std::string key(name);
+	auto variable = shellVariables.find(key);
+	if (variable != shellVariables.end()) {
+		setenv(key.c_str(), variable->second.c_str(), 1);
+		shellVariables.erase(variable);
+	} else if (!getenv(key.c_str())) {
+		pendingExports.insert(std::move(key));
+	}
+}
+
+void unsetVariable(std::string_view name) {
+	std::string key(name);
+	shellVariables.erase(key);
+	pendingExports.erase(key);
+	unsetenv(key.c_str());
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// --------------------------------------------------------------
+// Shell variables
+// --------------------------------------------------------------
+
+// Exported variables live in the environment of the shell, so the commands it starts inherit
+// them through environ and getenv sees them. The others are kept in a table of the shell.
+
+// The value of a variable, nullptr if it is not set
+// The pointer is valid until the variable is changed
+const char* getVariable(std::string_view name);
+
+// Set a variable, it stays exported if it already was
+void setVariable(std::string_view name, std::string_view value);
+
+// Move a variable into the environment, a variable that is not set is exported once it is
+void exportVariable(std::string_view name);
+
+void unsetVariable(std::string_view name);
+
+// Names start with a letter or an underscore, followed by letters, digits and underscores
+bool isVariableName(std::string_view name);